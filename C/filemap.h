@@ -0,0 +1,157 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; An open file mapped read-only, so AH=21h is a memcpy() out of the page
+; cache (which every process with the file open shares) rather than an
+; fseek() and fread().  next is where the next record would be if the
+; guest is reading in order, and ahead how far we've asked the kernel to
+; bring in already.  Both msdos and msdos_fixes keep one for each file
+; opened by FCB.
+;
+; Touching a page of the map past the end of the file is SIGBUS, and the
+; file can be cut short under us (AH=16h on another FCB, AH=3Ch, AH=40h
+; with CX=0, or some other process), so every read checks the size first
+; and the map is dropped once the file is smaller than it.
+;---------------------------------------------------------------------*/
+
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define FILEMAP_AHEAD	0x10000	/* bytes to prefetch once records go in order */
+
+typedef struct filemap
+{
+  const unsigned char *data;
+  size_t               size;
+  int                  fd;
+  size_t               next;
+  size_t               ahead;
+  char                 name[FILENAME_MAX];
+  unsigned long long   hits;
+  unsigned long long   misses;
+  unsigned long long   bytes;
+  unsigned long long   readaheads;
+} filemap__s;
+
+/********************************************************************/
+
+static inline void filemap_open(filemap__s *map,int fd,const char *name)
+{
+  struct stat  info;
+  void        *data;
+  
+  memset(map,0,sizeof(filemap__s));
+  snprintf(map->name,sizeof(map->name),"%s",name);
+  map->fd = fd;
+  
+  /* an empty (or new) file has nothing to map; it's read the old way */
+  if ((fstat(fd,&info) < 0) || (info.st_size == 0))
+    return;
+  
+  data = mmap(NULL,info.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if (data == MAP_FAILED)
+    return;
+  
+  /* Racter jumps all over; we'll do the read-ahead when it doesn't */
+  madvise(data,info.st_size,MADV_RANDOM);
+  map->data = data;
+  map->size = info.st_size;
+}
+
+static inline void filemap_stats(const filemap__s *map,FILE *fp)
+{
+  if (map->hits + map->misses > 0)
+    fprintf(
+      fp,
+      "file %-12s  %llu hits, %llu misses, %llu bytes, %llu read-aheads\n",
+      map->name,
+      map->hits,
+      map->misses,
+      map->bytes,
+      map->readaheads
+    );
+}
+
+static inline void filemap_close(filemap__s *map)
+{
+  if (map->data != NULL)
+    munmap((void *)map->data,map->size);
+  memset(map,0,sizeof(filemap__s));
+}
+
+/*---------------------------------------------------------------------
+; Copy a record out of the map.  Returns false if it's not all in there
+; (a short last record, the file has grown since it was opened, or it
+; has shrunk and the map is gone) so it has to be read for real.
+;---------------------------------------------------------------------*/
+
+static inline bool filemap_read(filemap__s *map,unsigned char *buf,size_t pos,size_t len)
+{
+  struct stat info;
+  
+  if ((map->data != NULL) && ((fstat(map->fd,&info) < 0) || ((size_t)info.st_size < map->size)))
+  {
+    munmap((void *)map->data,map->size);
+    map->data = NULL;
+    map->size = 0;
+  }
+  
+  if ((map->data == NULL) || (pos > map->size) || (len > map->size - pos))
+  {
+    map->misses++;
+    return false;
+  }
+  
+  memcpy(buf,&map->data[pos],len);
+  map->hits++;
+  map->bytes += len;
+  
+  /*---------------------------------------------------------------------
+  ; Two records in a row, and the end of what's been prefetched is close:
+  ; ask for the next FILEMAP_AHEAD bytes.
+  ;---------------------------------------------------------------------*/
+  
+  if ((pos == map->next) && (pos + len + FILEMAP_AHEAD / 2 > map->ahead) && (map->ahead < map->size))
+  {
+    size_t start = ((map->ahead > pos) ? map->ahead : pos) & ~(size_t)4095;
+    size_t end   = (start + FILEMAP_AHEAD < map->size) ? start + FILEMAP_AHEAD : map->size;
+    
+    madvise((void *)&map->data[start],end - start,MADV_WILLNEED);
+    map->ahead = end;
+    map->readaheads++;
+  }
+  
+  map->next = pos + len;
+  return true;
+}
+
+#endif
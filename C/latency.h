@@ -0,0 +1,189 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; Turn latency, for --latency.  A turn starts when the guest is handed
+; the first byte of its input and ends when it writes the CR LF > of its
+; next prompt.  Of that, I/O is time spent reading and writing the
+; console, blocked is time waiting on the rest of the input, and guest
+; is the rest---running it, DOS calls and all.
+;
+; Each goes into a histogram with LATENCY_SUB buckets to every power of
+; two of nanoseconds (an HDR histogram to about 3%), so a percentile
+; costs nothing to keep and little to find.
+;---------------------------------------------------------------------*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_BITS	5
+#define LATENCY_SUB	(1 << LATENCY_BITS)
+#define LATENCY_BUCKETS	((64 - LATENCY_BITS + 1) * LATENCY_SUB)
+
+enum
+{
+  LATENCY_TOTAL,
+  LATENCY_GUEST,
+  LATENCY_IO,
+  LATENCY_BLOCKED,
+  LATENCY_PARTS
+};
+
+typedef struct latency
+{
+  bool     turn;	/* between the input and the prompt */
+  uint64_t start;
+  uint64_t io;
+  uint64_t blocked;
+  uint64_t turns;
+  uint64_t max [LATENCY_PARTS];
+  uint64_t hist[LATENCY_PARTS][LATENCY_BUCKETS];
+} latency__s;
+
+/********************************************************************/
+
+static inline uint64_t latency_now(void)
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1000000000uLL + ts.tv_nsec;
+}
+
+/* below 2 * LATENCY_SUB exactly, then LATENCY_SUB steps a power of two */
+static inline int latency_bucket(uint64_t ns)
+{
+  int shift;
+  
+  if (ns < 2 * LATENCY_SUB)
+    return ns;
+  shift = 63 - __builtin_clzll(ns) - LATENCY_BITS;
+  return (shift + 1) * LATENCY_SUB + (int)(ns >> shift) - LATENCY_SUB;
+}
+
+/* the largest value that lands in a bucket */
+static inline uint64_t latency_value(int bucket)
+{
+  int shift;
+  
+  if (bucket < 2 * LATENCY_SUB)
+    return bucket;
+  shift = bucket / LATENCY_SUB - 1;
+  return ((uint64_t)(bucket % LATENCY_SUB + LATENCY_SUB + 1) << shift) - 1;
+}
+
+/********************************************************************/
+
+static inline void latency_begin(latency__s *lat)
+{
+  if (!lat->turn)
+  {
+    lat->turn    = true;
+    lat->start   = latency_now();
+    lat->io      = 0;
+    lat->blocked = 0;
+  }
+}
+
+static inline void latency_end(latency__s *lat)
+{
+  uint64_t part[LATENCY_PARTS];
+  
+  if (!lat->turn)
+    return;
+  
+  lat->turn              = false;
+  part[LATENCY_TOTAL]    = latency_now() - lat->start;
+  part[LATENCY_IO]       = lat->io;
+  part[LATENCY_BLOCKED]  = lat->blocked;
+  part[LATENCY_GUEST]    = (lat->io + lat->blocked < part[LATENCY_TOTAL])
+                         ? part[LATENCY_TOTAL] - lat->io - lat->blocked
+                         : 0;
+  
+  lat->turns++;
+  for (int i = 0 ; i < LATENCY_PARTS ; i++)
+  {
+    lat->hist[i][latency_bucket(part[i])]++;
+    if (part[i] > lat->max[i])
+      lat->max[i] = part[i];
+  }
+}
+
+/* time spent on the console while a turn is going */
+static inline void latency_io(latency__s *lat,uint64_t ns)
+{
+  if (lat->turn)
+    lat->io += ns;
+}
+
+static inline void latency_blocked(latency__s *lat,uint64_t ns)
+{
+  if (lat->turn)
+    lat->blocked += ns;
+}
+
+/********************************************************************/
+
+static inline uint64_t latency_percentile(const latency__s *lat,int part,double pct)
+{
+  uint64_t want = (uint64_t)(lat->turns * pct / 100.0 + 0.5);
+  uint64_t seen = 0;
+  
+  if (want == 0)
+    want = 1;
+  for (int b = 0 ; b < LATENCY_BUCKETS ; b++)
+  {
+    seen += lat->hist[part][b];
+    if (seen >= want)
+      return (latency_value(b) < lat->max[part]) ? latency_value(b) : lat->max[part];
+  }
+  return lat->max[part];
+}
+
+static inline void latency_write(const latency__s *lat,FILE *fp)
+{
+  static const char *name[LATENCY_PARTS] = { "turn" , "guest" , "I/O" , "blocked" };
+  
+  fprintf(fp,"latency:       %llu turns\n",(unsigned long long)lat->turns);
+  if (lat->turns == 0)
+    return;
+  
+  fprintf(fp,"  %-23s %8s %8s %8s %8s\n","ms","p50","p90","p99","max");
+  
+  for (int i = 0 ; i < LATENCY_PARTS ; i++)
+    fprintf(
+      fp,
+      "  %-23s %8.3f %8.3f %8.3f %8.3f\n",
+      name[i],
+      latency_percentile(lat,i,50.0) / 1e6,
+      latency_percentile(lat,i,90.0) / 1e6,
+      latency_percentile(lat,i,99.0) / 1e6,
+      lat->max[i] / 1e6
+    );
+}
+
+#endif
@@ -0,0 +1,5429 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+* Modified 2025 for better pipe communication
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; The portable emulator, as a library (see libmsdos.h).  Each VM is a
+; system__s of its own with the guest's memory, CPU and block cache, and
+; the console is a pair of buffers, so there can be as many of them in
+; a process as there is memory for.
+;---------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libmsdos.h"
+#include "filemap.h"
+#include "overlay.h"
+#include "profile.h"
+
+#define SEG_ENV		0x1000
+#define SEG_PSP		0x2000
+#define SEG_LOAD	0x2010
+
+#define MEM_ENV		(SEG_ENV  * 16)
+#define MEM_PSP		(SEG_PSP  * 16)
+#define MEM_LOAD	(SEG_LOAD * 16)
+
+#define IDLE_POLLS	64	/* empty console polls before we block */
+#define OUT_MAX		4096	/* output waiting before VM_OUTPUT */
+#define MEM_SIZE	0x110000	/* 1M plus the HMA */
+#define MEM_WRAP	0xFFFFF		/* address mask with A20 off */
+#define MEM_A20		0x1FFFFF	/* ... and on (FFFF:FFFF is 10FFEF) */
+#define HANDLES		20		/* handles a DOS process gets */
+#define HANDLE_PATH	128		/* longest path 3Ch/3Dh/41h take */
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#  error "the register views and word accesses assume a little-endian host"
+#endif
+
+/********************************************************************/
+
+typedef struct fcbs	/* short FCB block */
+{
+  char     drive;
+  char     name[8];
+  char     ext[3];
+  uint16_t cblock;
+  uint16_t recsize;
+} __attribute__((packed)) fcbs__s;
+
+typedef struct fcb
+{
+  char     drive;
+  char     name[8];
+  char     ext[3];
+  uint16_t cblock;
+  uint16_t recsize;
+  uint32_t size;
+  uint16_t date;
+  uint16_t time;
+  uint16_t rsvp0;
+  uint8_t  crecnum;
+  uint32_t relrec;
+} fcb__s;
+
+typedef struct psp
+{
+  uint8_t  warmboot[2];		/* 0xCD, 0x20 */
+  uint16_t last_seg;
+  uint8_t  rsvp0;
+  uint8_t  oldmscall_jmp;	/* 0x9A, offlo, offhi, seglo, seghi */
+  uint16_t oldmscall_off;
+  uint16_t oldmscall_seg;
+  uint16_t termaddr[2];
+  uint16_t ctrlcaddr[2];
+  uint16_t erroraddr[2];
+  uint8_t  rsvp1[22];
+  uint16_t envp;
+  uint8_t  rsvp2[34];
+  uint8_t  mscall[3];		/* 0xCD , 0x21 , 0xCB */
+  uint8_t  rsvp3[9];
+  fcbs__s  primary;
+  fcbs__s  secondary;
+  uint8_t  rsvp[4];
+  uint8_t  cmdlen;
+  uint8_t  cmd[127];
+} __attribute__((packed)) psp__s;
+
+typedef struct exehdr
+{
+  uint8_t  magic[2];	/* 0x4D, 0x5A */
+  uint16_t lastpagesize;
+  uint16_t filepages;
+  uint16_t numreloc;
+  uint16_t hdrpara;
+  uint16_t minalloc;
+  uint16_t maxalloc;
+  uint16_t init_ss;
+  uint16_t init_sp;
+  uint16_t chksum;
+  uint16_t init_ip;
+  uint16_t init_cs;
+  uint16_t reltable;
+  uint16_t overlay;
+} __attribute__((packed)) exehdr__s;
+
+/*---------------------------------------------------------------------
+; A file opened by handle---what DOS calls a system file table entry.
+; 45h/46h give another handle to the same one, file position and all.
+; The position is ours rather than the kernel's, so a read or write is
+; one pread() or pwrite() and nothing is buffered, and a child after
+; fork() can carry on with the descriptors it shares with its parent.
+; fd is -1 for the console, which handles 0 to 2 start out on.
+;---------------------------------------------------------------------*/
+
+typedef struct dosfile
+{
+  int      fd;
+  int      mode;	/* 0 read, 1 write, 2 both, as 3Dh has it */
+  uint32_t pos;
+  unsigned refs;
+  char     name[HANDLE_PATH];
+} dosfile__s;
+
+/* Enhanced x86 registers structure, in ModR/M order (see gpr__u) */
+typedef struct x86_regs {
+  uint32_t eax, ecx, edx, ebx;
+  uint32_t esp, ebp, esi, edi;
+  uint32_t eip;
+  uint32_t eflags;
+  uint16_t es, cs, ss, ds, fs, gs;
+} x86_regs;
+
+typedef struct system
+{
+  x86_regs                regs;
+  unsigned char          *mem;
+  fcb__s                 *fcbs[16];
+  FILE                   *fp[16];
+  filemap__s              maps[16];
+  vfile__s               *vf[16];		/* or NULL if it's fp[] */
+  
+  /* vm_base()'s directory, or -1, and the files written over it */
+  int                     base;
+  vfile__s               *overlay;
+  dosfile__s             *handles[HANDLES];
+  dosfile__s              con;
+  dosfile__s              conerr;
+  uint16_t                dtaseg;
+  uint16_t                dtaoff;
+  
+  /* Racter prompt detection */
+  bool input;
+  char prompt[4];
+  bool running;
+  
+  /* Console input from vm_feed(), and whether that's all there is */
+  char  *in;
+  size_t in_len;
+  size_t in_pos;
+  size_t in_alloc;
+  bool   eof;
+  
+  /* Empty AH=06h polls since the guest last read or wrote anything */
+  unsigned idle_polls;
+  
+  /* Console output for vm_drain() */
+  char  *out;
+  size_t out_len;
+  size_t out_alloc;
+  size_t out_max;
+  
+  /*---------------------------------------------------------------------
+  ; startup is true until the guest first asks for input, and everything
+  ; written until then is kept for vm_save() and vm_forked().
+  ;---------------------------------------------------------------------*/
+  
+  bool    startup;
+  char   *transcript;
+  size_t  transcript_len;
+  size_t  transcript_max;
+  
+  /* Why vm_run() is coming back before its budget is up */
+  bool         stop;
+  vm_reason__e reason;
+  int          exit_code;
+  
+  /* Debug mode */
+  bool debug;
+  
+  /* Guest instructions retired */
+  unsigned long long icount;
+  
+  /*---------------------------------------------------------------------
+  ; The clock (see clock_now()).  clock_polls counts clock reads since the
+  ; guest last did anything else, and tick_next is the instruction count
+  ; when the BIOS tick at 0040:006C is next due to change.  clock_zone is
+  ; seconds east of UTC, if a recording has pinned it (clock_fixed).
+  ;---------------------------------------------------------------------*/
+  
+  bool               realtime;
+  bool               clock_fixed;
+  long               clock_zone;
+  unsigned long long clock_base;
+  unsigned long long clock_skip;
+  unsigned long long clock_skips;
+  unsigned           clock_polls;
+  unsigned long long tick_next;
+  int                clock_day;
+  
+  /*---------------------------------------------------------------------
+  ; The INT 21h trace (see vm_trace() and trace.h).  moved is what the
+  ; call being made has read or written.
+  ;---------------------------------------------------------------------*/
+  
+  trace_ring__s      trace;
+  uint32_t           moved;
+  
+  /* --metrics, and when the guest started waiting on input */
+  metrics__s        *metrics;
+  unsigned long long blocked_since;
+  
+  /* --record and --replay (see vm_record()), and inputs replayed */
+  FILE              *record;
+  FILE              *replay;
+  unsigned long long replayed;
+  
+  /* --latency, and when vm_run() last came back, and why */
+  latency__s        *latency;
+  uint64_t           lat_mark;
+  bool               lat_waiting;
+  
+  /* The profiler's table of stacks (see profile_sample()) */
+  prof_table__s      prof;
+  unsigned long long prof_period;
+  unsigned long long prof_next;
+  uint32_t           prof_seed;
+  
+  /* Address mask: 0xFFFFF wraps at 1M like an 8086; with the A20 line
+     enabled the HMA is reachable */
+  size_t amask;
+  
+  /* Decoded block cache for the software CPU */
+  struct bcache *cache;
+  
+  /* Last flag-setting operation; while op != 0 the arithmetic flags in
+     regs.eflags are stale and get worked out from this when read */
+  struct
+  {
+    uint8_t  op;
+    bool     w;
+    uint16_t d;
+    uint16_t s;
+    uint16_t r;
+    uint16_t c;
+  } lazy;
+  
+  /* Translate hot blocks to native code, optionally checking every one */
+  bool jit;
+  bool lockstep;
+  struct journal *journal;
+} system__s;
+
+static void bcache_invalidate(system__s *,size_t,size_t);
+static void journal_add(struct journal *,size_t,uint8_t,uint8_t);
+
+/********************************************************************/
+
+/* The first reason to stop wins; the rest of the block still runs */
+static void vm_stop(system__s *sys,vm_reason__e reason)
+{
+  if (!sys->stop)
+  {
+    sys->stop   = true;
+    sys->reason = reason;
+  }
+}
+
+/********************************************************************/
+
+static inline uint16_t get_word(unsigned char *mem, size_t offset)
+{
+  uint16_t value;
+  memcpy(&value, &mem[offset], sizeof(value));
+  return value;
+}
+
+static inline void set_word(unsigned char *mem, size_t offset, uint16_t value)
+{
+  memcpy(&mem[offset], &value, sizeof(value));
+}
+
+static inline uint32_t get_dword(unsigned char *mem, size_t offset)
+{
+  uint32_t value;
+  memcpy(&value, &mem[offset], sizeof(value));
+  return value;
+}
+
+static inline void set_dword(unsigned char *mem, size_t offset, uint32_t value)
+{
+  memcpy(&mem[offset], &value, sizeof(value));
+}
+
+static inline size_t seg_off_to_linear(uint16_t seg, uint16_t off)
+{
+  return ((size_t)seg * 16) + off;
+}
+
+/********************************************************************/
+
+static void mkfilename(char *fname, fcb__s *fcb)
+{
+  int i;
+  int c;
+  
+  for(i = 0 , c = 0 ; (i < 8) && (fcb->name[i] != ' ') ; i++ , c++)
+    fname[c] = fcb->name[i];
+    
+  if (fcb->ext[0] != ' ')
+  {
+    fname[c++] = '.';
+    for(i = 0 ; (i < 3) && (fcb->ext[i] != ' ') ; i++ , c++)
+      fname[c] = fcb->ext[i];
+  }
+  
+  fname[c] = '\0';
+}
+
+/********************************************************************/
+
+static int find_fcb(system__s *sys, fcb__s *fcb)
+{
+  for (size_t i = 0 ; i < 16 ; i++)
+    if (sys->fcbs[i] == fcb)
+      return i;
+  return -1;
+}
+
+/*---------------------------------------------------------------------
+; With vm_base(), the guest's files come from that directory and what it
+; creates, writes or deletes stays in the VM (see overlay.h), so VMs
+; started from the same program don't write over each other's files.
+; It's taken by each VM when it's made.
+;---------------------------------------------------------------------*/
+
+static int g_base = -1;
+
+int vm_base(const char *dir)
+{
+  if (g_base != -1)
+    close(g_base);
+  g_base = -1;
+  if (dir == NULL)
+    return 0;
+  
+  g_base = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (g_base == -1)
+  {
+    perror(dir);
+    return -1;
+  }
+  return 0;
+}
+
+static FILE *file_open(system__s *sys, const char *name)
+{
+  FILE *fp;
+  int   fd;
+  
+  if (sys->base == -1)
+  {
+    fp = fopen(name, "r+b");
+    if (fp == NULL)
+      fp = fopen(name, "rb");
+    return fp;
+  }
+  
+  fd = openat(sys->base, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  fp = fdopen(fd, "rb");
+  if (fp == NULL)
+    close(fd);
+  return fp;
+}
+
+/* the guest is about to write to a file from the base directory */
+static bool vfile_copyup(system__s *sys, int idx)
+{
+  vfile__s *vf = vfile_new(&sys->overlay, sys->maps[idx].name);
+  
+  if ((vf == NULL) || !vfile_fill(vf, fileno(sys->fp[idx])))
+    return false;
+  
+  fclose(sys->fp[idx]);
+  filemap_close(&sys->maps[idx]);
+  sys->fp[idx] = NULL;
+  sys->vf[idx] = vf;
+  return true;
+}
+
+/* an FCB's slot is free again */
+static void fcb_close(system__s *sys, int idx)
+{
+  if (sys->fp[idx] != NULL)
+  {
+    fclose(sys->fp[idx]);
+    filemap_close(&sys->maps[idx]);
+  }
+  sys->fcbs[idx] = NULL;
+  sys->fp[idx]   = NULL;
+  sys->vf[idx]   = NULL;
+}
+
+/********************************************************************/
+
+static int open_file(system__s *sys, fcb__s *fcb, bool create)
+{
+  char      fname[13];
+  vfile__s *vf = NULL;
+  int       idx;
+  int       i;
+  
+  mkfilename(fname, fcb);
+  
+  /* made again while it's still open: that one goes first */
+  idx = create ? find_fcb(sys, fcb) : -1;
+  if (idx >= 0)
+    fcb_close(sys, idx);
+  else
+  {
+    for (i = 0 ; i < 16 ; i++)
+      if (sys->fcbs[i] == NULL)
+        break;
+    if (i == 16)
+      return 255;
+    idx = i;
+  }
+  
+  if (sys->base != -1)
+  {
+    vf = create ? vfile_new(&sys->overlay, fname) : vfile_find(sys->overlay, fname);
+    if ((vf == NULL) && create)
+      return 255;
+    if ((vf != NULL) && vf->deleted)
+      return 255;
+  }
+  
+  if (vf != NULL)
+    sys->vf[idx] = vf;
+  else
+  {
+    sys->fp[idx] = create ? fopen(fname, "w+b") : file_open(sys, fname);
+    if (sys->fp[idx] == NULL)
+      return 255;
+  }
+  
+  sys->fcbs[idx] = fcb;
+  fcb->cblock    = 0;
+  fcb->crecnum   = 0;
+  fcb->recsize   = 128;
+  
+  if (vf != NULL)
+    fcb->size = vf->size;
+  else if (!create)
+  {
+    struct stat buf;
+    fstat(fileno(sys->fp[idx]), &buf);
+    fcb->size = buf.st_size;
+  }
+  else
+    fcb->size = 0;
+    
+  fcb->drive = 3;  /* C: drive */
+  if (sys->fp[idx] != NULL)
+    filemap_open(&sys->maps[idx], fileno(sys->fp[idx]), fname);
+  return 0;
+}
+
+/*---------------------------------------------------------------------
+; AH=21h and 22h: the record at relrec, to or from the DTA.  A read
+; comes out of the file's map if it can.  Returns what goes in AL: 1 for
+; no record there (or the disk is full, for a write), 2 if the record
+; won't fit in memory at the DTA, 3 for a short last record (the rest of
+; it zeros).
+;---------------------------------------------------------------------*/
+
+static int fcb_record(system__s *sys, int handle, fcb__s *fcb, bool write)
+{
+  size_t         dta  = seg_off_to_linear(sys->dtaseg, sys->dtaoff);
+  size_t         len  = fcb->recsize;
+  size_t         pos  = (size_t)fcb->relrec * len;
+  unsigned char *buf  = &sys->mem[dta];
+  int            rc   = 0;
+  
+  if ((len == 0) || (dta + len > MEM_SIZE))
+    return 2;
+  
+  fcb->cblock  = fcb->relrec / 128;
+  fcb->crecnum = fcb->relrec % 128;
+  
+  if (write)
+  {
+    if ((sys->base != -1) && (sys->vf[handle] == NULL) && !vfile_copyup(sys, handle))
+      return 1;
+    
+    if (sys->vf[handle] != NULL)
+    {
+      if (!vfile_write(sys->vf[handle], buf, pos, len))
+        return 1;
+    }
+    else if ((fseek(sys->fp[handle], pos, SEEK_SET) != 0) || (fwrite(buf, 1, len, sys->fp[handle]) != len))
+    {
+      clearerr(sys->fp[handle]);
+      return 1;
+    }
+    else
+      fflush(sys->fp[handle]);	/* so the map sees it */
+    
+    if (pos + len > fcb->size)
+      fcb->size = pos + len;
+  }
+  else
+  {
+    if (pos >= fcb->size)
+      return 1;
+    if (fcb->size - pos < len)
+    {
+      rc  = 3;
+      len = fcb->size - pos;
+      memset(buf + len, 0, fcb->recsize - len);
+    }
+    if (sys->vf[handle] != NULL)
+    {
+      len = vfile_read(sys->vf[handle], buf, pos, len);
+      memset(buf + len, 0, fcb->recsize - len);
+    }
+    else if (!filemap_read(&sys->maps[handle], buf, pos, len))
+    {
+      /* it may have been cut short since it was opened */
+      fseek(sys->fp[handle], pos, SEEK_SET);
+      len = fread(buf, 1, len, sys->fp[handle]);
+      memset(buf + len, 0, fcb->recsize - len);
+    }
+    bcache_invalidate(sys, dta, fcb->recsize);
+  }
+  
+  /* DOS leaves relrec alone, but Racter needs it moved on (see msdos.c) */
+  fcb->relrec++;
+  sys->moved = len;
+  return rc;
+}
+
+/********************************************************************/
+
+static int dos_error(int err)
+{
+  switch(err)
+  {
+    case ENOENT:  return 0x02;	/* file not found */
+    case ENOTDIR: return 0x03;	/* path not found */
+    case EMFILE:
+    case ENFILE:  return 0x04;	/* too many open files */
+    case EBADF:   return 0x06;	/* invalid handle */
+    default:      return 0x05;	/* access denied */
+  }
+}
+
+static void dos_fail(system__s *sys,int code)
+{
+  sys->regs.eax     = code;
+  sys->regs.eflags |= 0x01;	/* Set CF */
+}
+
+static void dos_done(system__s *sys,uint16_t ax)
+{
+  sys->regs.eax     = ax;
+  sys->regs.eflags &= ~0x01;	/* Clear CF */
+}
+
+/*---------------------------------------------------------------------
+; The ASCIIZ path at DS:DX as a host path: no drive, and '/' for '\'.
+;---------------------------------------------------------------------*/
+
+static bool dos_path(system__s *sys,char *path)
+{
+  size_t addr = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+  size_t max  = (MEM_SIZE - addr < HANDLE_PATH) ? MEM_SIZE - addr : HANDLE_PATH;
+  size_t len  = strnlen((char *)&sys->mem[addr], max);
+  
+  if ((len == 0) || (len == max))
+    return false;
+  
+  if ((len >= 2) && (sys->mem[addr + 1] == ':'))
+  {
+    addr += 2;
+    len  -= 2;
+  }
+  
+  for (size_t i = 0 ; i <= len ; i++)
+    path[i] = (sys->mem[addr + i] == '\\') ? '/' : sys->mem[addr + i];
+  return true;
+}
+
+/********************************************************************/
+
+static dosfile__s *handle_get(system__s *sys,unsigned handle)
+{
+  return (handle < HANDLES) ? sys->handles[handle] : NULL;
+}
+
+/* the lowest free handle for f, or -1 */
+static int handle_new(system__s *sys,dosfile__s *f)
+{
+  for (int i = 0 ; i < HANDLES ; i++)
+  {
+    if (sys->handles[i] == NULL)
+    {
+      sys->handles[i] = f;
+      f->refs++;
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void handle_close(system__s *sys,unsigned handle)
+{
+  dosfile__s *f = sys->handles[handle];
+  
+  sys->handles[handle] = NULL;
+  if ((--f->refs == 0) && (f->fd != -1))
+  {
+    close(f->fd);
+    free(f);
+  }
+}
+
+static dosfile__s *dosfile_open(int dir,const char *path,int mode,bool create)
+{
+  static const int flags[3] = { O_RDONLY , O_WRONLY , O_RDWR };
+  
+  dosfile__s *f = calloc(1, sizeof(dosfile__s));
+  
+  if (f == NULL)
+    return NULL;
+  
+  f->mode = mode;
+  f->fd   = openat(dir, path, flags[mode] | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0666);
+  if (f->fd == -1)
+  {
+    int err = errno;
+    free(f);
+    errno = err;
+    return NULL;
+  }
+  
+  snprintf(f->name, sizeof(f->name), "%s", path);
+  return f;
+}
+
+static int handle_open(system__s *sys,const char *path,int mode,bool create)
+{
+  dosfile__s *f;
+  int         handle;
+  
+  /* the overlay only has FCB files; the base directory is read-only */
+  if ((sys->base != -1) && (create || (mode != 0)))
+    return -0x05;
+  
+  f = dosfile_open((sys->base != -1) ? sys->base : AT_FDCWD, path, mode, create);
+  if (f == NULL)
+    return -dos_error(errno);
+  
+  handle = handle_new(sys, f);
+  if (handle == -1)
+  {
+    close(f->fd);
+    free(f);
+    return -0x04;
+  }
+  return handle;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; The program loader.  The whole file comes in with one read(), and an
+; EXE's relocation table is applied straight out of that.
+;
+; With vm_image_cache(), an EXE relocated for SEG_LOAD is also kept in a
+; file named for a hash of the EXE's contents, as the guest pages it
+; takes up from MEM_PSP on.  The next load of the same EXE maps those
+; MAP_PRIVATE over guest memory instead, so every VM started from it
+; shares the page cache until it writes to a page.
+;---------------------------------------------------------------------*/
+
+#define IMG_MAGIC	"MSDOSIMG"
+#define IMG_VERSION	1
+#define IMG_ALIGN	4096
+
+typedef struct imgcache
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t base;	/* the segment it was relocated for */
+  uint64_t hash;
+  uint64_t exesize;
+  uint64_t size;	/* bytes of guest memory from MEM_PSP */
+} imgcache__s;
+
+static const char *g_image_cache;
+
+void vm_image_cache(const char *dir)
+{
+  g_image_cache = dir;
+}
+
+static uint64_t image_hash(const unsigned char *data,size_t size)
+{
+  uint64_t h = 0x9E3779B97F4A7C15uLL ^ size;
+  uint64_t w;
+  size_t   i;
+  
+  for (i = 0 ; i + 8 <= size ; i += 8)
+  {
+    memcpy(&w,&data[i],8);
+    h  = (h ^ w) * 0xFF51AFD7ED558CCDuLL;
+    h ^= h >> 32;
+  }
+  
+  for ( ; i < size ; i++)
+  {
+    h  = (h ^ data[i]) * 0xFF51AFD7ED558CCDuLL;
+    h ^= h >> 32;
+  }
+  
+  return h;
+}
+
+static bool image_load(system__s *sys,uint64_t hash,size_t exesize)
+{
+  char         path[FILENAME_MAX];
+  imgcache__s  img;
+  struct stat  info;
+  bool         ok;
+  int          fd;
+  
+  snprintf(path,sizeof(path),"%s/%016llx.img",g_image_cache,(unsigned long long)hash);
+  fd = open(path,O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  
+  ok =    (pread(fd,&img,sizeof(img),0) == sizeof(img))
+       && (memcmp(img.magic,IMG_MAGIC,sizeof(img.magic)) == 0)
+       && (img.version == IMG_VERSION)
+       && (img.base    == SEG_LOAD)
+       && (img.hash    == hash)
+       && (img.exesize == exesize)
+       && (img.size    <= MEM_SIZE - MEM_PSP)
+       && (img.size % IMG_ALIGN == 0)
+       && (fstat(fd,&info) == 0)
+       && ((uint64_t)info.st_size >= IMG_ALIGN + img.size)
+       && (mmap(&sys->mem[MEM_PSP],img.size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_FIXED,fd,IMG_ALIGN) != MAP_FAILED);
+  
+  close(fd);
+  return ok;
+}
+
+/* written to a temporary name and renamed, so nobody maps half of one */
+static void image_save(system__s *sys,uint64_t hash,size_t exesize,size_t size)
+{
+  static const char zero[IMG_ALIGN];
+  
+  char         path[FILENAME_MAX];
+  char         tmp[FILENAME_MAX + 16];
+  imgcache__s  img;
+  FILE        *fp;
+  
+  memset(&img,0,sizeof(img));
+  memcpy(img.magic,IMG_MAGIC,sizeof(img.magic));
+  img.version = IMG_VERSION;
+  img.base    = SEG_LOAD;
+  img.hash    = hash;
+  img.exesize = exesize;
+  img.size    = size;
+  
+  snprintf(path,sizeof(path),"%s/%016llx.img",g_image_cache,(unsigned long long)hash);
+  snprintf(tmp,sizeof(tmp),"%s.%ld",path,(long)getpid());
+  
+  fp = fopen(tmp,"wb");
+  if (fp == NULL)
+  {
+    perror(tmp);
+    return;
+  }
+  
+  fwrite(&img,sizeof(img),1,fp);
+  fwrite(zero,1,IMG_ALIGN - sizeof(img),fp);
+  fwrite(&sys->mem[MEM_PSP],1,size,fp);
+  
+  if ((fclose(fp) == EOF) || (rename(tmp,path) == -1))
+  {
+    perror(path);
+    unlink(tmp);
+  }
+}
+
+/********************************************************************/
+
+static int load_exe(system__s *sys,const unsigned char *exe,size_t exesize)
+{
+  unsigned char *mem = sys->mem;
+  exehdr__s      hdr;
+  size_t         offset;
+  size_t         binsize;
+  size_t         numreloc;
+  size_t         end;
+  uint64_t       hash = 0;
+  
+  memcpy(&hdr,exe,sizeof(hdr));
+  offset = hdr.hdrpara * 16;
+  
+  if (hdr.lastpagesize == 0)
+    binsize = hdr.filepages * 512;
+  else
+    binsize = (hdr.filepages - 1) * 512 + hdr.lastpagesize;
+  
+  /* a header that claims more than the file has gets what there is */
+  if (binsize > exesize)
+    binsize = exesize;
+  if ((binsize < offset) || (binsize - offset > MEM_SIZE - MEM_LOAD) || (hdr.reltable > exesize))
+    return EXIT_FAILURE;
+  binsize  -= offset;
+  numreloc  = hdr.numreloc;
+  if (numreloc > (exesize - hdr.reltable) / 4)
+    numreloc = (exesize - hdr.reltable) / 4;
+  
+  if (g_image_cache != NULL)
+  {
+    hash = image_hash(exe,exesize);
+    if (image_load(sys,hash,exesize))
+      return EXIT_SUCCESS;
+  }
+  
+  memcpy(&mem[MEM_LOAD],&exe[offset],binsize);
+  end = MEM_LOAD + binsize;
+  
+  for (size_t i = 0 ; i < numreloc ; i++)
+  {
+    uint16_t off[2];
+    size_t   where;
+    
+    memcpy(off,&exe[hdr.reltable + i * 4],sizeof(off));
+    where = MEM_LOAD + off[0] + off[1] * 16;
+    if (where + 2 > MEM_SIZE)
+      continue;
+    set_word(mem,where,get_word(mem,where) + SEG_LOAD);
+    if (where + 2 > end)
+      end = where + 2;
+  }
+  
+  if (g_image_cache != NULL)
+    image_save(sys,hash,exesize,(end - MEM_PSP + IMG_ALIGN - 1) & ~(size_t)(IMG_ALIGN - 1));
+  
+  return EXIT_SUCCESS;
+}
+
+/********************************************************************/
+
+static int load_program(
+        const char       *fname,
+        system__s        *sys
+)
+{
+  unsigned char *mem  = sys->mem;
+  x86_regs      *regs = &sys->regs;
+  unsigned char *file;
+  exehdr__s      hdr;
+  size_t         size;
+  size_t         i;
+  psp__s        *psp;
+  struct stat    st;
+  ssize_t        bytes;
+  int            fd;
+  
+  assert(fname != NULL);
+  assert(regs  != NULL);
+  
+  fd = open(fname,O_RDONLY | O_CLOEXEC);
+  if ((fd == -1) || (fstat(fd,&st) == -1))
+  {
+    fprintf(stderr,"open(\"%s\") = %s\n",fname,strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return EXIT_FAILURE;
+  }
+  
+  file = malloc(st.st_size + 1);
+  if (file == NULL)
+  {
+    perror("malloc()");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  
+  for (size = 0 ; size < (size_t)st.st_size ; size += bytes)
+  {
+    bytes = read(fd,&file[size],st.st_size - size);
+    if (bytes <= 0)
+      break;
+  }
+  close(fd);
+  
+  memset(regs, 0, sizeof(x86_regs));
+  regs->ds     = SEG_PSP;
+  regs->es     = SEG_PSP;
+  regs->eflags = 0x0200; /* Interrupts enabled */
+  
+  if ((size >= sizeof(hdr)) && (file[0] == 0x4D) && (file[1] == 0x5A))
+  {
+    /* EXE file; this goes first, as a cached image takes the PSP's page */
+    if (load_exe(sys,file,size) != EXIT_SUCCESS)
+    {
+      fprintf(stderr,"%s: bad EXE header\n",fname);
+      free(file);
+      return EXIT_FAILURE;
+    }
+    
+    memcpy(&hdr,file,sizeof(hdr));
+    regs->cs  = SEG_LOAD + hdr.init_cs;
+    regs->eip = hdr.init_ip;
+    regs->ss  = SEG_LOAD + hdr.init_ss;
+    regs->esp = hdr.init_sp;
+  }
+  else
+  {
+    /* COM file - load at offset 0x100 in PSP segment */
+    if (size > 65536 - 256)
+    {
+      fprintf(stderr,"%s: COM file too large\n",fname);
+      free(file);
+      return EXIT_FAILURE;
+    }
+    
+    memcpy(&mem[MEM_PSP + 0x100], file, size);
+    regs->cs  = SEG_PSP;
+    regs->ss  = SEG_PSP;
+    regs->eip = 0x100;  /* COM files start at offset 0x100 */
+    regs->esp = 0xFFFE; /* Stack at top of segment */
+    
+    /* A RET from the program returns to PSP:0000, which is INT 20h */
+    set_word(mem, MEM_PSP + 0xFFFE, 0x0000);
+  }
+  
+  free(file);
+  
+  memset(&mem[MEM_ENV],0,256);
+  psp = (psp__s *)&mem[MEM_PSP];
+  
+  memset(psp,0,256);
+  psp->warmboot[0]   = 0xCD;
+  psp->warmboot[1]   = 0x20;
+  psp->oldmscall_jmp = 0x9A;
+  psp->oldmscall_off = offsetof(psp__s,mscall);
+  psp->oldmscall_seg = SEG_PSP;
+  psp->termaddr[0]   = 129;
+  psp->termaddr[1]   = SEG_PSP;
+  psp->ctrlcaddr[0]  = 130;
+  psp->ctrlcaddr[1]  = SEG_PSP;
+  psp->erroraddr[0]  = 131;
+  psp->erroraddr[1]  = SEG_PSP;
+  psp->envp          = SEG_ENV;
+  psp->mscall[0]     = 0xCD;
+  psp->mscall[1]     = 0x21;
+  psp->mscall[2]     = 0xCB;
+  
+  /* Dummy interrupt handlers */
+  mem[MEM_PSP + 129] = 0xCF; /* IRET */
+  mem[MEM_PSP + 130] = 0xCF; /* IRET */
+  mem[MEM_PSP + 131] = 0xCF; /* IRET */
+  
+  /* Until the program hooks them, every vector points to an IRET */
+  for (i = 0 ; i < 256 ; i++)
+  {
+    set_word(mem, i * 4,     129);
+    set_word(mem, i * 4 + 2, SEG_PSP);
+  }
+  
+  /* Set up DTA (Disk Transfer Area) */
+  sys->dtaseg = SEG_PSP;
+  sys->dtaoff = 0x80;
+  
+  return EXIT_SUCCESS;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Console output.  Whatever the guest writes piles up in sys->out until
+; the caller takes it with vm_drain().  vm_run() comes back early with
+; VM_OUTPUT when the Racter prompt shows up (couch.lua waits on it) or
+; once out_max bytes are waiting, so it can be passed on.
+;
+; Everything written before the guest first asks for input is also kept
+; in the transcript, which vm_save() and vm_forked() replay.
+;---------------------------------------------------------------------*/
+
+static void grow(char **buf,size_t *max,size_t need)
+{
+  if (need <= *max)
+    return;
+  
+  *max = (need < 256) ? 512 : need * 2;
+  *buf = realloc(*buf,*max);
+  if (*buf == NULL)
+  {
+    perror("realloc()");
+    exit(3);
+  }
+}
+
+static void out_write(system__s *sys,const char *data,size_t size)
+{
+  grow(&sys->out,&sys->out_alloc,sys->out_len + size);
+  memcpy(&sys->out[sys->out_len],data,size);
+  sys->out_len += size;
+  
+  if (sys->startup)
+  {
+    grow(&sys->transcript,&sys->transcript_max,sys->transcript_len + size);
+    memcpy(&sys->transcript[sys->transcript_len],data,size);
+    sys->transcript_len += size;
+  }
+  
+  if ((size > 0) && (sys->out_len >= sys->out_max))
+    vm_stop(sys,VM_OUTPUT);
+}
+
+static void out_putc(system__s *sys,char c)
+{
+  out_write(sys,&c,1);
+}
+
+/********************************************************************/
+
+static void handle_prompt_detection(system__s *sys, char c)
+{
+  /* Handle Racter prompt detection */
+  memmove(&sys->prompt[0], &sys->prompt[1], 3);
+  sys->prompt[3] = c;
+  sys->idle_polls = 0;
+  
+  if (sys->prompt[1] == '\r' && sys->prompt[2] == '\n' && sys->prompt[3] == '>')
+  {
+    sys->input = true;
+    vm_stop(sys,VM_OUTPUT);
+    if (sys->latency != NULL)
+      latency_end(sys->latency);
+    if (sys->metrics != NULL)
+    {
+      metrics_add(&sys->metrics->turns,1);
+      metrics_set(&sys->metrics->prompt,1);
+    }
+  }
+  else if (c == '\r')
+  {
+    sys->input = false;
+    if (sys->metrics != NULL)
+      metrics_set(&sys->metrics->prompt,0);
+  }
+}
+
+/********************************************************************/
+
+/* the guest's first byte of input starts the clock on a turn */
+static void latency_input(system__s *sys)
+{
+  if (sys->latency != NULL)
+    latency_begin(sys->latency);
+}
+
+static int read_buffered_input(system__s *sys)
+{
+  if (sys->in_pos < sys->in_len)
+  {
+    latency_input(sys);
+    return (unsigned char)sys->in[sys->in_pos++];
+  }
+  return -1;
+}
+
+/*---------------------------------------------------------------------
+; Nothing queued for a call that has to wait.  Back the guest up over the
+; INT 21h so it makes the same call again, and have vm_run() return so
+; the caller can go and get some input.
+;---------------------------------------------------------------------*/
+
+static void wait_buffered_input(system__s *sys)
+{
+  sys->regs.eip = (sys->regs.eip - 2) & 0xFFFF;
+  vm_stop(sys,VM_NEED_INPUT);
+}
+
+/*---------------------------------------------------------------------
+; Whole strings and lines for AH=09h, 0Ah and handles 3Fh/40h.  A string
+; is one memcpy() into the output buffer, and a line one out of the input
+; queue.  The callers have made sure there's something to read (or that
+; there's never going to be).
+;---------------------------------------------------------------------*/
+
+static void console_write(system__s *sys,const char *data,size_t size)
+{
+  out_write(sys,data,size);
+  for (size_t i = 0 ; i < size ; i++)
+    handle_prompt_detection(sys,data[i]);
+}
+
+static size_t console_read(system__s *sys,char *data,size_t size)
+{
+  size_t n = sys->in_len - sys->in_pos;
+  
+  if (n > size)
+    n = size;
+  if (n > 0)
+    latency_input(sys);
+  memcpy(data,&sys->in[sys->in_pos],n);
+  sys->in_pos += n;
+  return n;
+}
+
+static bool console_have_line(system__s *sys)
+{
+  return sys->eof
+      || (memchr(&sys->in[sys->in_pos],'\r',sys->in_len - sys->in_pos) != NULL)
+      || (memchr(&sys->in[sys->in_pos],'\n',sys->in_len - sys->in_pos) != NULL);
+}
+
+static size_t console_read_line(system__s *sys,char *line,size_t max)
+{
+  char   *p     = &sys->in[sys->in_pos];
+  size_t  avail = sys->in_len - sys->in_pos;
+  size_t  n     = 0;
+  size_t  len;
+  
+  /* max counts the CR that ends the line; anything past it is dropped */
+  if (max == 0)
+    return 0;
+  if (avail > 0)
+    latency_input(sys);
+  
+  while ((n < avail) && (p[n] != '\r') && (p[n] != '\n'))
+    n++;
+  
+  len          = (n < max - 1) ? n : max - 1;
+  memcpy(line,p,len);
+  sys->in_pos += n;
+  
+  if (n < avail)
+  {
+    /* CR, LF or CR LF all end it */
+    sys->in_pos++;
+    if ((p[n] == '\r') && (n + 1 < avail) && (p[n + 1] == '\n'))
+      sys->in_pos++;
+  }
+  
+  line[len] = '\r';
+  out_write(sys,line,len);
+  return len;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Snapshots.  Racter spends a while loading and reading its vocabulary
+; before it says anything worth answering, so a VM can be saved the first
+; time the guest asks for console input and later restored from there.
+; Guest memory goes at the end, page aligned, so it can be mapped
+; MAP_PRIVATE and shared between every session started from the same
+; snapshot.  The transcript is kept too, and is waiting in the output of
+; a restored VM.
+;
+; The guest's IP has already been backed up over the INT 21h, so a
+; restored session makes the input call again.
+;---------------------------------------------------------------------*/
+
+#define SNAP_MAGIC	"MSDOSCPU"
+#define SNAP_VERSION	2
+#define SNAP_ALIGN	4096
+
+typedef struct snapshot
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t memsize;
+  uint64_t memoff;
+  uint32_t outlen;
+  x86_regs regs;
+  uint16_t dtaseg;
+  uint16_t dtaoff;
+  bool     input;
+  char     prompt[4];
+  struct
+  {
+    int32_t  fcb;	/* offset in guest memory, -1 if unused */
+    char     name[13];
+    int64_t  pos;
+  } files[16];
+  struct
+  {
+    int8_t   same;	/* earlier handle this is a duplicate of, or -1 */
+    int8_t   type;	/* 0 closed, 1 console, 2 stderr, 3 file */
+    int8_t   mode;
+    uint32_t pos;
+    char     name[HANDLE_PATH];
+  } handles[HANDLES];
+} snapshot__s;
+
+int vm_save(vm__s *sys,const char *fname)
+{
+  static const char zero[SNAP_ALIGN];
+  
+  snapshot__s  snap;
+  FILE        *fp;
+  size_t       pad;
+  
+  /* a snapshot only has the names of files; it can't bring the copies */
+  if (sys->overlay != NULL)
+  {
+    fprintf(stderr,"%s: the guest changed files while starting up\n",fname);
+    return -1;
+  }
+  
+  memset(&snap,0,sizeof(snap));
+  memcpy(snap.magic,SNAP_MAGIC,sizeof(snap.magic));
+  snap.version = SNAP_VERSION;
+  snap.memsize = MEM_SIZE;
+  snap.outlen  = sys->transcript_len;
+  snap.regs    = sys->regs;
+  snap.dtaseg  = sys->dtaseg;
+  snap.dtaoff  = sys->dtaoff;
+  snap.input   = sys->input;
+  memcpy(snap.prompt,sys->prompt,sizeof(snap.prompt));
+  
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    snap.files[i].fcb = -1;
+    if ((sys->fcbs[i] != NULL) && (sys->fp[i] != NULL))
+    {
+      snap.files[i].fcb = (unsigned char *)sys->fcbs[i] - sys->mem;
+      snap.files[i].pos = ftell(sys->fp[i]);
+      mkfilename(snap.files[i].name,sys->fcbs[i]);
+    }
+  }
+  
+  for (int i = 0 ; i < HANDLES ; i++)
+  {
+    dosfile__s *f = sys->handles[i];
+    
+    snap.handles[i].same = -1;
+    if (f == NULL)
+      continue;
+    
+    for (int j = 0 ; j < i ; j++)
+    {
+      if (sys->handles[j] == f)
+      {
+        snap.handles[i].same = j;
+        break;
+      }
+    }
+    
+    snap.handles[i].type = (f == &sys->con) ? 1 : (f == &sys->conerr) ? 2 : 3;
+    snap.handles[i].mode = f->mode;
+    snap.handles[i].pos  = f->pos;
+    memcpy(snap.handles[i].name,f->name,sizeof(f->name));
+  }
+  
+  snap.memoff = (sizeof(snap) + snap.outlen + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+  pad         = snap.memoff - sizeof(snap) - snap.outlen;
+  
+  fp = fopen(fname,"wb");
+  if (fp == NULL)
+  {
+    perror(fname);
+    return -1;
+  }
+  
+  fwrite(&snap,sizeof(snap),1,fp);
+  fwrite(sys->transcript,1,snap.outlen,fp);
+  fwrite(zero,1,pad,fp);
+  fwrite(sys->mem,1,MEM_SIZE,fp);
+  
+  if (fclose(fp) == EOF)
+  {
+    perror(fname);
+    return -1;
+  }
+  
+  return 0;
+}
+
+static int snapshot_restore(system__s *sys,const char *fname)
+{
+  snapshot__s  snap;
+  char        *out;
+  void        *mem;
+  int          fd;
+  
+  fd = open(fname,O_RDONLY);
+  if (fd == -1)
+  {
+    perror(fname);
+    return EXIT_FAILURE;
+  }
+  
+  if (
+          (pread(fd,&snap,sizeof(snap),0) != sizeof(snap))
+       || (memcmp(snap.magic,SNAP_MAGIC,sizeof(snap.magic)) != 0)
+       || (snap.version != SNAP_VERSION)
+       || (snap.memsize != MEM_SIZE)
+     )
+  {
+    fprintf(stderr,"%s: not a snapshot from this version\n",fname);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  
+  mem = mmap(NULL,MEM_SIZE,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,snap.memoff);
+  out = malloc(snap.outlen + 1);
+  if (
+          (mem == MAP_FAILED)
+       || (out == NULL)
+       || (pread(fd,out,snap.outlen,sizeof(snap)) != (ssize_t)snap.outlen)
+     )
+  {
+    perror(fname);
+    if (mem != MAP_FAILED)
+      munmap(mem,MEM_SIZE);
+    free(out);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  
+  close(fd);
+  munmap(sys->mem,MEM_SIZE);
+  sys->mem    = mem;
+  sys->regs   = snap.regs;
+  sys->dtaseg = snap.dtaseg;
+  sys->dtaoff = snap.dtaoff;
+  sys->input  = snap.input;
+  memcpy(sys->prompt,snap.prompt,sizeof(sys->prompt));
+  
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    if (snap.files[i].fcb < 0)
+      continue;
+  
+    snap.files[i].name[sizeof(snap.files[i].name) - 1] = '\0';
+    sys->fp[i] = file_open(sys,snap.files[i].name);
+    if (sys->fp[i] == NULL)
+    {
+      perror(snap.files[i].name);
+      free(out);
+      return EXIT_FAILURE;
+    }
+  
+    fseek(sys->fp[i],snap.files[i].pos,SEEK_SET);
+    sys->fcbs[i] = (fcb__s *)&sys->mem[snap.files[i].fcb];
+    filemap_open(&sys->maps[i],fileno(sys->fp[i]),snap.files[i].name);
+  }
+  
+  /* the handles start over from how they were, not from a new VM's */
+  memset(sys->handles,0,sizeof(sys->handles));
+  sys->con.refs    = 0;
+  sys->conerr.refs = 0;
+  
+  for (int i = 0 ; i < HANDLES ; i++)
+  {
+    dosfile__s *f;
+    
+    if ((snap.handles[i].same >= 0) && (snap.handles[i].same < i))
+      f = sys->handles[snap.handles[i].same];
+    else if (snap.handles[i].type == 1)
+      f = &sys->con;
+    else if (snap.handles[i].type == 2)
+      f = &sys->conerr;
+    else if (snap.handles[i].type == 3)
+    {
+      snap.handles[i].name[HANDLE_PATH - 1] = '\0';
+      if ((sys->base != -1) && (snap.handles[i].mode % 3 != 0))
+      {
+        fprintf(stderr,"%s: open for writing, and the base directory is read-only\n",snap.handles[i].name);
+        free(out);
+        return EXIT_FAILURE;
+      }
+      f = dosfile_open((sys->base != -1) ? sys->base : AT_FDCWD,snap.handles[i].name,snap.handles[i].mode % 3,false);
+      if (f == NULL)
+      {
+        perror(snap.handles[i].name);
+        free(out);
+        return EXIT_FAILURE;
+      }
+      f->pos = snap.handles[i].pos;
+    }
+    else
+      continue;
+    
+    if (f == NULL)
+      continue;
+    sys->handles[i] = f;
+    f->refs++;
+  }
+  
+  out_write(sys,out,snap.outlen);
+  free(out);
+  return EXIT_SUCCESS;
+}
+
+/*---------------------------------------------------------------------
+; After a fork() the child shares its parent's open files, file offsets
+; included, so it reopens the files the guest has open to get its own.
+; Files opened by handle keep their position to themselves, so those it
+; can go on sharing.  The output starts over with the transcript, as if
+; it had just been restored.
+;---------------------------------------------------------------------*/
+
+int vm_forked(vm__s *sys)
+{
+  char fname[13];
+  long pos;
+  
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    if ((sys->fcbs[i] == NULL) || (sys->fp[i] == NULL))
+      continue;
+  
+    pos = ftell(sys->fp[i]);
+    mkfilename(fname,sys->fcbs[i]);
+    fclose(sys->fp[i]);
+    sys->fp[i] = file_open(sys,fname);
+    if (sys->fp[i] == NULL)
+    {
+      perror(fname);
+      return -1;
+    }
+    fseek(sys->fp[i],pos,SEEK_SET);
+    sys->maps[i].fd = fileno(sys->fp[i]);	/* the map itself still holds */
+  }
+  
+  sys->out_len = 0;
+  out_write(sys,sys->transcript,sys->transcript_len);
+  return 0;
+}
+/*---------------------------------------------------------------------
+; The clock.  Unless it's VM_REALTIME, time is virtual: it starts at the
+; host's time when the VM is made and goes on at CLOCK_INSN_NS for each
+; instruction the guest runs, so a busy loop waiting on it costs what the
+; instructions cost and not the wall-clock time.  A guest asking the time
+; over and over without doing anything else is waiting for it to change,
+; so after CLOCK_SPINS reads in a row it jumps ahead to the next change
+; the guest can see.  Either way, the same guest fed the same input sees
+; the same times from the same start---and vm_record() writes down the
+; start, and the time zone, so a replay gets them too.
+;---------------------------------------------------------------------*/
+
+#define CLOCK_INSN_NS	1000uLL		/* 1 MIPS, about an AT */
+#define CLOCK_TICK_NS	54925494uLL	/* 65536 / 1193180 s */
+#define CLOCK_SPINS	4		/* time reads in a row that mean waiting */
+#define NS		1000000000uLL
+
+static unsigned long long clock_now(system__s *sys)
+{
+  struct timespec ts;
+  
+  if (sys->realtime)
+  {
+    clock_gettime(CLOCK_REALTIME,&ts);
+    return ts.tv_sec * NS + ts.tv_nsec;
+  }
+  
+  return sys->clock_base + sys->icount * CLOCK_INSN_NS + sys->clock_skip;
+}
+
+/* local time, and nanoseconds since local midnight */
+static unsigned long long clock_local(system__s *sys,unsigned long long now,struct tm *tm)
+{
+  time_t t = now / NS;
+  
+  if (sys->clock_fixed)
+  {
+    t += sys->clock_zone;
+    gmtime_r(&t,tm);
+  }
+  else
+    localtime_r(&t,tm);
+  return ((tm->tm_hour * 3600uLL) + (tm->tm_min * 60) + tm->tm_sec) * NS + now % NS;
+}
+
+static void clock_spin(system__s *sys,unsigned long long step)
+{
+  struct tm          tm;
+  unsigned long long since;
+  
+  if (sys->realtime || (++sys->clock_polls < CLOCK_SPINS))
+    return;
+  
+  since            = clock_local(sys,clock_now(sys),&tm);
+  sys->clock_skip += step - since % step;
+  sys->clock_skips++;
+  sys->tick_next   = 0;	/* the BIOS tick catches up too */
+}
+
+/* the BIOS tick count in 0040:006C, and the midnight flag after it */
+static void clock_tick(system__s *sys)
+{
+  struct tm          tm;
+  unsigned long long since = clock_local(sys,clock_now(sys),&tm);
+  
+  set_dword(sys->mem, 0x46C, since / CLOCK_TICK_NS);
+  if (tm.tm_yday != sys->clock_day)
+    sys->mem[0x470] = 1;
+  sys->clock_day = tm.tm_yday;
+  bcache_invalidate(sys, 0x46C, 5);
+  
+  sys->tick_next = sys->icount + (CLOCK_TICK_NS - since % CLOCK_TICK_NS) / CLOCK_INSN_NS + 1;
+}
+
+static inline uint8_t bcd(int n)
+{
+  return ((n / 10) << 4) | (n % 10);
+}
+
+static void bios_int1a(system__s *sys)
+{
+  struct tm tm;
+  
+  clock_spin(sys, CLOCK_TICK_NS);
+  clock_local(sys, clock_now(sys), &tm);
+  
+  switch((sys->regs.eax >> 8) & 0xFF)
+  {
+    case 0x00: /* Read tick count */
+      clock_tick(sys);
+      sys->regs.ecx   = get_word(sys->mem, 0x46E);
+      sys->regs.edx   = get_word(sys->mem, 0x46C);
+      sys->regs.eax   = sys->mem[0x470];
+      sys->mem[0x470] = 0;
+      break;
+      
+    case 0x02: /* Read RTC time */
+      sys->regs.ecx     = (bcd(tm.tm_hour) << 8) | bcd(tm.tm_min);
+      sys->regs.edx     = bcd(tm.tm_sec) << 8;
+      sys->regs.eflags &= ~0x01;
+      break;
+      
+    case 0x04: /* Read RTC date */
+      sys->regs.ecx     = (bcd((tm.tm_year + 1900) / 100) << 8) | bcd(tm.tm_year % 100);
+      sys->regs.edx     = (bcd(tm.tm_mon + 1) << 8) | bcd(tm.tm_mday);
+      sys->regs.eflags &= ~0x01;
+      break;
+      
+    default:
+      sys->regs.eflags |= 0x01;
+      break;
+  }
+}
+
+/********************************************************************/
+
+static void dos_int21(system__s *sys)
+{
+  unsigned char *mem = sys->mem;
+  uint8_t func = (sys->regs.eax >> 8) & 0xFF;
+  fcb__s *fcb;
+  size_t idx;
+  int handle;
+  
+  if (sys->debug)
+    fprintf(stderr, "DOS INT 21h AH=%02X\n", func);
+  
+  if (sys->metrics != NULL)
+    metrics_add(&sys->metrics->int21[func], 1);
+  
+  if (func != 0x2C)
+    sys->clock_polls = 0;
+  
+  switch(func)
+  {
+    case 0x01: /* Read character with echo */
+      {
+        sys->startup = false;
+        
+        /* this one waits, so stop until the input shows up */
+        int c = read_buffered_input(sys);
+        if (c >= 0)
+        {
+          sys->regs.eax = (sys->regs.eax & 0xFF00) | (c & 0xFF);
+          sys->moved    = 1;
+          if (c != '\n')
+            out_putc(sys, c);
+        }
+        else if (!sys->eof)
+        {
+          wait_buffered_input(sys);
+        }
+        else
+        {
+          /* EOF, return without blocking */
+          sys->regs.eax = (sys->regs.eax & 0xFF00);
+        }
+      }
+      break;
+      
+    case 0x02: /* Write character */
+      {
+        char c = sys->regs.edx & 0xFF;
+        out_putc(sys, c);
+        handle_prompt_detection(sys, c);
+        sys->moved = 1;
+      }
+      break;
+      
+    case 0x06: /* Direct console I/O */
+      {
+        uint8_t dl = sys->regs.edx & 0xFF;
+        if (dl == 0xFF) /* Input */
+        {
+          sys->startup = false;
+          
+          int c = read_buffered_input(sys);
+          
+          /*-------------------------------------------------------------
+          ; This one doesn't wait, so a guest waiting for input polls in
+          ; a loop.  Once it has come up empty enough times without doing
+          ; anything else, stop until there's input instead of letting
+          ; it spin.
+          ;--------------------------------------------------------------*/
+          
+          if ((c < 0) && !sys->eof && (++sys->idle_polls >= IDLE_POLLS))
+          {
+            wait_buffered_input(sys);
+            break;
+          }
+          
+          if (c >= 0)
+          {
+            sys->idle_polls = 0;
+            sys->moved      = 1;
+            sys->regs.eax = (sys->regs.eax & 0xFF00) | (c & 0xFF);
+            sys->regs.eflags &= ~0x40; /* Clear ZF */
+          }
+          else
+          {
+            sys->regs.eflags |= 0x40; /* Set ZF */
+          }
+        }
+        else /* Output */
+        {
+          out_putc(sys, dl);
+          handle_prompt_detection(sys, dl);
+          sys->moved = 1;
+        }
+      }
+      break;
+      
+    case 0x09: /* Write string */
+      {
+        size_t addr = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+        char  *end  = memchr(&mem[addr], '$', MEM_SIZE - addr);
+        if (end != NULL)
+        {
+          sys->moved = end - (char *)&mem[addr];
+          console_write(sys, (char *)&mem[addr], sys->moved);
+        }
+      }
+      break;
+      
+    case 0x0A: /* Buffered input */
+      {
+        sys->startup = false;
+        
+        if (!console_have_line(sys))
+        {
+          wait_buffered_input(sys);
+          break;
+        }
+        
+        size_t addr = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+        size_t max  = mem[addr];
+        
+        /* the line and its CR go at addr + 2 */
+        if (max > MEM_SIZE - addr - 2)
+          max = MEM_SIZE - addr - 2;
+        
+        size_t len  = console_read_line(sys, (char *)&mem[addr + 2], max);
+        mem[addr + 1] = len;
+        bcache_invalidate(sys, addr + 1, len + 2);
+        sys->moved = len;
+      }
+      break;
+      
+    case 0x0C: /* Clear keyboard buffer and read */
+      {
+        uint8_t subfunc = sys->regs.eax & 0xFF;
+        
+        /*-------------------------------------------------------------
+        ; Clear the input buffer.  If the subfunction has to wait, the
+        ; guest comes back with AH set to it, so what gets fed in the
+        ; meantime isn't thrown away.
+        ;--------------------------------------------------------------*/
+        
+        sys->in_pos = 0;
+        sys->in_len = 0;
+        
+        /* Now handle the subfunction */
+        if (subfunc == 0x01 || subfunc == 0x06 || subfunc == 0x07 || 
+            subfunc == 0x08 || subfunc == 0x0A)
+        {
+          sys->regs.eax = (subfunc << 8) | subfunc;
+          dos_int21(sys);
+        }
+      }
+      break;
+      
+    /* FCB File operations */
+    case 0x0F: /* Open file using FCB */
+      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+      fcb = (fcb__s *)&sys->mem[idx];
+      sys->regs.eax = (sys->regs.eax & 0xFF00) | open_file(sys, fcb, false);
+      break;
+      
+    case 0x10: /* Close file using FCB */
+      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+      fcb = (fcb__s *)&sys->mem[idx];
+      handle = find_fcb(sys, fcb);
+      if (handle >= 0)
+      {
+        fcb_close(sys, handle);
+        sys->regs.eax = (sys->regs.eax & 0xFF00);
+      }
+      else
+        sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
+      break;
+      
+    case 0x13: /* Delete file using FCB */
+      {
+        char fname[13];
+        
+        idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+        mkfilename(fname, (fcb__s *)&sys->mem[idx]);
+        if (sys->base != -1)
+        {
+          vfile__s *vf = vfile_find(sys->overlay, fname);
+          
+          if ((vf == NULL) ? (faccessat(sys->base, fname, F_OK, 0) == -1) : vf->deleted)
+            sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
+          else if ((vf = vfile_new(&sys->overlay, fname)) == NULL)
+            sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
+          else
+          {
+            vf->deleted   = true;
+            sys->regs.eax = (sys->regs.eax & 0xFF00);
+          }
+        }
+        else if (remove(fname) == 0)
+          sys->regs.eax = (sys->regs.eax & 0xFF00);
+        else
+          sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
+      }
+      break;
+      
+    case 0x14: /* Sequential read using FCB */
+      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+      fcb = (fcb__s *)&sys->mem[idx];
+      handle = find_fcb(sys, fcb);
+      if (handle >= 0)
+      {
+        size_t dta = seg_off_to_linear(sys->dtaseg, sys->dtaoff);
+        size_t nread;
+        
+        /* a copy in the overlay has no FILE to keep the place; the FCB does */
+        if (sys->vf[handle] != NULL)
+          nread = vfile_read(sys->vf[handle], &sys->mem[dta], ((size_t)fcb->cblock * 128 + fcb->crecnum) * fcb->recsize, fcb->recsize);
+        else
+          nread = fread(&sys->mem[dta], 1, fcb->recsize, sys->fp[handle]);
+        bcache_invalidate(sys, dta, nread);
+        sys->moved = nread;
+        if (nread == fcb->recsize)
+        {
+          if (++fcb->crecnum == 128)
+          {
+            fcb->crecnum = 0;
+            fcb->cblock++;
+          }
+          sys->regs.eax = (sys->regs.eax & 0xFF00);
+        }
+        else
+          sys->regs.eax = (sys->regs.eax & 0xFF00) | 0x01;
+      }
+      else
+        sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
+      break;
+      
+    case 0x16: /* Create file using FCB */
+      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+      fcb = (fcb__s *)&sys->mem[idx];
+      sys->regs.eax = (sys->regs.eax & 0xFF00) | open_file(sys, fcb, true);
+      break;
+      
+    case 0x19: /* Get current drive */
+      sys->regs.eax = (sys->regs.eax & 0xFF00) | 0x02; /* C: drive */
+      break;
+      
+    case 0x1A: /* Set DTA */
+      sys->dtaseg = sys->regs.ds;
+      sys->dtaoff = sys->regs.edx & 0xFFFF;
+      break;
+      
+    case 0x21: /* Random read using FCB */
+    case 0x22: /* Random write using FCB */
+      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+      fcb = (fcb__s *)&sys->mem[idx];
+      handle = find_fcb(sys, fcb);
+      if (handle >= 0)
+        sys->regs.eax = (sys->regs.eax & 0xFF00) | fcb_record(sys, handle, fcb, func == 0x22);
+      else
+        sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
+      break;
+      
+    case 0x25: /* Set interrupt vector */
+      {
+        size_t vec = (sys->regs.eax & 0xFF) * 4;
+        set_word(mem, vec,     sys->regs.edx & 0xFFFF);
+        set_word(mem, vec + 2, sys->regs.ds);
+        bcache_invalidate(sys, vec, 4);
+      }
+      break;
+      
+    case 0x2A: /* Get date */
+    case 0x2C: /* Get time */
+      {
+        struct tm          tm;
+        unsigned long long since;
+        
+        if (func == 0x2C)
+          clock_spin(sys, NS / 100);
+        since = clock_local(sys, clock_now(sys), &tm);
+        
+        if (func == 0x2A)
+        {
+          sys->regs.ecx = tm.tm_year + 1900;
+          sys->regs.edx = ((tm.tm_mon + 1) << 8) | tm.tm_mday;
+          sys->regs.eax = (sys->regs.eax & 0xFF00) | tm.tm_wday;
+        }
+        else
+        {
+          sys->regs.ecx = (tm.tm_hour << 8) | tm.tm_min;
+          sys->regs.edx = (tm.tm_sec << 8) | (since % NS / (NS / 100));
+        }
+      }
+      break;
+      
+    case 0x30: /* Get DOS version */
+      sys->regs.eax = 0x0005; /* DOS 5.0 */
+      sys->regs.ebx = 0x0000;
+      sys->regs.ecx = 0x0000;
+      break;
+      
+    case 0x35: /* Get interrupt vector */
+      {
+        size_t vec = (sys->regs.eax & 0xFF) * 4;
+        sys->regs.ebx = get_word(mem, vec);
+        sys->regs.es  = get_word(mem, vec + 2);
+      }
+      break;
+      
+    case 0x3C: /* Create file */
+    case 0x3D: /* Open file */
+      {
+        char path[HANDLE_PATH];
+        int  mode = (func == 0x3C) ? 2 : (sys->regs.eax & 0x03);
+        
+        if (mode == 3)
+        {
+          dos_fail(sys, 0x0C);	/* invalid access code */
+          break;
+        }
+        if (!dos_path(sys, path))
+        {
+          dos_fail(sys, 0x03);
+          break;
+        }
+        
+        handle = handle_open(sys, path, mode, func == 0x3C);
+        if (handle < 0)
+          dos_fail(sys, -handle);
+        else
+          dos_done(sys, handle);
+      }
+      break;
+      
+    case 0x3E: /* Close handle */
+      if (handle_get(sys, sys->regs.ebx & 0xFFFF) == NULL)
+      {
+        dos_fail(sys, 0x06);
+        break;
+      }
+      handle_close(sys, sys->regs.ebx & 0xFFFF);
+      dos_done(sys, sys->regs.eax & 0xFFFF);
+      break;
+      
+    case 0x3F: /* Read from handle */
+      {
+        size_t      addr = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+        size_t      size = sys->regs.ecx & 0xFFFF;
+        dosfile__s *f    = handle_get(sys, sys->regs.ebx & 0xFFFF);
+        
+        if ((f == NULL) || (f->mode == 1))
+        {
+          dos_fail(sys, (f == NULL) ? 0x06 : 0x05);
+          break;
+        }
+        
+        if (size > MEM_SIZE - addr)
+          size = MEM_SIZE - addr;
+        
+        if (f->fd != -1)
+        {
+          ssize_t bytes = pread(f->fd, &mem[addr], size, f->pos);
+          
+          if (bytes < 0)
+          {
+            dos_fail(sys, dos_error(errno));
+            break;
+          }
+          f->pos += bytes;
+          bcache_invalidate(sys, addr, bytes);
+          sys->moved = bytes;
+          dos_done(sys, bytes);
+          break;
+        }
+        
+        sys->startup = false;
+        
+        if ((sys->in_pos == sys->in_len) && !sys->eof)
+        {
+          wait_buffered_input(sys);
+          break;
+        }
+        
+        size = console_read(sys, (char *)&mem[addr], size);
+        bcache_invalidate(sys, addr, size);
+        sys->moved = size;
+        dos_done(sys, size);
+      }
+      break;
+      
+    case 0x40: /* Write to handle */
+      {
+        size_t      addr = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
+        size_t      size = sys->regs.ecx & 0xFFFF;
+        dosfile__s *f    = handle_get(sys, sys->regs.ebx & 0xFFFF);
+        
+        if ((f == NULL) || (f->mode == 0))
+        {
+          dos_fail(sys, (f == NULL) ? 0x06 : 0x05);
+          break;
+        }
+        
+        if (size > MEM_SIZE - addr)
+          size = MEM_SIZE - addr;
+        
+        if (f->fd != -1)
+        {
+          ssize_t bytes;
+          
+          /* writing nothing cuts the file off (or extends it) right there */
+          if (size == 0)
+            bytes = ftruncate(f->fd, f->pos);
+          else
+            bytes = pwrite(f->fd, &mem[addr], size, f->pos);
+          
+          if (bytes < 0)
+          {
+            dos_fail(sys, dos_error(errno));
+            break;
+          }
+          f->pos += bytes;
+          sys->moved = bytes;
+          dos_done(sys, bytes);
+        }
+        else
+        {
+          /* stdout or stderr, which DOS's CON doesn't tell apart */
+          console_write(sys, (char *)&mem[addr], size);
+          sys->moved = size;
+          dos_done(sys, size);
+        }
+      }
+      break;
+      
+    case 0x41: /* Delete file */
+      {
+        char path[HANDLE_PATH];
+        
+        if (!dos_path(sys, path))
+          dos_fail(sys, 0x03);
+        else if (sys->base != -1)
+          dos_fail(sys, 0x05);	/* access denied, as for 3Ch */
+        else if (unlink(path) == -1)
+          dos_fail(sys, dos_error(errno));
+        else
+          dos_done(sys, sys->regs.eax & 0xFFFF);
+      }
+      break;
+      
+    case 0x42: /* Move file pointer */
+      {
+        dosfile__s *f   = handle_get(sys, sys->regs.ebx & 0xFFFF);
+        int32_t     off = (int32_t)(((sys->regs.ecx & 0xFFFF) << 16) | (sys->regs.edx & 0xFFFF));
+        int64_t     pos;
+        struct stat info;
+        
+        if (f == NULL)
+        {
+          dos_fail(sys, 0x06);
+          break;
+        }
+        
+        if ((sys->regs.eax & 0xFF) > 2)
+        {
+          dos_fail(sys, 0x01);	/* invalid function */
+          break;
+        }
+        
+        /* the console doesn't have a position */
+        if (f->fd == -1)
+          pos = 0;
+        else if ((sys->regs.eax & 0xFF) == 0)
+          pos = (uint32_t)off;
+        else if ((sys->regs.eax & 0xFF) == 1)
+          pos = (int64_t)f->pos + off;
+        else if (fstat(f->fd, &info) == 0)
+          pos = (int64_t)info.st_size + off;
+        else
+        {
+          dos_fail(sys, dos_error(errno));
+          break;
+        }
+        
+        /* before the start, or further than the position can go */
+        if ((pos < 0) || (pos > UINT32_MAX))
+        {
+          dos_fail(sys, 0x19);	/* seek error */
+          break;
+        }
+        
+        f->pos        = pos;
+        sys->regs.edx = f->pos >> 16;
+        dos_done(sys, f->pos & 0xFFFF);
+      }
+      break;
+      
+    case 0x45: /* Duplicate handle */
+      {
+        dosfile__s *f = handle_get(sys, sys->regs.ebx & 0xFFFF);
+        
+        if (f == NULL)
+        {
+          dos_fail(sys, 0x06);
+          break;
+        }
+        
+        handle = handle_new(sys, f);
+        if (handle == -1)
+          dos_fail(sys, 0x04);
+        else
+          dos_done(sys, handle);
+      }
+      break;
+      
+    case 0x46: /* Force duplicate handle */
+      {
+        dosfile__s *f  = handle_get(sys, sys->regs.ebx & 0xFFFF);
+        unsigned    to = sys->regs.ecx & 0xFFFF;
+        
+        if ((f == NULL) || (to >= HANDLES))
+        {
+          dos_fail(sys, 0x06);
+          break;
+        }
+        
+        if (sys->handles[to] != f)
+        {
+          if (sys->handles[to] != NULL)
+            handle_close(sys, to);
+          sys->handles[to] = f;
+          f->refs++;
+        }
+        dos_done(sys, sys->regs.eax & 0xFFFF);
+      }
+      break;
+      
+    case 0x4C: /* Exit program */
+      sys->exit_code = sys->regs.eax & 0xFF;
+      sys->running   = false;
+      break;
+      
+    default:
+      if (sys->debug)
+        fprintf(stderr, "Unhandled DOS INT 21h function: %02X\n", func);
+      break;
+  }
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; dos_int21() with a record of it in the trace ring, which costs two
+; reads of the clock and some stores.
+;---------------------------------------------------------------------*/
+
+static void dos_traced(system__s *sys)
+{
+  uint16_t            ip = sys->regs.eip;
+  unsigned long long  start;
+  vm_trace__s        *t  = trace_begin(&sys->trace,&start);
+  
+  t->icount = sys->icount;
+  t->ax     = sys->regs.eax;
+  t->bx     = sys->regs.ebx;
+  t->cx     = sys->regs.ecx;
+  t->dx     = sys->regs.edx;
+  t->ds     = sys->regs.ds;
+  
+  sys->moved = 0;
+  dos_int21(sys);
+  
+  t->bytes = sys->moved;
+  t->ret   = sys->regs.eax;
+  t->flags = sys->regs.eflags & 0x01 ? TRACE_CF : 0;
+  
+  /* backed up over the INT to make it again (see wait_buffered_input()) */
+  if ((uint16_t)sys->regs.eip == (uint16_t)(ip - 2))
+    t->flags |= TRACE_WAIT;
+  
+  trace_end(&sys->trace,t,start);
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; The software CPU.  This is a complete 8086/8088 implementation---every
+; one of the 256 primary opcodes has a handler, including the aliases the
+; original part decodes (60h-6Fh as Jcc, C0h/C1h/C8h/C9h as RET/RETF, 82h
+; as 80h, F1h as LOCK, 0Fh as POP CS).  An instruction is first decoded
+; into an insn__s (prefixes, ModR/M, displacement and immediates), IP is
+; advanced past it, and then the handler for the opcode is called through
+; op_handlers[].  Computed goto would save an indirect call, but it isn't
+; ISO C, so a handler table it is.
+;
+; Performance target: >= 150M guest instructions/second on one core of a
+; contemporary x86_64 host, built with -O2.
+;---------------------------------------------------------------------*/
+
+#define FLAG_CF		0x0001
+#define FLAG_PF		0x0004
+#define FLAG_AF		0x0010
+#define FLAG_ZF		0x0040
+#define FLAG_SF		0x0080
+#define FLAG_TF		0x0100
+#define FLAG_IF		0x0200
+#define FLAG_DF		0x0400
+#define FLAG_OF		0x0800
+
+#define FLAGS_ARITH	(FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | FLAG_OF)
+#define FLAGS_8086	(FLAGS_ARITH | FLAG_TF | FLAG_IF | FLAG_DF)
+
+#define OI_MODRM	0x01
+#define OI_IMM8		0x02
+#define OI_IMM16	0x04
+#define OI_FAR		0x08	/* offset:segment immediate */
+#define OI_GRP3		0x10	/* immediate only for TEST (reg 0 or 1) */
+#define OI_PREFIX	0x20
+#define OI_BRANCH	0x40	/* always ends a decoded block */
+
+enum { SR_ES , SR_CS , SR_SS , SR_DS };
+enum { ALU_ADD , ALU_OR , ALU_ADC , ALU_SBB , ALU_AND , ALU_SUB , ALU_XOR , ALU_CMP };
+enum { LF_NONE , LF_ADD , LF_SUB , LF_LOGIC , LF_INC , LF_DEC };
+
+typedef struct insn insn__s;
+typedef void (*handler__f)(system__s *,const insn__s *);
+
+struct insn
+{
+  handler__f handler;
+  uint8_t    opcode;
+  uint8_t    len;
+  uint8_t    rep;	/* 0, 0xF2 (REPNE) or 0xF3 (REP/REPE) */
+  int8_t     seg;	/* segment override, or -1 */
+  uint8_t    mod;
+  uint8_t    reg;
+  uint8_t    rm;
+  uint16_t   disp;
+  uint16_t   imm;
+  uint16_t   imm2;	/* segment of a far pointer */
+};
+
+/*---------------------------------------------------------------------
+; Decoded block cache.  Straight-line runs of code are decoded once into
+; an array of insn__s, keyed by the linear address of CS:IP, and a block
+; remembers up to two successors so the common paths skip the hash lookup
+; entirely.  Blocks and their instructions come out of fixed arenas; when
+; either runs dry the whole cache is flushed.
+;
+; Every store checks the code page count for the page it lands in, and a
+; store into a page holding decoded code kills the blocks covering that
+; byte.  Host side writes (DOS reads into the DTA and so on) go through
+; bcache_invalidate() directly.
+;---------------------------------------------------------------------*/
+
+#define BLOCK_INSNS	32
+#define BLOCK_MAX	8192
+#define BLOCK_ARENA	65536
+#define BLOCK_HASH	4096
+#define CODE_PAGE_SHIFT	10
+#define CODE_PAGES	(MEM_SIZE >> CODE_PAGE_SHIFT)
+#define JIT_SIZE	(4uL * 1024uL * 1024uL)	/* native code space */
+#define JIT_SLACK	4096			/* enough for any one block */
+#define JIT_HOT		16			/* runs before a block is translated */
+
+typedef struct block block__s;
+
+struct block
+{
+  size_t    addr;	/* linear address of the first instruction */
+  size_t    end;	/* linear address past the last instruction */
+  insn__s  *insns;
+  unsigned  count;
+  bool      valid;
+  unsigned  slot;	/* next successor slot to replace */
+  block__s *next[2];	/* chained successors */
+  block__s *hash_link;
+  block__s *page_link;
+  unsigned  execs;	/* times run, until it gets hot */
+  bool      nojit;	/* not (or no longer) worth translating */
+  uint16_t  jit_ip;	/* IP the native code was made for */
+  unsigned (*jit)(system__s *,block__s *);
+};
+
+typedef struct bcache
+{
+  uint16_t           code[CODE_PAGES];	/* blocks touching each page */
+  block__s          *page[CODE_PAGES];	/* blocks starting in each page */
+  block__s          *hash[BLOCK_HASH];
+  size_t             nblocks;
+  size_t             ninsns;
+  unsigned long long hits;
+  unsigned long long chained;
+  unsigned long long misses;
+  unsigned long long invalidations;
+  unsigned long long flushes;
+  uint8_t           *jit_mem;		/* native code, JIT_SIZE bytes */
+  size_t             jit_used;
+  unsigned long long jit_blocks;
+  unsigned long long jit_entries;
+  unsigned long long jit_insns;
+  unsigned long long lockstep_checks;
+  block__s           blocks[BLOCK_MAX];
+  insn__s            arena[BLOCK_ARENA];
+} bcache__s;
+
+/*---------------------------------------------------------------------
+; The general registers, viewed as an array in ModR/M order.  w[r * 2] is
+; the 16-bit register r, and b[reg8_index[r]] the 8-bit register r (AL CL
+; DL BL AH CH DH BH), so none of them need any masking or shifting.
+;---------------------------------------------------------------------*/
+
+typedef union __attribute__((may_alias)) gpr
+{
+  uint32_t e[8];
+  uint16_t w[16];
+  uint8_t  b[32];
+} gpr__u;
+
+typedef uint16_t __attribute__((may_alias)) sreg__t;
+
+static const uint8_t reg8_index[8] = { 0 , 4 , 8 , 12 , 1 , 5 , 9 , 13 };
+
+/********************************************************************/
+
+static inline size_t linear(system__s *sys,uint16_t seg,uint16_t off)
+{
+  return (((size_t)seg << 4) + off) & sys->amask;
+}
+
+static inline uint8_t mem_rb(system__s *sys,uint16_t seg,uint16_t off)
+{
+  return sys->mem[linear(sys,seg,off)];
+}
+
+/*---------------------------------------------------------------------
+; A word at offset FFFF takes its high byte from offset 0 of the same
+; segment, and with A20 off a word at FFFFF takes it from address 0.
+; Everything else is a single (unaligned) load or store.
+;---------------------------------------------------------------------*/
+
+static inline uint16_t mem_rw(system__s *sys,uint16_t seg,uint16_t off)
+{
+  size_t   addr = linear(sys,seg,off);
+  uint16_t v;
+  
+  if ((off == 0xFFFF) || (addr == sys->amask))
+    return mem_rb(sys,seg,off) | (mem_rb(sys,seg,(uint16_t)(off + 1)) << 8);
+  
+  memcpy(&v,&sys->mem[addr],sizeof(v));
+  return v;
+}
+
+static inline void mem_wb(system__s *sys,uint16_t seg,uint16_t off,uint8_t v)
+{
+  size_t addr = linear(sys,seg,off);
+  
+  if (sys->journal != NULL)
+    journal_add(sys->journal,addr,sys->mem[addr],v);
+  sys->mem[addr] = v;
+  if (sys->cache->code[addr >> CODE_PAGE_SHIFT])
+    bcache_invalidate(sys,addr,1);
+}
+
+static inline void mem_ww(system__s *sys,uint16_t seg,uint16_t off,uint16_t v)
+{
+  size_t addr = linear(sys,seg,off);
+  
+  if ((off == 0xFFFF) || (addr == sys->amask) || (sys->journal != NULL))
+  {
+    mem_wb(sys,seg,off,v & 0xFF);
+    mem_wb(sys,seg,(uint16_t)(off + 1),v >> 8);
+    return;
+  }
+  
+  memcpy(&sys->mem[addr],&v,sizeof(v));
+  if (sys->cache->code[addr >> CODE_PAGE_SHIFT] | sys->cache->code[(addr + 1) >> CODE_PAGE_SHIFT])
+    bcache_invalidate(sys,addr,2);
+}
+
+/********************************************************************/
+
+static inline gpr__u *gpr(system__s *sys)
+{
+  return (gpr__u *)&sys->regs.eax;
+}
+
+static inline uint16_t get_reg16(system__s *sys,unsigned r)
+{
+  return gpr(sys)->w[r * 2];
+}
+
+static inline void set_reg16(system__s *sys,unsigned r,uint16_t v)
+{
+  gpr(sys)->w[r * 2] = v;
+}
+
+static inline uint8_t get_reg8(system__s *sys,unsigned r)
+{
+  return gpr(sys)->b[reg8_index[r]];
+}
+
+static inline void set_reg8(system__s *sys,unsigned r,uint8_t v)
+{
+  gpr(sys)->b[reg8_index[r]] = v;
+}
+
+static inline uint16_t get_sreg(system__s *sys,unsigned r)
+{
+  return ((sreg__t *)&sys->regs.es)[r];
+}
+
+static inline void set_sreg(system__s *sys,unsigned r,uint16_t v)
+{
+  ((sreg__t *)&sys->regs.es)[r] = v;
+}
+
+/********************************************************************/
+
+static inline void push16(system__s *sys,uint16_t v)
+{
+  sys->regs.esp = (sys->regs.esp - 2) & 0xFFFF;
+  mem_ww(sys,sys->regs.ss,sys->regs.esp,v);
+}
+
+static inline uint16_t pop16(system__s *sys)
+{
+  uint16_t v = mem_rw(sys,sys->regs.ss,sys->regs.esp);
+  sys->regs.esp = (sys->regs.esp + 2) & 0xFFFF;
+  return v;
+}
+
+/********************************************************************/
+
+static inline uint16_t data_seg(system__s *sys,const insn__s *insn,unsigned def)
+{
+  return get_sreg(sys,insn->seg >= 0 ? (unsigned)insn->seg : def);
+}
+
+static void decode_ea(
+        system__s      *sys,
+        const insn__s  *insn,
+        uint16_t       *seg,
+        uint16_t       *off
+)
+{
+  unsigned def = SR_DS;
+  uint16_t o;
+
+  switch(insn->rm)
+  {
+    case 0:  o = sys->regs.ebx + sys->regs.esi; break;
+    case 1:  o = sys->regs.ebx + sys->regs.edi; break;
+    case 2:  o = sys->regs.ebp + sys->regs.esi; def = SR_SS; break;
+    case 3:  o = sys->regs.ebp + sys->regs.edi; def = SR_SS; break;
+    case 4:  o = sys->regs.esi; break;
+    case 5:  o = sys->regs.edi; break;
+    case 6:
+         if (insn->mod == 0)
+           o = 0;
+         else
+         {
+           o   = sys->regs.ebp;
+           def = SR_SS;
+         }
+         break;
+    default: o = sys->regs.ebx; break;
+  }
+
+  *off = o + insn->disp;
+  *seg = data_seg(sys,insn,def);
+}
+
+static uint16_t rm_read(system__s *sys,const insn__s *insn,bool w)
+{
+  uint16_t seg;
+  uint16_t off;
+
+  if (insn->mod == 3)
+    return w ? get_reg16(sys,insn->rm) : get_reg8(sys,insn->rm);
+
+  decode_ea(sys,insn,&seg,&off);
+  return w ? mem_rw(sys,seg,off) : mem_rb(sys,seg,off);
+}
+
+static void rm_write(system__s *sys,const insn__s *insn,bool w,uint16_t v)
+{
+  uint16_t seg;
+  uint16_t off;
+
+  if (insn->mod == 3)
+  {
+    if (w)
+      set_reg16(sys,insn->rm,v);
+    else
+      set_reg8(sys,insn->rm,v);
+    return;
+  }
+
+  decode_ea(sys,insn,&seg,&off);
+  if (w)
+    mem_ww(sys,seg,off,v);
+  else
+    mem_wb(sys,seg,off,v);
+}
+
+static inline uint16_t reg_read(system__s *sys,const insn__s *insn,bool w)
+{
+  return w ? get_reg16(sys,insn->reg) : get_reg8(sys,insn->reg);
+}
+
+static inline void reg_write(system__s *sys,const insn__s *insn,bool w,uint16_t v)
+{
+  if (w)
+    set_reg16(sys,insn->reg,v);
+  else
+    set_reg8(sys,insn->reg,v);
+}
+
+/********************************************************************/
+
+static inline uint32_t flags_szp(uint32_t r,bool w)
+{
+  uint32_t f = 0;
+
+  if (r == 0)
+    f |= FLAG_ZF;
+  if (r & (w ? 0x8000 : 0x80))
+    f |= FLAG_SF;
+  if (!__builtin_parity(r & 0xFF))
+    f |= FLAG_PF;
+  return f;
+}
+
+/*---------------------------------------------------------------------
+; Lazy flags.  The ALU only records what it did in sys->lazy; the flags
+; are worked out when something actually looks at them, and then only the
+; ones it asks for.  Most ALU results are overwritten long before that.
+;---------------------------------------------------------------------*/
+
+static inline uint32_t flags_eval(const system__s *sys,uint32_t want)
+{
+  uint32_t mask = sys->lazy.w ? 0xFFFF : 0xFF;
+  uint32_t sign = sys->lazy.w ? 0x8000 : 0x80;
+  uint32_t d    = sys->lazy.d;
+  uint32_t s    = sys->lazy.s;
+  uint32_t r    = sys->lazy.r;
+  uint32_t c    = sys->lazy.c;
+  uint32_t f    = 0;
+
+  if ((want & FLAG_ZF) && (r == 0))
+    f |= FLAG_ZF;
+  if ((want & FLAG_SF) && (r & sign))
+    f |= FLAG_SF;
+  if ((want & FLAG_PF) && !__builtin_parity(r & 0xFF))
+    f |= FLAG_PF;
+  if ((want & FLAG_AF) && ((r ^ d ^ s) & 0x10) && (sys->lazy.op != LF_LOGIC))
+    f |= FLAG_AF;
+
+  switch(sys->lazy.op)
+  {
+    case LF_ADD:
+         if ((want & FLAG_CF) && (d + s + c > mask))     f |= FLAG_CF;
+         /* FALLTHROUGH */
+    case LF_INC:
+         if ((want & FLAG_OF) && ((r ^ d) & (r ^ s) & sign)) f |= FLAG_OF;
+         break;
+
+    case LF_SUB:
+         if ((want & FLAG_CF) && (d < s + c))            f |= FLAG_CF;
+         /* FALLTHROUGH */
+    case LF_DEC:
+         if ((want & FLAG_OF) && ((d ^ s) & (d ^ r) & sign)) f |= FLAG_OF;
+         break;
+
+    default:
+         break;
+  }
+
+  /* INC and DEC leave CF alone; alu_incdec() saved it in eflags */
+  if ((sys->lazy.op == LF_INC) || (sys->lazy.op == LF_DEC))
+    f |= sys->regs.eflags & want & FLAG_CF;
+
+  return f;
+}
+
+static void flags_sync(system__s *sys)
+{
+  if (sys->lazy.op != LF_NONE)
+  {
+    sys->regs.eflags = (sys->regs.eflags & ~FLAGS_ARITH) | flags_eval(sys,FLAGS_ARITH);
+    sys->lazy.op     = LF_NONE;
+  }
+}
+
+static inline uint32_t flags(system__s *sys)
+{
+  flags_sync(sys);
+  return sys->regs.eflags;
+}
+
+static inline uint32_t flags_get(const system__s *sys,uint32_t want)
+{
+  if (sys->lazy.op == LF_NONE)
+    return sys->regs.eflags & want;
+  return flags_eval(sys,want);
+}
+
+static inline void flags_set(system__s *sys,uint8_t op,uint16_t d,uint16_t s,uint16_t r,uint16_t c,bool w)
+{
+  sys->lazy.op = op;
+  sys->lazy.w  = w;
+  sys->lazy.d  = d;
+  sys->lazy.s  = s;
+  sys->lazy.r  = r;
+  sys->lazy.c  = c;
+}
+
+static uint16_t alu(system__s *sys,int op,uint16_t d,uint16_t s,bool w)
+{
+  uint32_t mask = w ? 0xFFFF : 0xFF;
+  uint32_t c    = 0;
+  uint32_t r;
+
+  switch(op)
+  {
+    case ALU_ADC:
+         c = flags_get(sys,FLAG_CF);
+         /* FALLTHROUGH */
+    case ALU_ADD:
+         r = ((uint32_t)d + s + c) & mask;
+         flags_set(sys,LF_ADD,d,s,r,c,w);
+         return r;
+
+    case ALU_SBB:
+         c = flags_get(sys,FLAG_CF);
+         /* FALLTHROUGH */
+    case ALU_SUB:
+    case ALU_CMP:
+         r = ((uint32_t)d - s - c) & mask;
+         flags_set(sys,LF_SUB,d,s,r,c,w);
+         return r;
+
+    case ALU_OR:  r = d | s; break;
+    case ALU_AND: r = d & s; break;
+    default:      r = d ^ s; break;
+  }
+
+  flags_set(sys,LF_LOGIC,d,s,r,0,w);
+  return r;
+}
+
+static uint16_t alu_incdec(system__s *sys,uint16_t d,bool dec,bool w)
+{
+  uint16_t r = (dec ? d - 1 : d + 1) & (w ? 0xFFFF : 0xFF);
+
+  sys->regs.eflags = (sys->regs.eflags & ~FLAG_CF) | flags_get(sys,FLAG_CF);
+  flags_set(sys,dec ? LF_DEC : LF_INC,d,1,r,0,w);
+  return r;
+}
+
+static uint16_t shift(system__s *sys,int op,uint16_t v,unsigned count,bool w)
+{
+  uint32_t mask = w ? 0xFFFF : 0xFF;
+  uint32_t sign = w ? 0x8000 : 0x80;
+  uint32_t cf   = flags(sys) & FLAG_CF;
+  uint32_t r    = v;
+  uint32_t out;
+  uint32_t f;
+  bool     of;
+
+  if (count == 0)
+    return v;
+
+  /*--------------------------------------------------------------------
+  ; The 8086 does not mask the count, so CL can legitimately be up to 255.
+  ; Doing it a bit at a time keeps CF correct for every case.
+  ;---------------------------------------------------------------------*/
+
+  for (unsigned i = 0 ; i < count ; i++)
+  {
+    switch(op)
+    {
+      case 0: cf = (r & sign) != 0; r = ((r << 1) | cf) & mask;  break;
+      case 1: cf = r & 1; r = (r >> 1) | (cf ? sign : 0);        break;
+      case 2: out = (r & sign) != 0; r = ((r << 1) | cf) & mask; cf = out; break;
+      case 3: out = r & 1; r = (r >> 1) | (cf ? sign : 0);       cf = out; break;
+      case 5: cf = r & 1; r >>= 1;                               break;
+      case 7: cf = r & 1; r = (r >> 1) | (r & sign);             break;
+      default: cf = (r & sign) != 0; r = (r << 1) & mask;        break;
+    }
+  }
+
+  switch(op)
+  {
+    case 1: case 3: of = ((r ^ (r << 1)) & sign) != 0; break;
+    case 5:         of = (v & sign) != 0;               break;
+    case 7:         of = false;                         break;
+    default:        of = ((r & sign) != 0) != (cf != 0);  break;
+  }
+
+  f = sys->regs.eflags & ~(FLAG_CF | FLAG_OF);
+  if (cf) f |= FLAG_CF;
+  if (of) f |= FLAG_OF;
+  if (op >= 4)
+    f = (f & ~(FLAG_SF | FLAG_ZF | FLAG_PF | FLAG_AF)) | flags_szp(r,w);
+  sys->regs.eflags = f;
+  return r;
+}
+
+static bool condition(system__s *sys,unsigned cc)
+{
+  uint32_t f;
+  bool     r;
+
+  /* each case asks for just the flags it tests */
+  switch(cc >> 1)
+  {
+    case 0:  r = flags_get(sys,FLAG_OF); break;
+    case 1:  r = flags_get(sys,FLAG_CF); break;
+    case 2:  r = flags_get(sys,FLAG_ZF); break;
+    case 3:  r = flags_get(sys,FLAG_CF | FLAG_ZF); break;
+    case 4:  r = flags_get(sys,FLAG_SF); break;
+    case 5:  r = flags_get(sys,FLAG_PF); break;
+    case 6:
+         f = flags_get(sys,FLAG_SF | FLAG_OF);
+         r = ((f & FLAG_SF) != 0) != ((f & FLAG_OF) != 0);
+         break;
+    default:
+         f = flags_get(sys,FLAG_ZF | FLAG_SF | FLAG_OF);
+         r = (f & FLAG_ZF) || (((f & FLAG_SF) != 0) != ((f & FLAG_OF) != 0));
+         break;
+  }
+
+  return (cc & 1) ? !r : r;
+}
+
+/********************************************************************/
+
+static void cpu_interrupt(system__s *sys,uint8_t num)
+{
+  uint16_t off;
+  uint16_t seg;
+
+  flags_sync(sys);
+  if (num == 0x21)
+  {
+    if (sys->trace.rec != NULL)
+      dos_traced(sys);
+    else
+      dos_int21(sys);
+    return;
+  }
+
+  if (num == 0x1A)
+  {
+    bios_int1a(sys);
+    return;
+  }
+
+  if (num == 0x20)
+  {
+    /* Program termination */
+    sys->running = false;
+    return;
+  }
+
+  off = get_word(sys->mem,num * 4);
+  seg = get_word(sys->mem,num * 4 + 2);
+
+  /*---------------------------------------------------------------------
+  ; Memory is filled with 0xCC, so running off into the weeds ends up
+  ; executing INT 3 forever.  If nobody hooked it, treat it as fatal.
+  ;---------------------------------------------------------------------*/
+
+  if ((num == 3) && (seg == SEG_PSP) && (off == 129))
+  {
+    fprintf(stderr,"unexpected interrupt %02X at %04X:%04X\n",num,sys->regs.cs,(uint16_t)sys->regs.eip);
+    sys->running = false;
+    return;
+  }
+
+  if (sys->debug)
+    fprintf(stderr, "Interrupt %02X to %04X:%04X\n",num,seg,off);
+
+  push16(sys,(sys->regs.eflags & FLAGS_8086) | 0xF002);
+  push16(sys,sys->regs.cs);
+  push16(sys,sys->regs.eip);
+  sys->regs.eflags &= ~(FLAG_IF | FLAG_TF);
+  sys->regs.cs      = seg;
+  sys->regs.eip     = off;
+}
+
+/********************************************************************/
+
+static inline void jump_rel(system__s *sys,uint16_t rel)
+{
+  sys->regs.eip = (sys->regs.eip + rel) & 0xFFFF;
+}
+
+static void op_nop(system__s *sys,const insn__s *insn)
+{
+  (void)sys;
+  (void)insn;
+}
+
+static void op_alu_rm_r(system__s *sys,const insn__s *insn)
+{
+  bool     w  = insn->opcode & 1;
+  int      op = insn->opcode >> 3;
+  uint16_t r  = alu(sys,op,rm_read(sys,insn,w),reg_read(sys,insn,w),w);
+
+  if (op != ALU_CMP)
+    rm_write(sys,insn,w,r);
+}
+
+static void op_alu_r_rm(system__s *sys,const insn__s *insn)
+{
+  bool     w  = insn->opcode & 1;
+  int      op = insn->opcode >> 3;
+  uint16_t r  = alu(sys,op,reg_read(sys,insn,w),rm_read(sys,insn,w),w);
+
+  if (op != ALU_CMP)
+    reg_write(sys,insn,w,r);
+}
+
+static void op_alu_a_imm(system__s *sys,const insn__s *insn)
+{
+  int op = insn->opcode >> 3;
+
+  if (insn->opcode & 1)
+  {
+    uint16_t r = alu(sys,op,sys->regs.eax,insn->imm,true);
+    if (op != ALU_CMP)
+      set_reg16(sys,0,r);
+  }
+  else
+  {
+    uint16_t r = alu(sys,op,sys->regs.eax & 0xFF,insn->imm,false);
+    if (op != ALU_CMP)
+      set_reg8(sys,0,r);
+  }
+}
+
+static void op_push_sreg(system__s *sys,const insn__s *insn)
+{
+  push16(sys,get_sreg(sys,insn->opcode >> 3));
+}
+
+static void op_pop_sreg(system__s *sys,const insn__s *insn)
+{
+  set_sreg(sys,insn->opcode >> 3,pop16(sys));
+}
+
+static void op_daa(system__s *sys,const insn__s *insn)
+{
+  uint8_t  al = sys->regs.eax & 0xFF;
+  uint32_t f  = flags(sys);
+  uint8_t  r  = al;
+
+  (void)insn;
+  f &= ~(FLAG_CF | FLAG_AF);
+  if (((al & 0x0F) > 9) || (sys->regs.eflags & FLAG_AF))
+  {
+    r += 6;
+    f |= FLAG_AF;
+  }
+  if ((al > 0x99) || (sys->regs.eflags & FLAG_CF))
+  {
+    r += 0x60;
+    f |= FLAG_CF;
+  }
+  set_reg8(sys,0,r);
+  sys->regs.eflags = (f & ~(FLAG_SF | FLAG_ZF | FLAG_PF)) | flags_szp(r,false);
+}
+
+static void op_das(system__s *sys,const insn__s *insn)
+{
+  uint8_t  al = sys->regs.eax & 0xFF;
+  uint32_t f  = flags(sys);
+  uint8_t  r  = al;
+
+  (void)insn;
+  f &= ~(FLAG_CF | FLAG_AF);
+  if (((al & 0x0F) > 9) || (sys->regs.eflags & FLAG_AF))
+  {
+    r -= 6;
+    f |= FLAG_AF;
+  }
+  if ((al > 0x99) || (sys->regs.eflags & FLAG_CF))
+  {
+    r -= 0x60;
+    f |= FLAG_CF;
+  }
+  set_reg8(sys,0,r);
+  sys->regs.eflags = (f & ~(FLAG_SF | FLAG_ZF | FLAG_PF)) | flags_szp(r,false);
+}
+
+static void op_aaa_aas(system__s *sys,const insn__s *insn)
+{
+  uint8_t al = sys->regs.eax & 0xFF;
+  uint8_t ah = (sys->regs.eax >> 8) & 0xFF;
+
+  flags_sync(sys);
+  if (((al & 0x0F) > 9) || (sys->regs.eflags & FLAG_AF))
+  {
+    if (insn->opcode == 0x37)
+    {
+      al += 6;
+      ah += 1;
+    }
+    else
+    {
+      al -= 6;
+      ah -= 1;
+    }
+    sys->regs.eflags |= FLAG_AF | FLAG_CF;
+  }
+  else
+    sys->regs.eflags &= ~(FLAG_AF | FLAG_CF);
+
+  set_reg16(sys,0,(ah << 8) | (al & 0x0F));
+}
+
+static void op_inc_r16(system__s *sys,const insn__s *insn)
+{
+  unsigned r = insn->opcode & 7;
+  set_reg16(sys,r,alu_incdec(sys,get_reg16(sys,r),false,true));
+}
+
+static void op_dec_r16(system__s *sys,const insn__s *insn)
+{
+  unsigned r = insn->opcode & 7;
+  set_reg16(sys,r,alu_incdec(sys,get_reg16(sys,r),true,true));
+}
+
+static void op_push_r16(system__s *sys,const insn__s *insn)
+{
+  unsigned r = insn->opcode & 7;
+
+  /* the 8086 pushes the already decremented SP */
+  if (r == 4)
+    push16(sys,sys->regs.esp - 2);
+  else
+    push16(sys,get_reg16(sys,r));
+}
+
+static void op_pop_r16(system__s *sys,const insn__s *insn)
+{
+  set_reg16(sys,insn->opcode & 7,pop16(sys));
+}
+
+static void op_jcc(system__s *sys,const insn__s *insn)
+{
+  if (condition(sys,insn->opcode & 0x0F))
+    jump_rel(sys,(int8_t)insn->imm);
+}
+
+static void op_grp1(system__s *sys,const insn__s *insn)
+{
+  bool     w   = insn->opcode & 1;
+  uint16_t imm = insn->opcode == 0x83 ? (uint16_t)(int8_t)insn->imm : insn->imm;
+  uint16_t r   = alu(sys,insn->reg,rm_read(sys,insn,w),imm,w);
+
+  if (insn->reg != ALU_CMP)
+    rm_write(sys,insn,w,r);
+}
+
+static void op_test_rm_r(system__s *sys,const insn__s *insn)
+{
+  bool w = insn->opcode & 1;
+  alu(sys,ALU_AND,rm_read(sys,insn,w),reg_read(sys,insn,w),w);
+}
+
+static void op_xchg_rm_r(system__s *sys,const insn__s *insn)
+{
+  bool     w = insn->opcode & 1;
+  uint16_t a = rm_read(sys,insn,w);
+  uint16_t b = reg_read(sys,insn,w);
+
+  rm_write(sys,insn,w,b);
+  reg_write(sys,insn,w,a);
+}
+
+static void op_mov_rm_r(system__s *sys,const insn__s *insn)
+{
+  bool w = insn->opcode & 1;
+  rm_write(sys,insn,w,reg_read(sys,insn,w));
+}
+
+static void op_mov_r_rm(system__s *sys,const insn__s *insn)
+{
+  bool w = insn->opcode & 1;
+  reg_write(sys,insn,w,rm_read(sys,insn,w));
+}
+
+static void op_mov_rm_sreg(system__s *sys,const insn__s *insn)
+{
+  rm_write(sys,insn,true,get_sreg(sys,insn->reg & 3));
+}
+
+static void op_lea(system__s *sys,const insn__s *insn)
+{
+  uint16_t seg;
+  uint16_t off;
+
+  if (insn->mod != 3)
+  {
+    decode_ea(sys,insn,&seg,&off);
+    set_reg16(sys,insn->reg,off);
+  }
+}
+
+static void op_mov_sreg_rm(system__s *sys,const insn__s *insn)
+{
+  set_sreg(sys,insn->reg & 3,rm_read(sys,insn,true));
+}
+
+static void op_pop_rm(system__s *sys,const insn__s *insn)
+{
+  rm_write(sys,insn,true,pop16(sys));
+}
+
+static void op_xchg_ax(system__s *sys,const insn__s *insn)
+{
+  unsigned r = insn->opcode & 7;
+  uint16_t t = get_reg16(sys,r);
+
+  set_reg16(sys,r,get_reg16(sys,0));
+  set_reg16(sys,0,t);
+}
+
+static void op_cbw(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  set_reg16(sys,0,(uint16_t)(int8_t)(sys->regs.eax & 0xFF));
+}
+
+static void op_cwd(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  set_reg16(sys,2,(sys->regs.eax & 0x8000) ? 0xFFFF : 0x0000);
+}
+
+static void op_call_far(system__s *sys,const insn__s *insn)
+{
+  push16(sys,sys->regs.cs);
+  push16(sys,sys->regs.eip);
+  sys->regs.cs  = insn->imm2;
+  sys->regs.eip = insn->imm;
+}
+
+static void op_pushf(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  push16(sys,(flags(sys) & FLAGS_8086) | 0xF002);
+}
+
+static void op_popf(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  sys->regs.eflags = pop16(sys) & FLAGS_8086;
+  sys->lazy.op     = LF_NONE;
+}
+
+static void op_sahf(system__s *sys,const insn__s *insn)
+{
+  uint32_t mask = FLAG_SF | FLAG_ZF | FLAG_AF | FLAG_PF | FLAG_CF;
+
+  (void)insn;
+  sys->regs.eflags = (flags(sys) & ~mask) | ((sys->regs.eax >> 8) & mask);
+}
+
+static void op_lahf(system__s *sys,const insn__s *insn)
+{
+  uint32_t mask = FLAG_SF | FLAG_ZF | FLAG_AF | FLAG_PF | FLAG_CF;
+
+  (void)insn;
+  set_reg8(sys,4,flags_get(sys,mask) | 0x02);
+}
+
+static void op_mov_a_moffs(system__s *sys,const insn__s *insn)
+{
+  uint16_t seg = data_seg(sys,insn,SR_DS);
+
+  switch(insn->opcode)
+  {
+    case 0xA0: set_reg8(sys,0,mem_rb(sys,seg,insn->imm));      break;
+    case 0xA1: set_reg16(sys,0,mem_rw(sys,seg,insn->imm));     break;
+    case 0xA2: mem_wb(sys,seg,insn->imm,sys->regs.eax & 0xFF); break;
+    default:   mem_ww(sys,seg,insn->imm,sys->regs.eax);        break;
+  }
+}
+
+/*----------------------------------------------------------------------
+; String instructions.  A REP prefix runs the whole loop inside the handler
+; instead of re-dispatching the instruction CX times.
+;----------------------------------------------------------------------*/
+
+static inline int16_t string_delta(system__s *sys,bool w)
+{
+  int16_t d = w ? 2 : 1;
+  return (sys->regs.eflags & FLAG_DF) ? -d : d;
+}
+
+static void op_movs(system__s *sys,const insn__s *insn)
+{
+  bool     w     = insn->opcode & 1;
+  int16_t  delta = string_delta(sys,w);
+  uint16_t src   = data_seg(sys,insn,SR_DS);
+  uint16_t si    = sys->regs.esi;
+  uint16_t di    = sys->regs.edi;
+  uint16_t cx    = insn->rep ? sys->regs.ecx : 1;
+
+  for ( ; cx != 0 ; cx--)
+  {
+    if (w)
+      mem_ww(sys,sys->regs.es,di,mem_rw(sys,src,si));
+    else
+      mem_wb(sys,sys->regs.es,di,mem_rb(sys,src,si));
+    si += delta;
+    di += delta;
+  }
+
+  sys->regs.esi = si;
+  sys->regs.edi = di;
+  if (insn->rep)
+    sys->regs.ecx = 0;
+}
+
+static void op_stos(system__s *sys,const insn__s *insn)
+{
+  bool     w     = insn->opcode & 1;
+  int16_t  delta = string_delta(sys,w);
+  uint16_t di    = sys->regs.edi;
+  uint16_t cx    = insn->rep ? sys->regs.ecx : 1;
+
+  for ( ; cx != 0 ; cx--)
+  {
+    if (w)
+      mem_ww(sys,sys->regs.es,di,sys->regs.eax);
+    else
+      mem_wb(sys,sys->regs.es,di,sys->regs.eax & 0xFF);
+    di += delta;
+  }
+
+  sys->regs.edi = di;
+  if (insn->rep)
+    sys->regs.ecx = 0;
+}
+
+static void op_lods(system__s *sys,const insn__s *insn)
+{
+  bool     w     = insn->opcode & 1;
+  int16_t  delta = string_delta(sys,w);
+  uint16_t src   = data_seg(sys,insn,SR_DS);
+  uint16_t si    = sys->regs.esi;
+  uint16_t cx    = insn->rep ? sys->regs.ecx : 1;
+
+  for ( ; cx != 0 ; cx--)
+  {
+    if (w)
+      set_reg16(sys,0,mem_rw(sys,src,si));
+    else
+      set_reg8(sys,0,mem_rb(sys,src,si));
+    si += delta;
+  }
+
+  sys->regs.esi = si;
+  if (insn->rep)
+    sys->regs.ecx = 0;
+}
+
+static void op_cmps(system__s *sys,const insn__s *insn)
+{
+  bool     w     = insn->opcode & 1;
+  int16_t  delta = string_delta(sys,w);
+  uint16_t src   = data_seg(sys,insn,SR_DS);
+
+  if (insn->rep && ((sys->regs.ecx & 0xFFFF) == 0))
+    return;
+
+  do
+  {
+    uint16_t a = w ? mem_rw(sys,src,sys->regs.esi) : mem_rb(sys,src,sys->regs.esi);
+    uint16_t b = w ? mem_rw(sys,sys->regs.es,sys->regs.edi) : mem_rb(sys,sys->regs.es,sys->regs.edi);
+
+    alu(sys,ALU_CMP,a,b,w);
+    sys->regs.esi = (sys->regs.esi + delta) & 0xFFFF;
+    sys->regs.edi = (sys->regs.edi + delta) & 0xFFFF;
+
+    if (!insn->rep)
+      break;
+
+    sys->regs.ecx = (sys->regs.ecx - 1) & 0xFFFF;
+    if ((insn->rep == 0xF3) != (flags_get(sys,FLAG_ZF) != 0))
+      break;
+  } while (sys->regs.ecx != 0);
+}
+
+static void op_scas(system__s *sys,const insn__s *insn)
+{
+  bool     w     = insn->opcode & 1;
+  int16_t  delta = string_delta(sys,w);
+  uint16_t a     = w ? get_reg16(sys,0) : get_reg8(sys,0);
+
+  if (insn->rep && ((sys->regs.ecx & 0xFFFF) == 0))
+    return;
+
+  do
+  {
+    uint16_t b = w ? mem_rw(sys,sys->regs.es,sys->regs.edi) : mem_rb(sys,sys->regs.es,sys->regs.edi);
+
+    alu(sys,ALU_CMP,a,b,w);
+    sys->regs.edi = (sys->regs.edi + delta) & 0xFFFF;
+
+    if (!insn->rep)
+      break;
+
+    sys->regs.ecx = (sys->regs.ecx - 1) & 0xFFFF;
+    if ((insn->rep == 0xF3) != (flags_get(sys,FLAG_ZF) != 0))
+      break;
+  } while (sys->regs.ecx != 0);
+}
+
+static void op_test_a_imm(system__s *sys,const insn__s *insn)
+{
+  bool w = insn->opcode & 1;
+  alu(sys,ALU_AND,w ? get_reg16(sys,0) : get_reg8(sys,0),insn->imm,w);
+}
+
+static void op_mov_r8_imm(system__s *sys,const insn__s *insn)
+{
+  set_reg8(sys,insn->opcode & 7,insn->imm);
+}
+
+static void op_mov_r16_imm(system__s *sys,const insn__s *insn)
+{
+  set_reg16(sys,insn->opcode & 7,insn->imm);
+}
+
+static void op_ret(system__s *sys,const insn__s *insn)
+{
+  sys->regs.eip = pop16(sys);
+  if (!(insn->opcode & 1))
+    sys->regs.esp = (sys->regs.esp + insn->imm) & 0xFFFF;
+}
+
+static void op_retf(system__s *sys,const insn__s *insn)
+{
+  sys->regs.eip = pop16(sys);
+  sys->regs.cs  = pop16(sys);
+  if (!(insn->opcode & 1))
+    sys->regs.esp = (sys->regs.esp + insn->imm) & 0xFFFF;
+}
+
+static void op_les_lds(system__s *sys,const insn__s *insn)
+{
+  uint16_t seg;
+  uint16_t off;
+
+  if (insn->mod == 3)
+    return;
+
+  decode_ea(sys,insn,&seg,&off);
+  set_reg16(sys,insn->reg,mem_rw(sys,seg,off));
+  set_sreg(sys,insn->opcode == 0xC4 ? SR_ES : SR_DS,mem_rw(sys,seg,off + 2));
+}
+
+static void op_mov_rm_imm(system__s *sys,const insn__s *insn)
+{
+  rm_write(sys,insn,insn->opcode & 1,insn->imm);
+}
+
+static void op_int3(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  cpu_interrupt(sys,3);
+}
+
+static void op_int(system__s *sys,const insn__s *insn)
+{
+  cpu_interrupt(sys,insn->imm);
+}
+
+static void op_into(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  if (flags_get(sys,FLAG_OF))
+    cpu_interrupt(sys,4);
+}
+
+static void op_iret(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  sys->regs.eip    = pop16(sys);
+  sys->regs.cs     = pop16(sys);
+  sys->regs.eflags = pop16(sys) & FLAGS_8086;
+  sys->lazy.op     = LF_NONE;
+}
+
+static void op_grp2(system__s *sys,const insn__s *insn)
+{
+  bool     w     = insn->opcode & 1;
+  unsigned count = (insn->opcode & 2) ? sys->regs.ecx & 0xFF : 1;
+
+  if (count != 0)
+    rm_write(sys,insn,w,shift(sys,insn->reg,rm_read(sys,insn,w),count,w));
+}
+
+static void op_aam(system__s *sys,const insn__s *insn)
+{
+  uint8_t al = sys->regs.eax & 0xFF;
+  uint8_t base = insn->imm;
+
+  if (base == 0)
+  {
+    cpu_interrupt(sys,0);
+    return;
+  }
+
+  set_reg16(sys,0,((al / base) << 8) | (al % base));
+  sys->regs.eflags = (flags(sys) & ~(FLAG_SF | FLAG_ZF | FLAG_PF)) | flags_szp(al % base,false);
+}
+
+static void op_aad(system__s *sys,const insn__s *insn)
+{
+  uint8_t al = sys->regs.eax & 0xFF;
+  uint8_t ah = (sys->regs.eax >> 8) & 0xFF;
+  uint8_t r  = al + ah * insn->imm;
+
+  set_reg16(sys,0,r);
+  sys->regs.eflags = (flags(sys) & ~(FLAG_SF | FLAG_ZF | FLAG_PF)) | flags_szp(r,false);
+}
+
+static void op_salc(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  set_reg8(sys,0,flags_get(sys,FLAG_CF) ? 0xFF : 0x00);
+}
+
+static void op_xlat(system__s *sys,const insn__s *insn)
+{
+  uint16_t off = sys->regs.ebx + (sys->regs.eax & 0xFF);
+  set_reg8(sys,0,mem_rb(sys,data_seg(sys,insn,SR_DS),off));
+}
+
+static void op_loop(system__s *sys,const insn__s *insn)
+{
+  bool take;
+
+  sys->regs.ecx = (sys->regs.ecx - 1) & 0xFFFF;
+  take          = sys->regs.ecx != 0;
+
+  if (insn->opcode == 0xE0)
+    take = take && !flags_get(sys,FLAG_ZF);
+  else if (insn->opcode == 0xE1)
+    take = take && flags_get(sys,FLAG_ZF);
+
+  if (take)
+    jump_rel(sys,(int8_t)insn->imm);
+}
+
+static void op_jcxz(system__s *sys,const insn__s *insn)
+{
+  if ((sys->regs.ecx & 0xFFFF) == 0)
+    jump_rel(sys,(int8_t)insn->imm);
+}
+
+static void op_in(system__s *sys,const insn__s *insn)
+{
+  /* no devices; the bus floats high */
+  if (insn->opcode & 1)
+    set_reg16(sys,0,0xFFFF);
+  else
+    set_reg8(sys,0,0xFF);
+}
+
+static void op_out(system__s *sys,const insn__s *insn)
+{
+  if (sys->debug)
+    fprintf(stderr,"OUT %04X\n",(insn->opcode & 8) ? sys->regs.edx & 0xFFFF : insn->imm);
+}
+
+static void op_call_rel(system__s *sys,const insn__s *insn)
+{
+  push16(sys,sys->regs.eip);
+  jump_rel(sys,insn->imm);
+}
+
+static void op_jmp_rel16(system__s *sys,const insn__s *insn)
+{
+  jump_rel(sys,insn->imm);
+}
+
+static void op_jmp_far(system__s *sys,const insn__s *insn)
+{
+  sys->regs.cs  = insn->imm2;
+  sys->regs.eip = insn->imm;
+}
+
+static void op_jmp_rel8(system__s *sys,const insn__s *insn)
+{
+  jump_rel(sys,(int8_t)insn->imm);
+}
+
+static void op_hlt(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+
+  /* nothing will ever interrupt us, so this is the end */
+  fprintf(stderr,"HLT at %04X:%04X\n",sys->regs.cs,(uint16_t)(sys->regs.eip - 1));
+  sys->running = false;
+}
+
+static void op_cmc(system__s *sys,const insn__s *insn)
+{
+  (void)insn;
+  sys->regs.eflags = flags(sys) ^ FLAG_CF;
+}
+
+static void op_grp3(system__s *sys,const insn__s *insn)
+{
+  bool     w = insn->opcode & 1;
+  uint16_t v = rm_read(sys,insn,w);
+  uint32_t f;
+
+  switch(insn->reg)
+  {
+    case 0:
+    case 1:
+         alu(sys,ALU_AND,v,insn->imm,w);
+         return;
+
+    case 2:
+         rm_write(sys,insn,w,~v);
+         return;
+
+    case 3:
+         rm_write(sys,insn,w,alu(sys,ALU_SUB,0,v,w));
+         return;
+
+    case 4:
+         f = flags(sys) & ~(FLAG_CF | FLAG_OF);
+         if (w)
+         {
+           uint32_t r = (uint32_t)get_reg16(sys,0) * v;
+           set_reg16(sys,0,r & 0xFFFF);
+           set_reg16(sys,2,r >> 16);
+           if (r >> 16) f |= FLAG_CF | FLAG_OF;
+         }
+         else
+         {
+           uint16_t r = (uint16_t)get_reg8(sys,0) * v;
+           set_reg16(sys,0,r);
+           if (r >> 8) f |= FLAG_CF | FLAG_OF;
+         }
+         break;
+
+    case 5:
+         f = flags(sys) & ~(FLAG_CF | FLAG_OF);
+         if (w)
+         {
+           int32_t r = (int32_t)(int16_t)get_reg16(sys,0) * (int16_t)v;
+           set_reg16(sys,0,(uint32_t)r & 0xFFFF);
+           set_reg16(sys,2,(uint32_t)r >> 16);
+           if (r != (int16_t)r) f |= FLAG_CF | FLAG_OF;
+         }
+         else
+         {
+           int16_t r = (int16_t)(int8_t)get_reg8(sys,0) * (int8_t)v;
+           set_reg16(sys,0,(uint16_t)r);
+           if (r != (int8_t)r) f |= FLAG_CF | FLAG_OF;
+         }
+         break;
+
+    case 6:
+         if (v == 0)
+         {
+           cpu_interrupt(sys,0);
+           return;
+         }
+         if (w)
+         {
+           uint32_t n = ((uint32_t)get_reg16(sys,2) << 16) | get_reg16(sys,0);
+           uint32_t q = n / v;
+           if (q > 0xFFFF)
+           {
+             cpu_interrupt(sys,0);
+             return;
+           }
+           set_reg16(sys,0,q);
+           set_reg16(sys,2,n % v);
+         }
+         else
+         {
+           uint16_t n = get_reg16(sys,0);
+           uint16_t q = n / v;
+           if (q > 0xFF)
+           {
+             cpu_interrupt(sys,0);
+             return;
+           }
+           set_reg16(sys,0,((n % v) << 8) | q);
+         }
+         return;
+
+    default:
+         if (v == 0)
+         {
+           cpu_interrupt(sys,0);
+           return;
+         }
+
+         /*-------------------------------------------------------------
+         ; Unlike later parts, the 8086 faults on the most negative
+         ; quotient as well.
+         ;--------------------------------------------------------------*/
+
+         if (w)
+         {
+           int64_t n = (int32_t)(((uint32_t)get_reg16(sys,2) << 16) | get_reg16(sys,0));
+           int64_t q = n / (int16_t)v;
+           if ((q > 0x7FFF) || (q < -0x7FFF))
+           {
+             cpu_interrupt(sys,0);
+             return;
+           }
+           set_reg16(sys,0,(uint16_t)q);
+           set_reg16(sys,2,(uint16_t)(n % (int16_t)v));
+         }
+         else
+         {
+           int32_t n = (int16_t)get_reg16(sys,0);
+           int32_t q = n / (int8_t)v;
+           if ((q > 0x7F) || (q < -0x7F))
+           {
+             cpu_interrupt(sys,0);
+             return;
+           }
+           set_reg16(sys,0,((uint8_t)(n % (int8_t)v) << 8) | (uint8_t)q);
+         }
+         return;
+  }
+
+  sys->regs.eflags = f;
+}
+
+static void op_flag(system__s *sys,const insn__s *insn)
+{
+  static const uint32_t bit[] = { FLAG_CF , FLAG_IF , FLAG_DF };
+  uint32_t f = bit[(insn->opcode - 0xF8) >> 1];
+
+  flags_sync(sys);
+  if (insn->opcode & 1)
+    sys->regs.eflags |= f;
+  else
+    sys->regs.eflags &= ~f;
+}
+
+static void op_grp4(system__s *sys,const insn__s *insn)
+{
+  if (insn->reg < 2)
+    rm_write(sys,insn,false,alu_incdec(sys,rm_read(sys,insn,false),insn->reg == 1,false));
+}
+
+static void op_grp5(system__s *sys,const insn__s *insn)
+{
+  uint16_t seg;
+  uint16_t off;
+  uint16_t v;
+
+  switch(insn->reg)
+  {
+    case 0:
+    case 1:
+         rm_write(sys,insn,true,alu_incdec(sys,rm_read(sys,insn,true),insn->reg == 1,true));
+         break;
+
+    case 2:
+         v = rm_read(sys,insn,true);
+         push16(sys,sys->regs.eip);
+         sys->regs.eip = v;
+         break;
+
+    case 3:
+    case 5:
+         if (insn->mod == 3)
+           break;
+         decode_ea(sys,insn,&seg,&off);
+         if (insn->reg == 3)
+         {
+           push16(sys,sys->regs.cs);
+           push16(sys,sys->regs.eip);
+         }
+         sys->regs.eip = mem_rw(sys,seg,off);
+         sys->regs.cs  = mem_rw(sys,seg,off + 2);
+         break;
+
+    case 4:
+         sys->regs.eip = rm_read(sys,insn,true);
+         break;
+
+    default:
+         if ((insn->mod == 3) && (insn->rm == 4))
+           push16(sys,sys->regs.esp - 2);
+         else
+           push16(sys,rm_read(sys,insn,true));
+         break;
+  }
+}
+
+/********************************************************************/
+
+#define M	OI_MODRM
+#define I8	OI_IMM8
+#define I16	OI_IMM16
+#define P	OI_PREFIX
+#define B	OI_BRANCH
+
+static const uint8_t op_info[256] =
+{
+  /* 00 */ M,M,M,M,I8,I16,0,0, M,M,M,M,I8,I16,0,B,
+  /* 10 */ M,M,M,M,I8,I16,0,0, M,M,M,M,I8,I16,0,0,
+  /* 20 */ M,M,M,M,I8,I16,P,0, M,M,M,M,I8,I16,P,0,
+  /* 30 */ M,M,M,M,I8,I16,P,0, M,M,M,M,I8,I16,P,0,
+  /* 40 */ 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  /* 50 */ 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  /* 60 */ I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B, I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,
+  /* 70 */ I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B, I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,I8|B,
+  /* 80 */ M|I8,M|I16,M|I8,M|I8,M,M,M,M, M,M,M,M,M,M,M,M,
+  /* 90 */ 0,0,0,0,0,0,0,0, 0,0,OI_FAR|B,0,0,0,0,0,
+  /* A0 */ I16,I16,I16,I16,0,0,0,0, I8,I16,0,0,0,0,0,0,
+  /* B0 */ I8,I8,I8,I8,I8,I8,I8,I8, I16,I16,I16,I16,I16,I16,I16,I16,
+  /* C0 */ I16|B,B,I16|B,B,M,M,M|I8,M|I16, I16|B,B,I16|B,B,B,I8|B,B,B,
+  /* D0 */ M,M,M,M,I8|B,I8,0,0, M,M,M,M,M,M,M,M,
+  /* E0 */ I8|B,I8|B,I8|B,I8|B,I8,I8,I8,I8, I16|B,I16|B,OI_FAR|B,I8|B,0,0,0,0,
+  /* F0 */ P,P,P,P,B,0,M|OI_GRP3,M|OI_GRP3, 0,0,0,0,0,0,M,M,
+};
+
+#undef M
+#undef I8
+#undef I16
+#undef P
+#undef B
+
+static const handler__f op_handlers[256] =
+{
+  /* 00 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_push_sreg,op_pop_sreg,
+  /* 08 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_push_sreg,op_pop_sreg,
+  /* 10 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_push_sreg,op_pop_sreg,
+  /* 18 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_push_sreg,op_pop_sreg,
+  /* 20 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_nop,op_daa,
+  /* 28 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_nop,op_das,
+  /* 30 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_nop,op_aaa_aas,
+  /* 38 */ op_alu_rm_r,op_alu_rm_r,op_alu_r_rm,op_alu_r_rm,op_alu_a_imm,op_alu_a_imm,op_nop,op_aaa_aas,
+  /* 40 */ op_inc_r16,op_inc_r16,op_inc_r16,op_inc_r16,op_inc_r16,op_inc_r16,op_inc_r16,op_inc_r16,
+  /* 48 */ op_dec_r16,op_dec_r16,op_dec_r16,op_dec_r16,op_dec_r16,op_dec_r16,op_dec_r16,op_dec_r16,
+  /* 50 */ op_push_r16,op_push_r16,op_push_r16,op_push_r16,op_push_r16,op_push_r16,op_push_r16,op_push_r16,
+  /* 58 */ op_pop_r16,op_pop_r16,op_pop_r16,op_pop_r16,op_pop_r16,op_pop_r16,op_pop_r16,op_pop_r16,
+  /* 60 */ op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,
+  /* 68 */ op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,
+  /* 70 */ op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,
+  /* 78 */ op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,op_jcc,
+  /* 80 */ op_grp1,op_grp1,op_grp1,op_grp1,op_test_rm_r,op_test_rm_r,op_xchg_rm_r,op_xchg_rm_r,
+  /* 88 */ op_mov_rm_r,op_mov_rm_r,op_mov_r_rm,op_mov_r_rm,op_mov_rm_sreg,op_lea,op_mov_sreg_rm,op_pop_rm,
+  /* 90 */ op_nop,op_xchg_ax,op_xchg_ax,op_xchg_ax,op_xchg_ax,op_xchg_ax,op_xchg_ax,op_xchg_ax,
+  /* 98 */ op_cbw,op_cwd,op_call_far,op_nop,op_pushf,op_popf,op_sahf,op_lahf,
+  /* A0 */ op_mov_a_moffs,op_mov_a_moffs,op_mov_a_moffs,op_mov_a_moffs,op_movs,op_movs,op_cmps,op_cmps,
+  /* A8 */ op_test_a_imm,op_test_a_imm,op_stos,op_stos,op_lods,op_lods,op_scas,op_scas,
+  /* B0 */ op_mov_r8_imm,op_mov_r8_imm,op_mov_r8_imm,op_mov_r8_imm,op_mov_r8_imm,op_mov_r8_imm,op_mov_r8_imm,op_mov_r8_imm,
+  /* B8 */ op_mov_r16_imm,op_mov_r16_imm,op_mov_r16_imm,op_mov_r16_imm,op_mov_r16_imm,op_mov_r16_imm,op_mov_r16_imm,op_mov_r16_imm,
+  /* C0 */ op_ret,op_ret,op_ret,op_ret,op_les_lds,op_les_lds,op_mov_rm_imm,op_mov_rm_imm,
+  /* C8 */ op_retf,op_retf,op_retf,op_retf,op_int3,op_int,op_into,op_iret,
+  /* D0 */ op_grp2,op_grp2,op_grp2,op_grp2,op_aam,op_aad,op_salc,op_xlat,
+  /* D8 */ op_nop,op_nop,op_nop,op_nop,op_nop,op_nop,op_nop,op_nop,
+  /* E0 */ op_loop,op_loop,op_loop,op_jcxz,op_in,op_in,op_out,op_out,
+  /* E8 */ op_call_rel,op_jmp_rel16,op_jmp_far,op_jmp_rel8,op_in,op_in,op_out,op_out,
+  /* F0 */ op_nop,op_nop,op_nop,op_nop,op_hlt,op_cmc,op_grp3,op_grp3,
+  /* F8 */ op_flag,op_flag,op_flag,op_flag,op_flag,op_flag,op_grp4,op_grp5,
+};
+
+/********************************************************************/
+
+static void decode_instruction(system__s *sys,uint16_t ip,insn__s *insn)
+{
+  uint8_t        buf[16];
+  const uint8_t *p;
+  size_t         addr = linear(sys,sys->regs.cs,ip);
+  uint8_t        info;
+  uint8_t        op;
+  
+  /*---------------------------------------------------------------------
+  ; An instruction (with our cap on prefixes) is never longer than 16
+  ; bytes, so unless we're near the end of the segment or of memory, just
+  ; decode in place.  Otherwise, gather the bytes with the wrap applied.
+  ;---------------------------------------------------------------------*/
+  
+  if ((ip <= 0x10000 - sizeof(buf)) && (addr + sizeof(buf) <= sys->amask + 1))
+    p = &sys->mem[addr];
+  else
+  {
+    for (size_t i = 0 ; i < sizeof(buf) ; i++)
+      buf[i] = mem_rb(sys,sys->regs.cs,ip + i);
+    p = buf;
+  }
+  
+  insn->rep = 0;
+  insn->seg = -1;
+  insn->len = 1;
+  op        = *p++;
+  info      = op_info[op];
+  
+  /*---------------------------------------------------------------------
+  ; The 8086 will happily take any number of prefixes, but we cap it so
+  ; the instruction fits in the buffer.  Past that, the prefix just acts
+  ; as a NOP.
+  ;---------------------------------------------------------------------*/
+  
+  while ((info & OI_PREFIX) && (insn->len < 10))
+  {
+    switch(op)
+    {
+      case 0x26: insn->seg = SR_ES; break;
+      case 0x2E: insn->seg = SR_CS; break;
+      case 0x36: insn->seg = SR_SS; break;
+      case 0x3E: insn->seg = SR_DS; break;
+      case 0xF2:
+      case 0xF3: insn->rep = op;    break;
+      default: break;
+    }
+    
+    op   = *p++;
+    info = op_info[op];
+    insn->len++;
+  }
+  
+  insn->opcode  = op;
+  insn->handler = op_handlers[op];
+  
+  if (info & OI_MODRM)
+  {
+    uint8_t modrm = *p++;
+    
+    insn->mod  = modrm >> 6;
+    insn->reg  = (modrm >> 3) & 7;
+    insn->rm   = modrm & 7;
+    insn->disp = 0;
+    insn->len++;
+    
+    if ((insn->mod == 2) || ((insn->mod == 0) && (insn->rm == 6)))
+    {
+      insn->disp = p[0] | (p[1] << 8);
+      p         += 2;
+      insn->len += 2;
+    }
+    else if (insn->mod == 1)
+    {
+      insn->disp = (uint16_t)(int8_t)*p++;
+      insn->len++;
+    }
+    
+    if ((info & OI_GRP3) && (insn->reg < 2))
+      info |= (op & 1) ? OI_IMM16 : OI_IMM8;
+  }
+  
+  if (info & OI_IMM8)
+  {
+    insn->imm = p[0];
+    insn->len++;
+  }
+  else if (info & OI_IMM16)
+  {
+    insn->imm  = p[0] | (p[1] << 8);
+    insn->len += 2;
+  }
+  else if (info & OI_FAR)
+  {
+    insn->imm  = p[0] | (p[1] << 8);
+    insn->imm2 = p[2] | (p[3] << 8);
+    insn->len += 4;
+  }
+}
+
+/********************************************************************/
+
+static void execute_instruction(system__s *sys)
+{
+  insn__s insn;
+
+  decode_instruction(sys,sys->regs.eip,&insn);
+
+  if (sys->debug)
+    fprintf(stderr, "Execute: %04X:%04X: %02X\n", sys->regs.cs, (uint16_t)sys->regs.eip, insn.opcode);
+
+  sys->regs.eip = (sys->regs.eip + insn.len) & 0xFFFF;
+  insn.handler(sys,&insn);
+  sys->icount++;
+}
+
+/********************************************************************/
+
+static bool insn_ends_block(const insn__s *insn)
+{
+  if (op_info[insn->opcode] & OI_BRANCH)
+    return true;
+  
+  /*---------------------------------------------------------------------
+  ; Besides the obvious control transfers, anything that can raise a
+  ; divide fault or load CS changes CS:IP behind the block's back.
+  ;---------------------------------------------------------------------*/
+  
+  switch(insn->opcode)
+  {
+    case 0x8E: return (insn->reg & 3) == SR_CS;
+    case 0xF6:
+    case 0xF7: return insn->reg >= 6;
+    case 0xFF: return (insn->reg >= 2) && (insn->reg <= 5);
+    default:   return false;
+  }
+}
+
+static inline size_t bcache_hash(size_t addr)
+{
+  return (addr ^ (addr >> 12)) & (BLOCK_HASH - 1);
+}
+
+static void bcache_flush(bcache__s *c)
+{
+  memset(c->code,0,sizeof(c->code));
+  memset(c->page,0,sizeof(c->page));
+  memset(c->hash,0,sizeof(c->hash));
+  c->nblocks  = 0;
+  c->ninsns   = 0;
+  c->jit_used = 0;
+  c->flushes++;
+}
+
+static block__s *bcache_lookup(bcache__s *c,size_t addr)
+{
+  for (block__s *b = c->hash[bcache_hash(addr)] ; b != NULL ; b = b->hash_link)
+    if (b->addr == addr)
+      return b;
+  return NULL;
+}
+
+static void bcache_kill(bcache__s *c,block__s *b)
+{
+  block__s **pb;
+  
+  for (pb = &c->hash[bcache_hash(b->addr)] ; *pb != b ; pb = &(*pb)->hash_link)
+    ;
+  *pb = b->hash_link;
+  
+  for (size_t p = b->addr >> CODE_PAGE_SHIFT ; p <= (b->end - 1) >> CODE_PAGE_SHIFT ; p++)
+    c->code[p]--;
+  
+  b->valid = false;
+  c->invalidations++;
+}
+
+static void bcache_invalidate(system__s *sys,size_t addr,size_t len)
+{
+  bcache__s *c = sys->cache;
+  size_t     first;
+  size_t     last;
+  
+  if (len == 0)
+    return;
+  
+  first = addr >> CODE_PAGE_SHIFT;
+  last  = (addr + len - 1) >> CODE_PAGE_SHIFT;
+  
+  /*---------------------------------------------------------------------
+  ; Blocks are only listed under the page they start in, but one may run
+  ; into the following page, so the page before the range is checked too.
+  ;---------------------------------------------------------------------*/
+  
+  for (size_t p = first > 0 ? first - 1 : 0 ; (p <= last) && (p < CODE_PAGES) ; p++)
+  {
+    block__s **pb = &c->page[p];
+    
+    while (*pb != NULL)
+    {
+      block__s *b = *pb;
+      
+      if ((b->addr < addr + len) && (addr < b->end))
+      {
+        *pb = b->page_link;
+        bcache_kill(c,b);
+      }
+      else
+        pb = &b->page_link;
+    }
+  }
+}
+
+static block__s *bcache_translate(system__s *sys,size_t addr)
+{
+  bcache__s *c  = sys->cache;
+  uint16_t   ip = sys->regs.eip;
+  block__s  *b;
+  size_t     h;
+  
+  if (
+          (c->nblocks == BLOCK_MAX)
+       || (c->ninsns + BLOCK_INSNS > BLOCK_ARENA)
+       || (c->jit_used + JIT_SLACK > JIT_SIZE)
+     )
+    bcache_flush(c);
+  
+  b        = &c->blocks[c->nblocks];
+  b->insns = &c->arena[c->ninsns];
+  b->count = 0;
+  
+  /*---------------------------------------------------------------------
+  ; Code that wraps around the end of its segment or of memory is left to
+  ; execute_instruction(); it's never worth caching.
+  ;---------------------------------------------------------------------*/
+  
+  while (
+             (b->count < BLOCK_INSNS)
+          && (ip <= 0x10000 - 16)
+          && (addr + (uint16_t)(ip - sys->regs.eip) + 16 <= sys->amask + 1)
+        )
+  {
+    insn__s *insn = &b->insns[b->count++];
+    
+    decode_instruction(sys,ip,insn);
+    ip += insn->len;
+    if (insn_ends_block(insn))
+      break;
+  }
+  
+  if (b->count == 0)
+    return NULL;
+  
+  c->nblocks++;
+  c->ninsns   += b->count;
+  b->addr      = addr;
+  b->end       = addr + (uint16_t)(ip - sys->regs.eip);
+  b->valid     = true;
+  b->slot      = 0;
+  b->next[0]   = NULL;
+  b->next[1]   = NULL;
+  b->execs     = 0;
+  b->nojit     = false;
+  b->jit       = NULL;
+  h            = bcache_hash(addr);
+  b->hash_link = c->hash[h];
+  c->hash[h]   = b;
+  b->page_link = c->page[addr >> CODE_PAGE_SHIFT];
+  c->page[addr >> CODE_PAGE_SHIFT] = b;
+  
+  for (size_t p = addr >> CODE_PAGE_SHIFT ; p <= (b->end - 1) >> CODE_PAGE_SHIFT ; p++)
+    c->code[p]++;
+  
+  return b;
+}
+
+/*---------------------------------------------------------------------
+; The JIT.  Once a cached block has run JIT_HOT times, it is translated
+; into x86_64 code operating directly on the x86_regs in system__s:
+;
+;	* register and immediate forms of the common ALU, MOV, INC/DEC,
+;	  shift-by-one and flag instructions are emitted inline, with the
+;	  host flags merged back into regs.eflags;
+;	* any other instruction that doesn't end a block becomes a direct
+;	  call to its interpreter handler;
+;	* a closing Jcc, JMP, LOOP or JCXZ is emitted inline;
+;	* anything else that ends a block (INT, CALL, RET, ...) is left for
+;	  the interpreter, which picks up from where the native code stops.
+;
+; The code is specialized on the IP the block was entered with (so all the
+; IP arithmetic is constant), and it returns the number of instructions
+; it retired.  Register assignment: RBX = sys, RBP = block.
+;---------------------------------------------------------------------*/
+
+typedef struct journal
+{
+  size_t  n;
+  size_t  max;
+  struct
+  {
+    uint32_t addr;
+    uint8_t  old;
+    uint8_t  new;
+  }      *e;
+} journal__s;
+
+static void journal_add(journal__s *j,size_t addr,uint8_t old,uint8_t new)
+{
+  if (j->n == j->max)
+  {
+    j->max = j->max ? j->max * 2 : 256;
+    j->e   = realloc(j->e,j->max * sizeof(j->e[0]));
+    if (j->e == NULL)
+    {
+      perror("realloc()");
+      exit(3);
+    }
+  }
+  
+  j->e[j->n].addr  = addr;
+  j->e[j->n].old   = old;
+  j->e[j->n++].new = new;
+}
+
+#if defined(__x86_64__)
+
+enum { H_EAX , H_ECX , H_EDX };
+
+static inline void emit8(uint8_t **p,uint8_t b)
+{
+  *(*p)++ = b;
+}
+
+static inline void emit32(uint8_t **p,uint32_t v)
+{
+  memcpy(*p,&v,sizeof(v));
+  *p += sizeof(v);
+}
+
+static inline void emit64(uint8_t **p,uint64_t v)
+{
+  memcpy(*p,&v,sizeof(v));
+  *p += sizeof(v);
+}
+
+/* [RBX + disp32] with the given reg field; disp is into sys->regs */
+static inline void emit_sys(uint8_t **p,unsigned reg,size_t disp)
+{
+  emit8(p,0x80 | (reg << 3) | 3);
+  emit32(p,offsetof(system__s,regs) + disp);
+}
+
+static inline size_t guest_reg(unsigned r,bool w)
+{
+  return offsetof(x86_regs,eax) + (w ? r * 4 : reg8_index[r]);
+}
+
+static void emit_load(uint8_t **p,unsigned host,size_t disp,bool w)
+{
+  emit8(p,0x0F);		/* MOVZX host,[RBX + disp] */
+  emit8(p,w ? 0xB7 : 0xB6);
+  emit_sys(p,host,disp);
+}
+
+static void emit_store(uint8_t **p,unsigned host,size_t disp,bool w)
+{
+  if (w)
+    emit8(p,0x66);
+  emit8(p,w ? 0x89 : 0x88);	/* MOV [RBX + disp],host */
+  emit_sys(p,host,disp);
+}
+
+static void emit_imm(uint8_t **p,unsigned host,uint32_t v)
+{
+  emit8(p,0xB8 + host);		/* MOV host,imm32 */
+  emit32(p,v);
+}
+
+static void emit_eflags(uint8_t **p,unsigned op,uint32_t v)
+{
+  emit8(p,0x81);		/* AND/OR/XOR [RBX + eflags],imm32 */
+  emit_sys(p,op,offsetof(x86_regs,eflags));
+  emit32(p,v);
+}
+
+/*---------------------------------------------------------------------
+; Capture the host flags (the result is still in EAX, so the caller has to
+; store it first) and merge those in keep into regs.eflags, clearing those
+; in clear.
+;---------------------------------------------------------------------*/
+
+static void emit_flags(uint8_t **p,uint32_t keep,uint32_t clear)
+{
+  emit8(p,0x9C);		/* PUSHFQ			*/
+  emit8(p,0x5A);		/* POP RDX			*/
+  emit8(p,0x81);		/* AND EDX,keep			*/
+  emit8(p,0xE2);
+  emit32(p,keep);
+  emit8(p,0x8B);		/* MOV EAX,[RBX + eflags]	*/
+  emit_sys(p,H_EAX,offsetof(x86_regs,eflags));
+  emit8(p,0x25);		/* AND EAX,~(keep | clear)	*/
+  emit32(p,~(keep | clear));
+  emit8(p,0x09);		/* OR EAX,EDX			*/
+  emit8(p,0xD0);
+  emit8(p,0x89);		/* MOV [RBX + eflags],EAX	*/
+  emit_sys(p,H_EAX,offsetof(x86_regs,eflags));
+}
+
+static void emit_set_ip(uint8_t **p,uint16_t ip)
+{
+  emit8(p,0xC7);		/* MOV DWORD [RBX + eip],imm32 */
+  emit_sys(p,0,offsetof(x86_regs,eip));
+  emit32(p,ip);
+}
+
+static void emit_exit(uint8_t **p,unsigned count)
+{
+  emit_imm(p,H_EAX,count);	/* MOV EAX,count	*/
+  emit8(p,0x48);		/* ADD RSP,8		*/
+  emit8(p,0x83);
+  emit8(p,0xC4);
+  emit8(p,0x08);
+  emit8(p,0x5D);		/* POP RBP		*/
+  emit8(p,0x5B);		/* POP RBX		*/
+  emit8(p,0xC3);		/* RET			*/
+}
+
+/* the guest flags into the host flags, for a Jcc */
+static void emit_guest_flags(uint8_t **p)
+{
+  emit8(p,0x8B);		/* MOV EAX,[RBX + eflags]	*/
+  emit_sys(p,H_EAX,offsetof(x86_regs,eflags));
+  emit8(p,0x25);		/* AND EAX,arithmetic flags	*/
+  emit32(p,FLAGS_ARITH);
+  emit8(p,0x50);		/* PUSH RAX			*/
+  emit8(p,0x9D);		/* POPFQ			*/
+}
+
+/* IP = condition cc ? target : next, then leave */
+static void emit_branch(uint8_t **p,unsigned cc,uint16_t next,uint16_t target,unsigned count)
+{
+  emit_imm(p,H_ECX,next);
+  emit_imm(p,H_EDX,target);
+  emit8(p,0x0F);		/* CMOVcc ECX,EDX		*/
+  emit8(p,0x40 + cc);
+  emit8(p,0xCA);
+  emit8(p,0x89);		/* MOV [RBX + eip],ECX		*/
+  emit_sys(p,H_ECX,offsetof(x86_regs,eip));
+  emit_exit(p,count);
+}
+
+static void emit_call_handler(uint8_t **p,const insn__s *insn,uint16_t next,unsigned count)
+{
+  void   (*sync)(system__s *) = flags_sync;
+  uint64_t fn;
+  
+  memcpy(&fn,&insn->handler,sizeof(fn));
+  emit_set_ip(p,next);
+  emit8(p,0x48);		/* MOV RDI,RBX		*/
+  emit8(p,0x89);
+  emit8(p,0xDF);
+  emit8(p,0x48);		/* MOV RSI,insn		*/
+  emit8(p,0xBE);
+  emit64(p,(uintptr_t)insn);
+  emit8(p,0x48);		/* MOV RAX,handler	*/
+  emit8(p,0xB8);
+  emit64(p,fn);
+  emit8(p,0xFF);		/* CALL RAX		*/
+  emit8(p,0xD0);
+  
+  /*---------------------------------------------------------------------
+  ; The inline code needs the flags in eflags, so bring them up to date
+  ; if the handler left them pending.
+  ;---------------------------------------------------------------------*/
+  
+  memcpy(&fn,&sync,sizeof(fn));
+  emit8(p,0x80);		/* CMP BYTE [RBX + lazy.op],0	*/
+  emit8(p,0xBB);
+  emit32(p,offsetof(system__s,lazy.op));
+  emit8(p,0x00);
+  emit8(p,0x74);		/* JE +15			*/
+  emit8(p,0x0F);
+  emit8(p,0x48);		/* MOV RDI,RBX			*/
+  emit8(p,0x89);
+  emit8(p,0xDF);
+  emit8(p,0x48);		/* MOV RAX,flags_sync		*/
+  emit8(p,0xB8);
+  emit64(p,fn);
+  emit8(p,0xFF);		/* CALL RAX			*/
+  emit8(p,0xD0);
+  
+  /*---------------------------------------------------------------------
+  ; The handler may have stored over this very block, in which case we
+  ; have to get out now.  IP is already correct for the next instruction.
+  ;---------------------------------------------------------------------*/
+  
+  emit8(p,0x80);		/* CMP BYTE [RBP + valid],0	*/
+  emit8(p,0xBD);
+  emit32(p,offsetof(block__s,valid));
+  emit8(p,0x00);
+  emit8(p,0x75);		/* JNE +12			*/
+  emit8(p,0x0C);
+  emit_exit(p,count);
+}
+
+/* dst op= src for the eight ALU operations; dst in EAX, src in ECX */
+static void emit_alu(uint8_t **p,unsigned op,size_t dst,bool w,bool store)
+{
+  if ((op == ALU_ADC) || (op == ALU_SBB))
+  {
+    emit8(p,0x0F);		/* BT DWORD [RBX + eflags],0	*/
+    emit8(p,0xBA);
+    emit_sys(p,4,offsetof(x86_regs,eflags));
+    emit8(p,0x00);
+  }
+  
+  if (w)
+    emit8(p,0x66);
+  emit8(p,(op << 3) | w);	/* op EAX,ECX			*/
+  emit8(p,0xC8);
+  
+  if (store)
+    emit_store(p,H_EAX,dst,w);
+  
+  if ((op == ALU_OR) || (op == ALU_AND) || (op == ALU_XOR))
+    emit_flags(p,FLAGS_ARITH & ~FLAG_AF,FLAG_AF);
+  else
+    emit_flags(p,FLAGS_ARITH,0);
+}
+
+/*---------------------------------------------------------------------
+; Emit one instruction inline if we can.  Returns false if it has to go
+; some other way.
+;---------------------------------------------------------------------*/
+
+static bool emit_inline(uint8_t **p,const insn__s *insn)
+{
+  uint8_t  op = insn->opcode;
+  bool     w  = op & 1;
+  bool     r  = insn->mod == 3;
+  uint16_t imm;
+  
+  if ((op < 0x40) && ((op & 7) < 6))
+  {
+    switch(op & 7)
+    {
+      case 0:
+      case 1:
+           if (!r) return false;
+           emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+           emit_load(p,H_ECX,guest_reg(insn->reg,w),w);
+           emit_alu(p,op >> 3,guest_reg(insn->rm,w),w,(op >> 3) != ALU_CMP);
+           return true;
+  
+      case 2:
+      case 3:
+           if (!r) return false;
+           emit_load(p,H_EAX,guest_reg(insn->reg,w),w);
+           emit_load(p,H_ECX,guest_reg(insn->rm,w),w);
+           emit_alu(p,op >> 3,guest_reg(insn->reg,w),w,(op >> 3) != ALU_CMP);
+           return true;
+  
+      default:
+           emit_load(p,H_EAX,guest_reg(0,w),w);
+           emit_imm(p,H_ECX,insn->imm);
+           emit_alu(p,op >> 3,guest_reg(0,w),w,(op >> 3) != ALU_CMP);
+           return true;
+    }
+  }
+  
+  switch(op)
+  {
+    case 0x40: case 0x41: case 0x42: case 0x43:
+    case 0x44: case 0x45: case 0x46: case 0x47:
+    case 0x48: case 0x49: case 0x4A: case 0x4B:
+    case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+         emit_load(p,H_EAX,guest_reg(op & 7,true),true);
+         emit8(p,0x66);		/* INC/DEC AX */
+         emit8(p,0xFF);
+         emit8(p,(op & 8) ? 0xC8 : 0xC0);
+         emit_store(p,H_EAX,guest_reg(op & 7,true),true);
+         emit_flags(p,FLAGS_ARITH & ~FLAG_CF,0);
+         return true;
+  
+    case 0x80: case 0x81: case 0x82: case 0x83:
+         if (!r) return false;
+         imm = (op == 0x83) ? (uint16_t)(int8_t)insn->imm : insn->imm;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         emit_imm(p,H_ECX,imm);
+         emit_alu(p,insn->reg,guest_reg(insn->rm,w),w,insn->reg != ALU_CMP);
+         return true;
+  
+    case 0x84: case 0x85:
+         if (!r) return false;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         emit_load(p,H_ECX,guest_reg(insn->reg,w),w);
+         emit_alu(p,ALU_AND,0,w,false);
+         return true;
+  
+    case 0xA8: case 0xA9:
+         emit_load(p,H_EAX,guest_reg(0,w),w);
+         emit_imm(p,H_ECX,insn->imm);
+         emit_alu(p,ALU_AND,0,w,false);
+         return true;
+  
+    case 0x86: case 0x87:
+         if (!r) return false;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         emit_load(p,H_ECX,guest_reg(insn->reg,w),w);
+         emit_store(p,H_ECX,guest_reg(insn->rm,w),w);
+         emit_store(p,H_EAX,guest_reg(insn->reg,w),w);
+         return true;
+  
+    case 0x88: case 0x89:
+         if (!r) return false;
+         emit_load(p,H_EAX,guest_reg(insn->reg,w),w);
+         emit_store(p,H_EAX,guest_reg(insn->rm,w),w);
+         return true;
+  
+    case 0x8A: case 0x8B:
+         if (!r) return false;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         emit_store(p,H_EAX,guest_reg(insn->reg,w),w);
+         return true;
+  
+    case 0x90:
+         return true;
+  
+    case 0x91: case 0x92: case 0x93:
+    case 0x94: case 0x95: case 0x96: case 0x97:
+         emit_load(p,H_EAX,guest_reg(0,true),true);
+         emit_load(p,H_ECX,guest_reg(op & 7,true),true);
+         emit_store(p,H_ECX,guest_reg(0,true),true);
+         emit_store(p,H_EAX,guest_reg(op & 7,true),true);
+         return true;
+  
+    case 0x98:
+         emit8(p,0x0F);		/* MOVSX EAX,BYTE [AL] */
+         emit8(p,0xBE);
+         emit_sys(p,H_EAX,guest_reg(0,false));
+         emit_store(p,H_EAX,guest_reg(0,true),true);
+         return true;
+  
+    case 0x99:
+         emit8(p,0x0F);		/* MOVSX EAX,WORD [AX] */
+         emit8(p,0xBF);
+         emit_sys(p,H_EAX,guest_reg(0,true));
+         emit8(p,0xC1);		/* SAR EAX,31 */
+         emit8(p,0xF8);
+         emit8(p,0x1F);
+         emit_store(p,H_EAX,guest_reg(2,true),true);
+         return true;
+  
+    case 0xB0: case 0xB1: case 0xB2: case 0xB3:
+    case 0xB4: case 0xB5: case 0xB6: case 0xB7:
+         emit8(p,0xC6);		/* MOV BYTE [reg],imm8 */
+         emit_sys(p,0,guest_reg(op & 7,false));
+         emit8(p,insn->imm);
+         return true;
+  
+    case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+    case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+         emit8(p,0x66);		/* MOV WORD [reg],imm16 */
+         emit8(p,0xC7);
+         emit_sys(p,0,guest_reg(op & 7,true));
+         emit8(p,insn->imm & 0xFF);
+         emit8(p,insn->imm >> 8);
+         return true;
+  
+    case 0xD0: case 0xD1:
+         if (!r) return false;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         if (insn->reg < 4)
+         {
+           emit8(p,0x0F);	/* BT DWORD [RBX + eflags],0 */
+           emit8(p,0xBA);
+           emit_sys(p,4,offsetof(x86_regs,eflags));
+           emit8(p,0x00);
+         }
+         if (w)
+           emit8(p,0x66);
+         emit8(p,op);		/* rot/shift AX,1 */
+         emit8(p,0xC0 | ((insn->reg == 6 ? 4 : insn->reg) << 3));
+         emit_store(p,H_EAX,guest_reg(insn->rm,w),w);
+         if (insn->reg < 4)
+           emit_flags(p,FLAG_CF | FLAG_OF,0);
+         else
+           emit_flags(p,FLAGS_ARITH & ~FLAG_AF,FLAG_AF);
+         return true;
+  
+    case 0xF5:
+         emit_eflags(p,6,FLAG_CF);
+         return true;
+  
+    case 0xF6: case 0xF7:
+         if (!r || (insn->reg == 1) || (insn->reg > 3)) return false;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         if (insn->reg == 0)
+         {
+           emit_imm(p,H_ECX,insn->imm);
+           emit_alu(p,ALU_AND,0,w,false);
+           return true;
+         }
+         if (w)
+           emit8(p,0x66);
+         emit8(p,op);		/* NOT/NEG AX */
+         emit8(p,insn->reg == 2 ? 0xD0 : 0xD8);
+         emit_store(p,H_EAX,guest_reg(insn->rm,w),w);
+         if (insn->reg == 3)
+           emit_flags(p,FLAGS_ARITH,0);
+         return true;
+  
+    case 0xF8: case 0xF9: case 0xFA:
+    case 0xFB: case 0xFC: case 0xFD:
+         {
+           static const uint32_t bit[] = { FLAG_CF , FLAG_IF , FLAG_DF };
+           uint32_t f = bit[(op - 0xF8) >> 1];
+  
+           if (op & 1)
+             emit_eflags(p,1,f);
+           else
+             emit_eflags(p,4,~f);
+         }
+         return true;
+  
+    case 0xFE: case 0xFF:
+         if (!r || (insn->reg > 1)) return false;
+         emit_load(p,H_EAX,guest_reg(insn->rm,w),w);
+         if (w)
+           emit8(p,0x66);
+         emit8(p,0xFE | w);	/* INC/DEC AX */
+         emit8(p,insn->reg ? 0xC8 : 0xC0);
+         emit_store(p,H_EAX,guest_reg(insn->rm,w),w);
+         emit_flags(p,FLAGS_ARITH & ~FLAG_CF,0);
+         return true;
+  
+    default:
+         return false;
+  }
+}
+
+/*---------------------------------------------------------------------
+; The block closing branches.  Returns false if it has to be left to the
+; interpreter.
+;---------------------------------------------------------------------*/
+
+static bool emit_closing(uint8_t **p,const insn__s *insn,uint16_t next,unsigned count)
+{
+  uint16_t target;
+  
+  switch(insn->opcode)
+  {
+    case 0xE9:
+         target = next + insn->imm;
+         emit_set_ip(p,target);
+         emit_exit(p,count);
+         return true;
+  
+    case 0xEB:
+         target = next + (int8_t)insn->imm;
+         emit_set_ip(p,target);
+         emit_exit(p,count);
+         return true;
+  
+    case 0xE2:
+         target = next + (int8_t)insn->imm;
+         emit8(p,0x66);		/* DEC WORD [CX] */
+         emit8(p,0xFF);
+         emit_sys(p,1,guest_reg(1,true));
+         emit_branch(p,0x5,next,target,count);
+         return true;
+  
+    case 0xE3:
+         target = next + (int8_t)insn->imm;
+         emit8(p,0x66);		/* CMP WORD [CX],0 */
+         emit8(p,0x83);
+         emit_sys(p,7,guest_reg(1,true));
+         emit8(p,0x00);
+         emit_branch(p,0x4,next,target,count);
+         return true;
+  
+    default:
+         if ((insn->opcode < 0x60) || (insn->opcode > 0x7F))
+           return false;
+         target = next + (int8_t)insn->imm;
+         emit_guest_flags(p);
+         emit_branch(p,insn->opcode & 0x0F,next,target,count);
+         return true;
+  }
+}
+
+static void jit_translate(system__s *sys,block__s *b)
+{
+  bcache__s *c      = sys->cache;
+  uint8_t   *start  = &c->jit_mem[c->jit_used];
+  uint8_t   *p      = start;
+  uint16_t   ip     = sys->regs.eip;
+  bool       closed = false;
+  unsigned   i;
+  
+  b->nojit = true;
+  if (c->jit_used + JIT_SLACK > JIT_SIZE)
+    return;
+  
+  emit8(&p,0x53);		/* PUSH RBX	*/
+  emit8(&p,0x55);		/* PUSH RBP	*/
+  emit8(&p,0x48);		/* SUB RSP,8	*/
+  emit8(&p,0x83);
+  emit8(&p,0xEC);
+  emit8(&p,0x08);
+  emit8(&p,0x48);		/* MOV RBX,RDI	*/
+  emit8(&p,0x89);
+  emit8(&p,0xFB);
+  emit8(&p,0x48);		/* MOV RBP,RSI	*/
+  emit8(&p,0x89);
+  emit8(&p,0xF5);
+  
+  for (i = 0 ; i < b->count ; i++)
+  {
+    insn__s *insn = &b->insns[i];
+  
+    ip += insn->len;
+  
+    if (emit_inline(&p,insn))
+      continue;
+  
+    if (insn_ends_block(insn))
+    {
+      closed = emit_closing(&p,insn,ip,i + 1);
+      ip    -= insn->len;
+      break;
+    }
+  
+    emit_call_handler(&p,insn,ip,i + 1);
+  }
+  
+  /* unless a branch already left, fall out to the interpreter */
+  if (!closed)
+  {
+    if (i == 0)
+      return;
+    emit_set_ip(&p,ip);
+    emit_exit(&p,i);
+  }
+  
+  memcpy(&b->jit,&start,sizeof(b->jit));
+  b->nojit     = false;
+  b->jit_ip    = sys->regs.eip;
+  c->jit_used += p - start;
+  c->jit_blocks++;
+}
+
+#else
+
+static void jit_translate(system__s *sys,block__s *b)
+{
+  (void)sys;
+  b->nojit = true;
+}
+
+#endif
+
+/********************************************************************/
+
+static void dump_regs(const x86_regs *regs)
+{
+  char flags[17];
+  
+  flags[ 0] = '-';
+  flags[ 1] = '-';
+  flags[ 2] = '-';
+  flags[ 3] = '-';
+  flags[ 4] = regs->eflags & 0x0800 ? 'O' : 'o';
+  flags[ 5] = regs->eflags & 0x0400 ? 'D' : 'd';
+  flags[ 6] = regs->eflags & 0x0200 ? 'I' : 'i';
+  flags[ 7] = regs->eflags & 0x0100 ? 'T' : 't';
+  flags[ 8] = regs->eflags & 0x0080 ? 'S' : 's';
+  flags[ 9] = regs->eflags & 0x0040 ? 'Z' : 'z';
+  flags[10] = '-';
+  flags[11] = regs->eflags & 0x0010 ? 'A' : 'a';
+  flags[12] = '-';
+  flags[13] = regs->eflags & 0x0004 ? 'P' : 'p';
+  flags[14] = '-';
+  flags[15] = regs->eflags & 0x0001 ? 'C' : 'c';
+  flags[16] = '\0';
+  
+  fprintf(
+          stderr,
+          "AX: %04X BX: %04X CX: %04X DX: %04X\n"
+          "SI: %04X DI: %04X BP: %04X SP: %04X\n"
+          "IP: %04X FL: %s\n"
+          "CS: %04X DS: %04X ES: %04X SS: %04X\n"
+          "\n",
+          regs->eax & 0xFFFF,
+          regs->ebx & 0xFFFF,
+          regs->ecx & 0xFFFF,
+          regs->edx & 0xFFFF,
+          regs->esi & 0xFFFF,
+          regs->edi & 0xFFFF,
+          regs->ebp & 0xFFFF,
+          regs->esp & 0xFFFF,
+          regs->eip & 0xFFFF,
+          flags,
+          regs->cs,
+          regs->ds,
+          regs->es,
+          regs->ss
+  );
+}
+
+static bool regs_equal(const x86_regs *a,const x86_regs *b)
+{
+  const gpr__u *ga = (const gpr__u *)&a->eax;
+  const gpr__u *gb = (const gpr__u *)&b->eax;
+  
+  for (unsigned r = 0 ; r < 8 ; r++)
+    if (ga->w[r * 2] != gb->w[r * 2])
+      return false;
+  
+  return ((a->eip & 0xFFFF) == (b->eip & 0xFFFF))
+      && ((a->eflags & FLAGS_8086) == (b->eflags & FLAGS_8086))
+      && (a->cs == b->cs)
+      && (a->ds == b->ds)
+      && (a->es == b->es)
+      && (a->ss == b->ss);
+}
+
+/*---------------------------------------------------------------------
+; Lockstep mode.  Run the native code while journaling every store, roll
+; memory and registers back, run the same instructions through the
+; interpreter, and insist on the same registers and the same stores.  If
+; the block overwrote itself there is nothing to replay, so that case
+; just goes unchecked.
+;---------------------------------------------------------------------*/
+
+static unsigned jit_lockstep(system__s *sys,block__s *b)
+{
+  journal__s jj = { 0 , 0 , NULL };
+  journal__s ji = { 0 , 0 , NULL };
+  x86_regs   before = sys->regs;
+  x86_regs   after;
+  unsigned   done;
+  bool       same;
+  
+  sys->journal = &jj;
+  done         = b->jit(sys,b);
+  sys->journal = NULL;
+  
+  if (!b->valid)
+  {
+    free(jj.e);
+    return done;
+  }
+  
+  after = sys->regs;
+  for (size_t i = jj.n ; i-- > 0 ; )
+    sys->mem[jj.e[i].addr] = jj.e[i].old;
+  
+  sys->regs    = before;
+  sys->journal = &ji;
+  for (unsigned i = 0 ; i < done ; i++)
+  {
+    sys->regs.eip = (sys->regs.eip + b->insns[i].len) & 0xFFFF;
+    b->insns[i].handler(sys,&b->insns[i]);
+  }
+  sys->journal = NULL;
+  flags_sync(sys);
+  
+  same = regs_equal(&after,&sys->regs) && (jj.n == ji.n);
+  for (size_t i = 0 ; same && (i < jj.n) ; i++)
+    same = (jj.e[i].addr == ji.e[i].addr) && (jj.e[i].new == ji.e[i].new);
+  
+  if (!same)
+  {
+    fprintf(stderr,"JIT lockstep mismatch in block %05zX after %u instructions\n",b->addr,done);
+    fprintf(stderr,"start:\n");
+    dump_regs(&before);
+    fprintf(stderr,"JIT (%zu stores):\n",jj.n);
+    dump_regs(&after);
+    fprintf(stderr,"interpreter (%zu stores):\n",ji.n);
+    dump_regs(&sys->regs);
+    exit(5);
+  }
+  
+  sys->cache->lockstep_checks++;
+  free(jj.e);
+  free(ji.e);
+  return done;
+}
+
+/********************************************************************/
+
+static void block_execute(system__s *sys,block__s *b)
+{
+  const insn__s *insn = b->insns;
+  const insn__s *end  = insn + b->count;
+  
+  if (sys->jit && !b->nojit)
+  {
+    if ((b->jit == NULL) && (++b->execs == JIT_HOT))
+      jit_translate(sys,b);
+    
+    if ((b->jit != NULL) && (b->jit_ip == (sys->regs.eip & 0xFFFF)))
+    {
+      unsigned done;
+      
+      /* the native code works on real flags */
+      flags_sync(sys);
+      done = sys->lockstep ? jit_lockstep(sys,b) : b->jit(sys,b);
+      
+      sys->cache->jit_entries++;
+      sys->cache->jit_insns += done;
+      insn                  += done;
+      if (!b->valid)
+      {
+        sys->icount += done;
+        return;
+      }
+    }
+  }
+  
+  while (insn < end)
+  {
+    sys->regs.eip = (sys->regs.eip + insn->len) & 0xFFFF;
+    insn->handler(sys,insn);
+    insn++;
+    
+    /* the block just overwrote itself */
+    if (!b->valid)
+      break;
+  }
+  
+  sys->icount += insn - b->insns;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; The profiler (see vm_profile() and profile.h).  Every so many
+; instructions, give or take a block and a random half of the period
+; either way so it can't fall into step with a loop, the guest's CS:IP
+; and stack go into the table.
+;---------------------------------------------------------------------*/
+
+static uint8_t prof_rb(void *sys,uint16_t seg,uint16_t off)
+{
+  return mem_rb(sys,seg,off);
+}
+
+static void profile_sample(system__s *sys)
+{
+  /* xorshift for the jitter */
+  sys->prof_seed ^= sys->prof_seed << 13;
+  sys->prof_seed ^= sys->prof_seed >> 17;
+  sys->prof_seed ^= sys->prof_seed << 5;
+  sys->prof_next  = sys->icount + sys->prof_period / 2 + sys->prof_seed % (sys->prof_period + 1);
+  
+  prof_sample(&sys->prof,prof_rb,sys,sys->regs.cs,sys->regs.eip,sys->regs.ss,sys->regs.esp);
+}
+
+/********************************************************************/
+
+static void cpu_run(system__s *sys,unsigned long long limit)
+{
+  bcache__s *c    = sys->cache;
+  block__s  *prev = NULL;
+  
+  if (sys->debug)
+  {
+    while (sys->running && !sys->stop && (sys->icount < limit))
+    {
+      if (sys->icount >= sys->tick_next)
+        clock_tick(sys);
+      if (sys->icount >= sys->prof_next)
+        profile_sample(sys);
+      execute_instruction(sys);
+    }
+    return;
+  }
+  
+  while (sys->running && !sys->stop && (sys->icount < limit))
+  {
+    size_t    addr;
+    block__s *b    = NULL;
+    
+    if (sys->icount >= sys->tick_next)
+      clock_tick(sys);
+    if (sys->icount >= sys->prof_next)
+      profile_sample(sys);
+    addr = linear(sys,sys->regs.cs,sys->regs.eip);
+    
+    if (prev != NULL)
+    {
+      if ((prev->next[0] != NULL) && (prev->next[0]->addr == addr) && prev->next[0]->valid)
+        b = prev->next[0];
+      else if ((prev->next[1] != NULL) && (prev->next[1]->addr == addr) && prev->next[1]->valid)
+        b = prev->next[1];
+    }
+    
+    if (b != NULL)
+      c->chained++;
+    else
+    {
+      b = bcache_lookup(c,addr);
+      if (b != NULL)
+        c->hits++;
+      else
+      {
+        unsigned long long flushes = c->flushes;
+        
+        c->misses++;
+        b = bcache_translate(sys,addr);
+        if (b == NULL)
+        {
+          execute_instruction(sys);
+          prev = NULL;
+          continue;
+        }
+        
+        if (c->flushes != flushes)
+          prev = NULL;
+      }
+      
+      if (prev != NULL)
+      {
+        prev->next[prev->slot] = b;
+        prev->slot ^= 1;
+      }
+    }
+    
+    block_execute(sys,b);
+    prev = b->valid ? b : NULL;
+  }
+}
+
+/*---------------------------------------------------------------------
+; Guest memory.  Every VM starts out as MAP_PRIVATE views of the same
+; image, BLANK_SIZE bytes of 0xCC in a memfd made the first time it's
+; needed, so a page only gets a copy of its own (and costs anything) the
+; first time the guest writes to it.  The image is one 64K segment rather
+; than the whole of memory, which keeps making it cheap while a VM is
+; still only a handful of mappings.  There's no counting on the store
+; path: vm_resident() asks the kernel which pages are private to the VM.
+;---------------------------------------------------------------------*/
+
+#define BLANK_SIZE	0x10000
+
+static int g_blank = -1;
+
+static int blank_image(void)
+{
+  int   fd       = __atomic_load_n(&g_blank,__ATOMIC_ACQUIRE);
+  int   expected = -1;
+  void *mem;
+  
+  if (fd != -1)
+    return fd;
+  
+  fd = memfd_create("msdos-blank",MFD_CLOEXEC);
+  if ((fd == -1) || (ftruncate(fd,BLANK_SIZE) == -1))
+  {
+    perror("memfd_create()");
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  
+  mem = mmap(NULL,BLANK_SIZE,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap()");
+    close(fd);
+    return -1;
+  }
+  memset(mem,0xCC,BLANK_SIZE);
+  munmap(mem,BLANK_SIZE);
+  
+  /* another thread may have beaten us to it */
+  if (!__atomic_compare_exchange_n(&g_blank,&expected,fd,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+  {
+    close(fd);
+    fd = expected;
+  }
+  
+  return fd;
+}
+
+static unsigned char *blank_map(void)
+{
+  unsigned char *mem;
+  int            fd = blank_image();
+  
+  if (fd == -1)
+    return NULL;
+  
+  mem = mmap(NULL,MEM_SIZE,PROT_NONE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap()");
+    return NULL;
+  }
+  
+  for (size_t off = 0 ; off < MEM_SIZE ; off += BLANK_SIZE)
+  {
+    if (mmap(&mem[off],BLANK_SIZE,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_FIXED,fd,0) == MAP_FAILED)
+    {
+      perror("mmap()");
+      munmap(mem,MEM_SIZE);
+      return NULL;
+    }
+  }
+  
+  return mem;
+}
+
+/********************************************************************/
+
+long vm_resident(vm__s *sys)
+{
+  uint64_t entry[MEM_SIZE / 4096];
+  long     pages = 0;
+  int      fd;
+  
+  fd = open("/proc/self/pagemap",O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  
+  if (pread(fd,entry,sizeof(entry),(uintptr_t)sys->mem / 4096 * sizeof(entry[0])) != sizeof(entry))
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  
+  /* present, and not the page cache of the image it was mapped from */
+  for (size_t i = 0 ; i < sizeof(entry) / sizeof(entry[0]) ; i++)
+    if ((entry[i] & (1uLL << 63)) && !(entry[i] & (1uLL << 61)))
+      pages++;
+  
+  return pages * 4096;
+}
+
+/********************************************************************/
+
+void vm_stats(vm__s *sys,FILE *fp)
+{
+  bcache__s *c        = sys->cache;
+  long       resident = vm_resident(sys);
+  
+  fprintf(
+    fp,
+    "instructions:  %llu\n"
+    "block cache:   %llu chained, %llu hits, %llu misses\n"
+    "               %llu invalidations, %llu flushes\n",
+    sys->icount,
+    c->chained,
+    c->hits,
+    c->misses,
+    c->invalidations,
+    c->flushes
+  );
+  
+  if (resident >= 0)
+    fprintf(fp,"memory:        %ld of %d KiB written\n",resident / 1024,MEM_SIZE / 1024);
+  
+  if (!sys->realtime)
+    fprintf(
+      fp,
+      "clock:         %.3f s virtual, %.3f s of it skipped in %llu jumps\n",
+      (double)(sys->icount * CLOCK_INSN_NS + sys->clock_skip) / NS,
+      (double)sys->clock_skip / NS,
+      sys->clock_skips
+    );
+  
+  if (sys->jit)
+    fprintf(
+      fp,
+      "JIT:           %llu blocks, %zu bytes, %llu entries, %llu instructions, %llu lockstep checks\n",
+      c->jit_blocks,
+      c->jit_used,
+      c->jit_entries,
+      c->jit_insns,
+      c->lockstep_checks
+    );
+  
+  for (int i = 0 ; i < 16 ; i++)
+    if (sys->fp[i] != NULL)
+      filemap_stats(&sys->maps[i],fp);
+  
+  if (sys->base != -1)
+  {
+    size_t files = 0;
+    size_t bytes = 0;
+    
+    for (vfile__s *vf = sys->overlay ; vf != NULL ; vf = vf->next)
+    {
+      files++;
+      bytes += vf->size;
+    }
+    fprintf(fp,"overlay:       %zu files, %zu bytes\n",files,bytes);
+  }
+}
+
+/********************************************************************/
+
+static system__s *vm_new(unsigned flags)
+{
+  system__s       *sys = calloc(1, sizeof(system__s));
+  struct timespec  now;
+  
+  if (sys == NULL)
+  {
+    perror("calloc()");
+    return NULL;
+  }
+  
+  sys->debug    = (flags & VM_DEBUG)    != 0;
+  sys->jit      = (flags & (VM_JIT | VM_LOCKSTEP)) != 0;
+  sys->lockstep = (flags & VM_LOCKSTEP) != 0;
+  sys->amask    = (flags & VM_A20) ? MEM_A20 : MEM_WRAP;
+  sys->out_max  = OUT_MAX;
+  sys->running  = true;
+  sys->startup  = true;
+  sys->realtime = (flags & VM_REALTIME) != 0;
+  sys->clock_day = -1;
+  sys->prof_next = ~0uLL;
+  sys->base      = g_base;
+  
+  /* virtual time starts from now */
+  clock_gettime(CLOCK_REALTIME, &now);
+  sys->clock_base = now.tv_sec * NS + now.tv_nsec;
+  
+  /* stdin, stdout and stderr */
+  sys->con.fd        = -1;
+  sys->con.mode      = 2;
+  sys->conerr        = sys->con;
+  sys->handles[0]    = &sys->con;
+  sys->handles[1]    = &sys->con;
+  sys->handles[2]    = &sys->conerr;
+  sys->con.refs      = 2;
+  sys->conerr.refs   = 1;
+  
+  sys->mem = blank_map();
+  if (sys->mem == NULL)
+  {
+    vm_destroy(sys);
+    return NULL;
+  }
+  
+  sys->cache = calloc(1, sizeof(bcache__s));
+  if (sys->cache == NULL)
+  {
+    perror("calloc()");
+    vm_destroy(sys);
+    return NULL;
+  }
+  
+#if defined(__x86_64__)
+  if (sys->jit)
+  {
+    void *jm = mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jm == MAP_FAILED)
+    {
+      perror("mmap()");
+      vm_destroy(sys);
+      return NULL;
+    }
+    sys->cache->jit_mem = jm;
+  }
+#else
+  if (sys->jit)
+  {
+    fprintf(stderr, "JIT not supported on this host; interpreting\n");
+    sys->jit = sys->lockstep = false;
+  }
+#endif
+  
+  return sys;
+}
+
+/********************************************************************/
+
+vm__s *vm_create(const char *fname,unsigned flags)
+{
+  system__s *sys = vm_new(flags);
+  
+  if ((sys != NULL) && (load_program(fname, sys) != EXIT_SUCCESS))
+  {
+    vm_destroy(sys);
+    return NULL;
+  }
+  
+  return sys;
+}
+
+/********************************************************************/
+
+vm__s *vm_restore(const char *fname,unsigned flags)
+{
+  system__s *sys = vm_new(flags);
+  
+  if ((sys != NULL) && (snapshot_restore(sys, fname) != EXIT_SUCCESS))
+  {
+    vm_destroy(sys);
+    return NULL;
+  }
+  
+  return sys;
+}
+
+/********************************************************************/
+
+void vm_destroy(vm__s *sys)
+{
+  if (sys->mem != NULL)
+    munmap(sys->mem, MEM_SIZE);
+  
+  if (sys->cache != NULL)
+  {
+    if (sys->cache->jit_mem != NULL)
+      munmap(sys->cache->jit_mem, JIT_SIZE);
+    free(sys->cache);
+  }
+  
+  for (int i = 0; i < 16; i++)
+    if (sys->fp[i] != NULL)
+    {
+      fclose(sys->fp[i]);
+      filemap_close(&sys->maps[i]);
+    }
+  vfile_free(&sys->overlay);
+  
+  for (int i = 0; i < HANDLES; i++)
+    if (sys->handles[i] != NULL)
+      handle_close(sys, i);
+  
+  free(sys->in);
+  free(sys->out);
+  free(sys->transcript);
+  trace_init(&sys->trace,0);
+  prof_init(&sys->prof,0,false);
+  free(sys);
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; The metrics are brought up to date once a vm_run(), so there's no more
+; on the way than a count for every INT 21h.  The time from a return with
+; VM_NEED_INPUT to the next vm_run() is time blocked on input, on the
+; wall clock so msdos-top can count a wait that's still going.
+;---------------------------------------------------------------------*/
+
+static vm_reason__e vm_metrics_run(system__s *sys,vm_reason__e why)
+{
+  struct timespec    ts;
+  unsigned long long now;
+  
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = ts.tv_sec * 1000000000uLL + ts.tv_nsec;
+  if ((sys->blocked_since != 0) && (now > sys->blocked_since))
+    metrics_add(&sys->metrics->blocked_ns, now - sys->blocked_since);
+  sys->blocked_since = (why == VM_NEED_INPUT) ? now : 0;
+  metrics_set(&sys->metrics->waiting, sys->blocked_since);
+  metrics_set(&sys->metrics->insns, sys->icount);
+  return why;
+}
+
+/*---------------------------------------------------------------------
+; For --latency, the time since vm_run() last came back went to the
+; caller: waiting for input if it came back VM_NEED_INPUT, or else on
+; the console.  Only a turn that's going counts it.
+;---------------------------------------------------------------------*/
+
+static void vm_latency_enter(system__s *sys)
+{
+  uint64_t gap = latency_now() - sys->lat_mark;
+  
+  if (sys->lat_waiting)
+    latency_blocked(sys->latency, gap);
+  else
+    latency_io(sys->latency, gap);
+}
+
+static void vm_latency_leave(system__s *sys,vm_reason__e why)
+{
+  sys->lat_mark    = latency_now();
+  sys->lat_waiting = (why == VM_NEED_INPUT);
+}
+
+vm_reason__e vm_run(vm__s *sys,unsigned long long budget)
+{
+  unsigned long long limit = sys->icount + budget;
+  vm_reason__e       why   = VM_BUDGET;
+  
+  /* VM_FOREVER */
+  if (limit < sys->icount)
+    limit = ~0uLL;
+  
+  if (sys->latency != NULL)
+    vm_latency_enter(sys);
+  
+  sys->stop = false;
+  if (sys->running)
+    cpu_run(sys, limit);
+  
+  if (!sys->running)
+    why = VM_EXITED;
+  else if (sys->stop)
+    why = sys->reason;
+  
+  if (sys->latency != NULL)
+    vm_latency_leave(sys, why);
+  return (sys->metrics != NULL) ? vm_metrics_run(sys, why) : why;
+}
+
+/********************************************************************/
+
+/* each record goes straight out, so a session that dies is still there */
+static void record_feed(system__s *sys,const void *data,size_t size)
+{
+  vm_record__s rec;
+  
+  memset(&rec, 0, sizeof(rec));
+  rec.icount = sys->icount;
+  rec.size   = size;
+  
+  if (
+          (fwrite(&rec, sizeof(rec), 1, sys->record) != 1)
+       || ((size > 0) && (fwrite(data, 1, size, sys->record) != size))
+       || (fflush(sys->record) == EOF)
+     )
+  {
+    perror("vm_record()");
+    sys->record = NULL;
+  }
+}
+
+void vm_feed(vm__s *sys,const void *data,size_t size)
+{
+  if (size == 0)
+  {
+    if (sys->record != NULL)
+      record_feed(sys, NULL, 0);
+    sys->eof = true;
+    return;
+  }
+  
+  if (sys->metrics != NULL)
+    metrics_add(&sys->metrics->bytes_in, size);
+  if (sys->record != NULL)
+    record_feed(sys, data, size);
+  
+  /* keep the queue from creeping along */
+  if (sys->in_pos > 0)
+  {
+    memmove(sys->in, &sys->in[sys->in_pos], sys->in_len - sys->in_pos);
+    sys->in_len -= sys->in_pos;
+    sys->in_pos  = 0;
+  }
+  
+  grow(&sys->in, &sys->in_alloc, sys->in_len + size);
+  memcpy(&sys->in[sys->in_len], data, size);
+  sys->in_len += size;
+}
+
+/********************************************************************/
+
+void vm_drain(vm__s *sys,const char **data,size_t *size)
+{
+  *data        = sys->out;
+  *size        = sys->out_len;
+  sys->out_len = 0;
+  
+  if (sys->metrics != NULL)
+    metrics_add(&sys->metrics->bytes_out, *size);
+}
+
+/********************************************************************/
+
+void vm_output_max(vm__s *sys,size_t max)
+{
+  sys->out_max = max;
+}
+
+/********************************************************************/
+
+int vm_exit_code(vm__s *sys)
+{
+  return sys->exit_code;
+}
+
+/********************************************************************/
+
+int vm_trace(vm__s *sys,size_t records)
+{
+  return trace_init(&sys->trace,records);
+}
+
+/********************************************************************/
+
+int vm_trace_dump(vm__s *sys,int fd)
+{
+  return trace_write(&sys->trace,fd);
+}
+
+/********************************************************************/
+
+int vm_profile(vm__s *sys,unsigned long long period)
+{
+  sys->prof_next = ~0uLL;
+  if (prof_init(&sys->prof,SEG_LOAD,period > 0) != 0)
+    return -1;
+  if (period == 0)
+    return 0;
+  
+  sys->prof_period = period;
+  sys->prof_seed   = 0x9E3779B9;
+  sys->prof_next   = sys->icount + period;
+  return 0;
+}
+
+int vm_profile_write(vm__s *sys,FILE *folded,FILE *flat)
+{
+  char every[64];
+  
+  snprintf(every, sizeof(every), "%llu instructions or so", sys->prof_period);
+  return prof_write(&sys->prof,folded,flat,every);
+}
+
+/********************************************************************/
+
+void vm_metrics(vm__s *sys,metrics__s *metrics)
+{
+  sys->metrics       = metrics;
+  sys->blocked_since = 0;
+  if (metrics != NULL)
+  {
+    metrics_set(&metrics->insns, sys->icount);
+    metrics_set(&metrics->waiting, 0);
+    metrics_set(&metrics->prompt, sys->input);
+  }
+}
+
+/********************************************************************/
+
+void vm_latency(vm__s *sys,latency__s *latency)
+{
+  sys->latency     = latency;
+  sys->lat_mark    = latency_now();
+  sys->lat_waiting = false;
+}
+
+/*---------------------------------------------------------------------
+; Record and replay.  With the virtual clock, what the guest does depends
+; only on where it starts, the time it starts at, and the input it's fed
+; and when.  Input only ever goes in while the guest is stopped, and the
+; instruction count says where that was, so a replay that isn't where
+; the recording was has gone its own way (a different backend, say).
+;---------------------------------------------------------------------*/
+
+int vm_record(vm__s *sys,FILE *fp)
+{
+  vm_record_hdr__s hdr;
+  struct tm        tm;
+  time_t           t = sys->clock_base / NS;
+  
+  if (sys->realtime)
+  {
+    fprintf(stderr, "vm_record(): not with the host's clock\n");
+    return -1;
+  }
+  
+  localtime_r(&t, &tm);
+  sys->clock_zone  = tm.tm_gmtoff;
+  sys->clock_fixed = true;
+  
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+  hdr.version = RECORD_VERSION;
+  hdr.zone    = sys->clock_zone;
+  hdr.clock   = sys->clock_base;
+  
+  if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) || (fflush(fp) == EOF))
+  {
+    perror("vm_record()");
+    return -1;
+  }
+  
+  sys->record = fp;
+  return 0;
+}
+
+/********************************************************************/
+
+int vm_replay(vm__s *sys,FILE *fp)
+{
+  vm_record_hdr__s hdr;
+  
+  if (
+          (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+       || (memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) != 0)
+       || (hdr.version != RECORD_VERSION)
+     )
+  {
+    fprintf(stderr, "vm_replay(): not a recording this understands\n");
+    return -1;
+  }
+  if (sys->realtime)
+  {
+    fprintf(stderr, "vm_replay(): not with the host's clock\n");
+    return -1;
+  }
+  
+  sys->clock_base  = hdr.clock;
+  sys->clock_zone  = hdr.zone;
+  sys->clock_fixed = true;
+  sys->replay      = fp;
+  sys->replayed    = 0;
+  return 0;
+}
+
+int vm_replay_feed(vm__s *sys)
+{
+  vm_record__s  rec;
+  char         *data;
+  int           rc;
+  
+  if ((sys->replay == NULL) || (fread(&rec, sizeof(rec), 1, sys->replay) != 1))
+    return -1;
+  
+  data = malloc(rec.size + 1);
+  if ((data == NULL) || (fread(data, 1, rec.size, sys->replay) != rec.size))
+  {
+    free(data);
+    return -1;
+  }
+  
+  rc = (rec.icount == sys->icount) ? 0 : 1;
+  sys->replayed++;
+  vm_feed(sys, data, rec.size);
+  free(data);
+  return rc;
+}
@@ -0,0 +1,170 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; The software emulator as a library.  A VM never touches a file
+; descriptor for the console---the guest's input is whatever has been
+; given to vm_feed(), and its output piles up until vm_drain().  So a
+; conversation can be driven in-process:
+;
+;	vm__s *vm = vm_create("RACTER.EXE",0);
+;
+;	while(true)
+;	{
+;	  vm_reason__e why = vm_run(vm,VM_FOREVER);
+;	  vm_drain(vm,&text,&len);
+;	  ... show text ...
+;	  if (why == VM_EXITED) break;
+;	  if (why == VM_NEED_INPUT) vm_feed(vm,line,strlen(line));
+;	}
+;
+;	vm_destroy(vm);
+;
+; Errors are reported on stderr, and NULL or -1 returned.
+;---------------------------------------------------------------------*/
+
+#ifndef LIBMSDOS_H
+#define LIBMSDOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+#include "latency.h"
+#include "trace.h"
+
+#define VM_JIT		0x01	/* translate hot code to x86_64 */
+#define VM_LOCKSTEP	0x02	/* ... and check it against the interpreter */
+#define VM_A20		0x04	/* A20 on, so FFFF:xxxx reaches the HMA */
+#define VM_DEBUG	0x08	/* trace to stderr, one instruction at a time */
+#define VM_REALTIME	0x10	/* the guest's clock is the host's */
+
+#define VM_FOREVER	(~0uLL)
+
+typedef struct system vm__s;
+
+typedef enum vm_reason
+{
+  VM_NEED_INPUT,	/* waiting on input; vm_feed() and run again */
+  VM_OUTPUT,		/* the prompt went out, or output reached the limit */
+  VM_EXITED,		/* the program is done */
+  VM_BUDGET,		/* ran the instructions it was given */
+} vm_reason__e;
+
+extern vm__s        *vm_create	(const char *,unsigned);
+extern vm__s        *vm_restore	(const char *,unsigned);
+extern int           vm_save	(vm__s *,const char *);
+extern int           vm_forked	(vm__s *);
+extern void          vm_destroy	(vm__s *);
+extern vm_reason__e  vm_run	(vm__s *,unsigned long long);
+extern void          vm_feed	(vm__s *,const void *,size_t);
+extern void          vm_drain	(vm__s *,const char **,size_t *);
+extern void          vm_output_max	(vm__s *,size_t);
+extern int           vm_exit_code	(vm__s *);
+extern long          vm_resident	(vm__s *);
+extern void          vm_stats	(vm__s *,FILE *);
+extern void          vm_image_cache	(const char *);
+extern int           vm_base	(const char *);
+extern int           vm_trace	(vm__s *,size_t);
+extern int           vm_trace_dump	(vm__s *,int);
+extern int           vm_profile	(vm__s *,unsigned long long);
+extern int           vm_profile_write	(vm__s *,FILE *,FILE *);
+extern void          vm_metrics	(vm__s *,metrics__s *);
+extern void          vm_latency	(vm__s *,latency__s *);
+extern int           vm_record	(vm__s *,FILE *);
+extern int           vm_replay	(vm__s *,FILE *);
+extern int           vm_replay_feed	(vm__s *);
+
+/*---------------------------------------------------------------------
+; vm_create()	load an EXE or COM file with VM_* flags
+; vm_restore()	start from a vm_save() file instead; what the guest had
+;		written up to then is waiting in the output
+; vm_save()	save a VM at its first VM_NEED_INPUT; the guest makes
+;		the input call again when it's restored
+; vm_forked()	call in the child after fork() so it gets its own file
+;		offsets; the startup output is waiting in its output again
+; vm_run()	run for that many instructions (give or take a block)
+; vm_feed()	add input; a length of 0 is end of file
+; vm_drain()	point at the output written so far and consume it; the
+;		pointer is good until the next vm_run()
+; vm_output_max() return VM_OUTPUT once that much output is waiting
+;		(default 4096, 0 for every byte)
+; vm_exit_code() the program's return code once it has exited
+; vm_resident()	bytes of guest memory the VM has a page of its own for
+;		(the ones it has written to), or -1 if the kernel won't say
+; vm_stats()	CPU and cache statistics
+; vm_image_cache() keep relocated EXEs in this directory for vm_create()
+;		to map next time (process-wide; NULL to stop)
+; vm_base()	VMs made by vm_create() and vm_restore() after this take
+;		their files from this directory and never write it; FCB
+;		creates, writes and deletes stay in the VM, and handle
+;		calls can only read (process-wide; NULL to stop)
+; vm_trace()	keep (at least) the last so many INT 21h calls in a ring
+;		of vm_trace__s, a power of two of them; 0 to stop
+; vm_trace_dump() write the ring to a file descriptor, a vm_trace_hdr__s
+;		and then the records oldest first.  Only calls write(),
+;		so it can be done from a signal handler
+; vm_profile()	sample where the guest is, and what called it, about
+;		every so many instructions; 0 to stop
+; vm_profile_write() write the samples as folded stacks (for flamegraph
+;		tools) and/or a flat profile; either FILE can be NULL
+; vm_metrics()	keep these metrics up to date from now on (NULL to stop);
+;		what's counted is added to what's there
+; vm_latency()	time each turn into these histograms (NULL to stop).  Time
+;		between vm_run()s is taken as console I/O, or after
+;		VM_NEED_INPUT as blocked on it
+; vm_record()	write the session to a file as it goes: the clock it
+;		started with, then everything given to vm_feed().  Call it
+;		before the first vm_run()
+; vm_replay()	start the clock from a recording instead, also before
+;		the first vm_run()
+; vm_replay_feed() feed the next input from the recording, for when
+;		vm_run() wants some.  Returns 1 if the guest isn't where
+;		it was when it was recorded, -1 when there's no more
+;---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+; A recording (see vm_record()).  The header, and then a vm_record__s
+; for each vm_feed() followed by its bytes; none is end of file.  icount
+; is the guest instructions run before it.
+;---------------------------------------------------------------------*/
+
+#define RECORD_MAGIC	"MSDOSREC"
+#define RECORD_VERSION	1
+
+typedef struct vm_record_hdr
+{
+  char     magic[8];
+  uint32_t version;
+  int32_t  zone;	/* seconds east of UTC */
+  uint64_t clock;	/* the guest's time at instruction 0, ns since 1970 */
+} vm_record_hdr__s;
+
+typedef struct vm_record
+{
+  uint64_t icount;
+  uint32_t size;
+  uint32_t pad;
+} vm_record__s;
+
+#endif
@@ -0,0 +1,74 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; Live metrics.  With --metrics, msdos and msdos_fixes each keep one of
+; these in METRICS_DIR/msdos.<pid>, a file mapped shared, and update it
+; with plain relaxed stores as they go---no system calls, and nothing at
+; all when it's off.  There's only ever one writer, so a reader sees each
+; counter whole but not all of them from the same instant.  msdos-top
+; reads every one there is.
+;---------------------------------------------------------------------*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_DIR	"/dev/shm"
+#define METRICS_PREFIX	"msdos."
+#define METRICS_MAGIC	"MSDOSMET"
+#define METRICS_VERSION	1
+
+#define METRICS_SOFT	1	/* msdos_fixes, the software CPU */
+#define METRICS_VM86	2	/* msdos */
+
+typedef struct metrics
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t backend;
+  int64_t  pid;
+  uint64_t started;	/* CLOCK_REALTIME, ns */
+  uint64_t insns;	/* guest instructions run (software CPU) */
+  uint64_t entries;	/* trips into vm86() */
+  uint64_t bytes_in;	/* console input */
+  uint64_t bytes_out;	/* console output */
+  uint64_t turns;	/* Racter prompts written */
+  uint64_t blocked_ns;	/* waiting on console input, up to the last wait */
+  uint64_t waiting;	/* ... and when this one started (0 if not waiting) */
+  uint64_t prompt;	/* 1 while the guest is at the prompt */
+  uint64_t int21[256];	/* INT 21h calls by AH */
+} metrics__s;
+
+/* the one writer doesn't need a locked add, just a store nobody tears */
+static inline void metrics_add(uint64_t *counter,uint64_t n)
+{
+  __atomic_store_n(counter,*counter + n,__ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(uint64_t *counter,uint64_t n)
+{
+  __atomic_store_n(counter,n,__ATOMIC_RELAXED);
+}
+
+#endif
@@ -46,16 +46,47 @@
 #include <unistd.h>
 #include <sys/vm86.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "latency.h"
+#include "filemap.h"
+#include "overlay.h"
+#include "trace.h"
+#include "profile.h"
 
 #define SEG_ENV		0x1000
+#define SEG_STUB	0x1800
 #define SEG_PSP		0x2000
 #define SEG_LOAD	0x2010
 
 #define MEM_ENV		(SEG_ENV  * 16)
+#define MEM_STUB	(SEG_STUB * 16)
 #define MEM_PSP		(SEG_PSP  * 16)
 #define MEM_LOAD	(SEG_LOAD * 16)
 
+#define STUB_DTA	0x0000	/* offset, segment of the DTA */
+#define STUB_LAST	0x0004	/* last two characters written */
+#define STUB_LEN	0x0006	/* bytes in the output buffer */
+#define STUB_ENTRY	0x0010	/* INT 21h points here */
+#define STUB_BUF	0x0100	/* output buffer */
+#define STUB_SIZE	0x0400
+
+#define STUB_PENDING	0xE0	/* first byte went into an empty buffer */
+#define STUB_FLUSH	0xE1	/* buffer full, or the prompt went in */
+#define STUB_CALL	0xE2	/* anything the stub can't do itself */
+
+#define IDLE_POLLS	64	/* empty console polls before we block */
+#define OUT_SIZE	4096	/* console output buffer */
+#define OUT_DELAY	20	/* ms before buffered output goes out anyway */
+#define TRACE_RECORDS	4096	/* INT 21h calls --trace keeps by default */
+
 /********************************************************************/
 
 typedef struct fcbs	/* short FCB block */
@@ -129,8 +160,13 @@ typedef struct system
   unsigned char          *mem;
   fcb__s                 *fcbs[16];
   FILE                   *fp[16];
-  uint16_t                dtaseg;
-  uint16_t                dtaoff;
+  filemap__s              maps[16];
+  vfile__s               *vf[16];		/* or NULL if it's fp[] */
+  
+  /* --base and --write-behind directories, or -1 (see overlay.h) */
+  int                     base;
+  int                     behind;
+  vfile__s               *overlay;
   
   /*---------------------------------------------------------------------
   ; Basically, before we can actually return data, we need to wait for the
@@ -152,6 +188,53 @@ typedef struct system
   char input_buffer[256];
   int input_len;
   int input_pos;
+  
+  /* Print console I/O counts on exit */
+  bool stats;
+  
+  /* Empty AH=06h polls since the guest last read or wrote anything */
+  unsigned idle_polls;
+  
+  /* Console output buffer, flushed with writev() */
+  char   out[OUT_SIZE];
+  size_t out_len;
+  size_t out_max;
+  
+  /* Host console I/O calls, reported by -s */
+  unsigned long long writes;
+  unsigned long long reads;
+  unsigned long long polls;
+  
+  /* Trips out of vm86 mode, likewise */
+  unsigned long long exits;
+  
+  /*---------------------------------------------------------------------
+  ; With --snapshot or --zygote, startup is true until the guest first
+  ; asks for input, and everything written until then is kept.
+  ;---------------------------------------------------------------------*/
+  
+  const char *snapshot;
+  const char *zygote;
+  bool        startup;
+  char       *transcript;
+  size_t      transcript_len;
+  size_t      transcript_max;
+  
+  /* --metrics (see metrics.h), or NULL */
+  metrics__s *metrics;
+  
+  /* --latency (see latency.h), or NULL */
+  latency__s *latency;
+  
+  /* --trace (see trace.h and dos_traced()) */
+  trace_ring__s trace;
+  uint32_t      moved;
+  bool          waited;
+  
+  /* --profile, and the samples so far (see profile.h) */
+  const char    *profile;
+  bool           prof_forked;
+  prof_table__s  prof;
 } system__s;
 
 /********************************************************************/
@@ -273,25 +356,153 @@ static void dump_regs(const struct vm86_regs *regs)
 
 /********************************************************************/
 
+static inline uint16_t get_word(unsigned char *mem,size_t offset)
+{
+  uint16_t value;
+  memcpy(&value,&mem[offset],sizeof(value));
+  return value;
+}
+
+static inline void set_word(unsigned char *mem,size_t offset,uint16_t value)
+{
+  memcpy(&mem[offset],&value,sizeof(value));
+}
+
+static void revector(struct revectored_struct *r,int n,bool host)
+{
+  size_t        bits = sizeof(r->__map[0]) * 8;
+  unsigned long mask = 1uL << (n % bits);
+  
+  if (host)
+    r->__map[n / bits] |= mask;
+  else
+    r->__map[n / bits] &= ~mask;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; The resident DOS stub.  Every trip out of vm86 mode is a trip through the
+; kernel, and Racter makes one per character it prints.  So INT 21h goes
+; to this instead (int21_revectored still sends everything it doesn't do
+; straight to us).  It answers 19h and 1Ah by itself, and keeps what 02h,
+; 06h and 09h print in a buffer at SEG_STUB:STUB_BUF, only calling on us
+; (through interrupts nobody else uses) when
+;
+;	* the first byte goes into an empty buffer (STUB_PENDING), so we
+;	  can start the OUT_DELAY clock;
+;	* the buffer fills up, or CR LF > goes in (STUB_FLUSH);
+;	* it's AH=06h input (STUB_CALL).
+;
+; and we empty the buffer on every trip out, whatever the reason.
+;
+;	0010	80FC06		entry:	cmp	ah,06h
+;	0013	7417			je	dircon
+;	0015	80FC02			cmp	ah,02h
+;	0018	7417			je	putdl
+;	001A	80FC09			cmp	ah,09h
+;	001D	741A			je	putstr
+;	001F	80FC19			cmp	ah,19h
+;	0022	7428			je	drive
+;	0024	80FC1A			cmp	ah,1Ah
+;	0027	7426			je	setdta
+;	0029	CDE2		call:	int	STUB_CALL
+;	002B	CF			iret
+;	002C	80FAFF		dircon:	cmp	dl,0FFh
+;	002F	74F8			je	call
+;	0031	50		putdl:	push	ax
+;	0032	88D0			mov	al,dl
+;	0034	E82300			call	putc
+;	0037	58			pop	ax
+;	0038	CF			iret
+;	0039	50		putstr:	push	ax
+;	003A	56			push	si
+;	003B	89D6			mov	si,dx
+;	003D	8A04		.next:	mov	al,[si]
+;	003F	3C24			cmp	al,'$'
+;	0041	7406			je	.done
+;	0043	E81400			call	putc
+;	0046	46			inc	si
+;	0047	EBF4			jmp	.next
+;	0049	5E		.done:	pop	si
+;	004A	58			pop	ax
+;	004B	CF			iret
+;	004C	B000		drive:	mov	al,0
+;	004E	CF			iret
+;	004F	2E89160000	setdta:	mov	cs:[STUB_DTA],dx
+;	0054	2E8C1E0200		mov	cs:[STUB_DTA+2],ds
+;	0059	CF			iret
+;	005A	53		putc:	push	bx
+;	005B	2E8B1E0600		mov	bx,cs:[STUB_LEN]
+;	0060	2E88870001		mov	cs:[bx+STUB_BUF],al
+;	0065	43			inc	bx
+;	0066	2E891E0600		mov	cs:[STUB_LEN],bx
+;	006B	81FB0004		cmp	bx,STUB_SIZE
+;	006F	7416			je	.flush
+;	0071	3C3E			cmp	al,'>'
+;	0073	7509			jne	.first
+;	0075	2E813E04000A0D		cmp	word cs:[STUB_LAST],0D0Ah
+;	007C	7409			je	.flush
+;	007E	83FB01		.first:	cmp	bx,1
+;	0081	7506			jne	.last
+;	0083	CDE0			int	STUB_PENDING
+;	0085	EB02			jmp	.last
+;	0087	CDE1		.flush:	int	STUB_FLUSH
+;	0089	2E8B1E0400	.last:	mov	bx,cs:[STUB_LAST]
+;	008E	88DF			mov	bh,bl
+;	0090	88C3			mov	bl,al
+;	0092	2E891E0400		mov	cs:[STUB_LAST],bx
+;	0097	5B			pop	bx
+;	0098	C3			ret
+;---------------------------------------------------------------------*/
+
+static const unsigned char c_stub[] =
+{
+  0x80,0xFC,0x06,0x74,0x17,0x80,0xFC,0x02,0x74,0x17,0x80,0xFC,
+  0x09,0x74,0x1A,0x80,0xFC,0x19,0x74,0x28,0x80,0xFC,0x1A,0x74,
+  0x26,0xCD,0xE2,0xCF,0x80,0xFA,0xFF,0x74,0xF8,0x50,0x88,0xD0,
+  0xE8,0x23,0x00,0x58,0xCF,0x50,0x56,0x89,0xD6,0x8A,0x04,0x3C,
+  0x24,0x74,0x06,0xE8,0x14,0x00,0x46,0xEB,0xF4,0x5E,0x58,0xCF,
+  0xB0,0x00,0xCF,0x2E,0x89,0x16,0x00,0x00,0x2E,0x8C,0x1E,0x02,
+  0x00,0xCF,0x53,0x2E,0x8B,0x1E,0x06,0x00,0x2E,0x88,0x87,0x00,
+  0x01,0x43,0x2E,0x89,0x1E,0x06,0x00,0x81,0xFB,0x00,0x04,0x74,
+  0x16,0x3C,0x3E,0x75,0x09,0x2E,0x81,0x3E,0x04,0x00,0x0A,0x0D,
+  0x74,0x09,0x83,0xFB,0x01,0x75,0x06,0xCD,0xE0,0xEB,0x02,0xCD,
+  0xE1,0x2E,0x8B,0x1E,0x04,0x00,0x88,0xDF,0x88,0xC3,0x2E,0x89,
+  0x1E,0x04,0x00,0x5B,0xC3
+};
+
+/********************************************************************/
+
 static int load_exe(
         const char       *fname,
         unsigned char    *mem,
         struct vm86_regs *regs
 )
 {
-  exehdr__s  hdr;
-  size_t     binsize;
-  size_t     i;
-  uint16_t   off[2];
-  FILE      *fp;
-  psp__s    *psp;
-  uint16_t  *patch;
-  size_t     offset;
+  exehdr__s      hdr;
+  size_t         binsize;
+  size_t         i;
+  size_t         count;
+  uint16_t       off[2];
+  unsigned char *table;
+  FILE          *fp;
+  psp__s        *psp;
+  uint16_t      *patch;
+  size_t         offset;
   
   assert(fname != NULL);
   assert(regs  != NULL);
   
   memset(&mem[MEM_ENV],0,256);
+  
+  memset(&mem[MEM_STUB],0,STUB_BUF);
+  memcpy(&mem[MEM_STUB + STUB_ENTRY],c_stub,sizeof(c_stub));
+  set_word(mem,MEM_STUB + STUB_DTA,0x80);	/* the default DTA is in the PSP */
+  set_word(mem,MEM_STUB + STUB_DTA + 2,SEG_PSP);
+  set_word(mem,0x21 * 4,STUB_ENTRY);
+  set_word(mem,0x21 * 4 + 2,SEG_STUB);
+  
   psp = (psp__s *)&mem[MEM_PSP];
   
   memset(psp,0,256);
@@ -337,16 +548,27 @@ static int load_exe(
   
   fseek(fp,hdr.hdrpara * 16,SEEK_SET);
   fread(&mem[MEM_LOAD],1,binsize,fp);
+  
+  /* the whole relocation table in one read */
+  table = malloc(hdr.numreloc * sizeof(off) + 1);
+  if (table == NULL)
+  {
+    perror("malloc()");
+    fclose(fp);
+    return ENOMEM;
+  }
   fseek(fp,hdr.reltable,SEEK_SET);
+  count = fread(table,sizeof(off),hdr.numreloc,fp);
   
-  for (i = 0 ; i < hdr.numreloc ; i++)
+  for (i = 0 ; i < count ; i++)
   {
-    fread(&off,sizeof(off),1,fp);
+    memcpy(off,&table[i * 4],sizeof(off));
     offset  = off[1] * 16 + off[0];
     patch   = (uint16_t *)&mem[MEM_LOAD + offset];
     *patch += (uint16_t)SEG_LOAD;    
   }
   
+  free(table);
   fclose(fp);
   return 0;  
 }
@@ -393,13 +615,79 @@ static int find_fcb(system__s *sys,fcb__s *fcb)
 
 /********************************************************************/
 
+static void file_unmap(system__s *sys,int idx)
+{
+  if (sys->stats)
+    filemap_stats(&sys->maps[idx],stderr);
+  filemap_close(&sys->maps[idx]);
+}
+
+/********************************************************************/
+
+static FILE *file_open(system__s *sys,const char *name)
+{
+  FILE *fp;
+  int   fd;
+  
+  if (sys->base == -1)
+  {
+    fp = fopen(name,"r+b");
+    if (fp == NULL)
+      fp = fopen(name,"rb");
+    return fp;
+  }
+  
+  fd = openat(sys->base,name,O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  fp = fdopen(fd,"rb");
+  if (fp == NULL)
+    close(fd);
+  return fp;
+}
+
+/********************************************************************/
+
+/* the file as an empty copy in the overlay */
+static vfile__s *vfile_create(system__s *sys,const char *name)
+{
+  vfile__s *vf = vfile_new(&sys->overlay,name);
+  
+  if (vf == NULL)
+    exit(3);
+  return vf;
+}
+
+/*---------------------------------------------------------------------
+; The guest is about to write to a file it opened from the base
+; directory, so it gets a copy of its own to write to from now on.
+;---------------------------------------------------------------------*/
+
+static void vfile_copyup(system__s *sys,int idx)
+{
+  vfile__s *vf = vfile_create(sys,sys->maps[idx].name);
+  
+  if (!vfile_fill(vf,fileno(sys->fp[idx])))
+  {
+    perror(vf->name);
+    exit(3);
+  }
+  
+  fclose(sys->fp[idx]);
+  file_unmap(sys,idx);
+  sys->fp[idx] = NULL;
+  sys->vf[idx] = vf;
+}
+
+/********************************************************************/
+
 static int open_file(system__s *sys,fcb__s *fcb,bool create)
 {
   char         filename[FILENAME_MAX];
   FILE        *fp;
+  vfile__s    *vf = NULL;
   int          idx;
   struct stat  info;
-  const char  *mode;
 
   assert(sys  != NULL);
   assert(fcb  != NULL);
@@ -410,45 +698,208 @@ static int open_file(system__s *sys,fcb__s *fcb,bool create)
     
   mkfilename(filename,fcb);
   
-  if (!create)
+  if (sys->base != -1)
   {
-    if (stat(filename,&info) < 0)
-      return errno;
-    fcb->size = info.st_size;
-    mode      = "r+b";
+    vf = create ? vfile_create(sys,filename) : vfile_find(sys->overlay,filename);
+    if ((vf != NULL) && vf->deleted)
+      return ENOENT;
   }
-  else
+  
+  if (vf != NULL)
   {
-    fcb->size = 0;
-    mode      = "w+b";
+    sys->fcbs[idx] = fcb;
+    sys->vf[idx]   = vf;
+    fcb->size      = vf->size;
+    fcb->recsize   = 128;
+    return 0;
   }
   
-  fp = fopen(filename,mode);
+  fp = create ? fopen(filename,"w+b") : file_open(sys,filename);
   if (fp == NULL)
     return errno;
   
+  if (fstat(fileno(fp),&info) < 0)
+  {
+    fclose(fp);
+    return errno;
+  }
+  
   sys->fcbs[idx] = fcb;
   sys->fp[idx]   = fp;
+  fcb->size      = info.st_size;
   fcb->recsize   = 128;
+  filemap_open(&sys->maps[idx],fileno(sys->fp[idx]),filename);
   return 0;
 }
 
 /********************************************************************/
 
+/*---------------------------------------------------------------------
+; Console output.  Rather than one write() per character, output collects
+; in sys->out and goes out with a single writev() when
+;
+;	* the Racter prompt shows up (couch.lua waits on it);
+;	* it reaches the -o threshold;
+;	* OUT_DELAY ms pass after the first byte went in (SIGALRM);
+;	* we're about to wait on input, or exit.
+;
+; Anything too big for the buffer is written straight from where it is,
+; behind what's already buffered, in the same writev().
+;---------------------------------------------------------------------*/
+
+static volatile sig_atomic_t g_flush_due;
+static volatile sig_atomic_t g_latency_due;
+
+static void out_record(system__s *,const char *,size_t);
+
+static void out_alarm(int sig)
+{
+  (void)sig;
+  g_flush_due = 1;
+}
+
+/* --latency prints the histograms so far on SIGUSR1 */
+static void latency_signal(int sig)
+{
+  (void)sig;
+  g_latency_due = 1;
+}
+
+static void latency_report(system__s *sys)
+{
+  if (g_latency_due && (sys->latency != NULL))
+  {
+    g_latency_due = 0;
+    latency_write(sys->latency,stderr);
+  }
+}
+
+static void out_writev(system__s *sys,const char *data,size_t size)
+{
+  struct iovec iov[2];
+  int          n = 0;
+  
+  g_flush_due = 0;
+  
+  if (sys->out_len > 0)
+  {
+    iov[n].iov_base = sys->out;
+    iov[n].iov_len  = sys->out_len;
+    n++;
+  }
+  
+  if (size > 0)
+  {
+    iov[n].iov_base = (void *)data;
+    iov[n].iov_len  = size;
+    n++;
+  }
+  
+  sys->out_len = 0;
+  
+  if (sys->startup)
+    for (int i = 0 ; i < n ; i++)
+      out_record(sys,iov[i].iov_base,iov[i].iov_len);
+  
+  while (n > 0)
+  {
+    uint64_t start = (sys->latency != NULL) ? latency_now() : 0;
+    ssize_t  bytes = writev(STDOUT_FILENO,iov,n);
+    
+    if (sys->latency != NULL)
+      latency_io(sys->latency,latency_now() - start);
+    sys->writes++;
+    if ((bytes > 0) && (sys->metrics != NULL))
+      metrics_add(&sys->metrics->bytes_out,bytes);
+    if (bytes < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+      {
+        struct pollfd pfd = { .fd = STDOUT_FILENO , .events = POLLOUT };
+        poll(&pfd,1,-1);
+        continue;
+      }
+      return;	/* nobody is listening any more */
+    }
+    
+    /* partial write---skip what made it */
+    while ((n > 0) && ((size_t)bytes >= iov[0].iov_len))
+    {
+      bytes -= iov[0].iov_len;
+      if (--n > 0)
+        iov[0] = iov[1];
+    }
+    if (n > 0)
+    {
+      iov[0].iov_base  = (char *)iov[0].iov_base + bytes;
+      iov[0].iov_len  -= bytes;
+    }
+  }
+}
+
+static void out_flush(system__s *sys)
+{
+  if (sys->out_len > 0)
+    out_writev(sys,NULL,0);
+  g_flush_due = 0;
+}
+
+/* the first byte in starts the clock */
+static void out_clock(system__s *sys)
+{
+  if (sys->out_len == 0)
+  {
+    struct itimerval it = { { 0 , 0 } , { 0 , OUT_DELAY * 1000 } };
+    setitimer(ITIMER_REAL,&it,NULL);
+  }
+}
+
+static void out_write(system__s *sys,const char *data,size_t size)
+{
+  if (sys->out_len + size > sys->out_max)
+  {
+    out_writev(sys,data,size);
+    return;
+  }
+  
+  out_clock(sys);
+  memcpy(&sys->out[sys->out_len],data,size);
+  sys->out_len += size;
+}
+
+static void out_putc(system__s *sys,char c)
+{
+  out_write(sys,&c,1);
+}
+
+/********************************************************************/
+
 static void handle_prompt_detection(system__s *sys, char c)
 {
   /* Handle Racter prompt detection */
   memmove(&sys->prompt[0], &sys->prompt[1], 3);
   sys->prompt[3] = c;
+  sys->idle_polls = 0;
   
   if (sys->prompt[1] == '\r' && sys->prompt[2] == '\n' && sys->prompt[3] == '>')
   {
     sys->input = true;
-    fflush(stdout);
+    if (sys->latency != NULL)
+      latency_end(sys->latency);
+    out_flush(sys);
+    if (sys->metrics != NULL)
+    {
+      metrics_add(&sys->metrics->turns,1);
+      metrics_set(&sys->metrics->prompt,1);
+    }
   }
   else if (c == '\r')
   {
     sys->input = false;
+    if (sys->metrics != NULL)
+      metrics_set(&sys->metrics->prompt,0);
   }
 }
 
@@ -456,177 +907,824 @@ static void handle_prompt_detection(system__s *sys, char c)
 
 static int read_buffered_input(system__s *sys)
 {
+  uint64_t start;
+  
+  /* the guest's first byte of input starts the clock on a turn */
   if (sys->input_pos < sys->input_len)
   {
-    return sys->input_buffer[sys->input_pos++];
+    if (sys->latency != NULL)
+      latency_begin(sys->latency);
+    return (unsigned char)sys->input_buffer[sys->input_pos++];
   }
   
   /* Check if input is available without blocking */
   struct pollfd pfd = { .fd = 0, .events = POLLIN };
+  start = (sys->latency != NULL) ? latency_now() : 0;
+  sys->polls++;
   if (poll(&pfd, 1, 0) > 0)
   {
+    sys->reads++;
     sys->input_len = read(0, sys->input_buffer, sizeof(sys->input_buffer) - 1);
+    if (sys->latency != NULL)
+      latency_io(sys->latency,latency_now() - start);
     if (sys->input_len > 0)
     {
+      if (sys->latency != NULL)
+        latency_begin(sys->latency);
+      if (sys->metrics != NULL)
+        metrics_add(&sys->metrics->bytes_in,sys->input_len);
       sys->input_pos = 0;
-      return sys->input_buffer[sys->input_pos++];
+      return (unsigned char)sys->input_buffer[sys->input_pos++];
     }
   }
   
   return -1;
 }
 
-/********************************************************************/
+/*---------------------------------------------------------------------
+; Park on poll() until stdin has something for us.  Whatever we've written
+; goes out first, since the other end is most likely waiting on it before
+; it answers.  Returns -1 only at EOF (or on a real error).
+;---------------------------------------------------------------------*/
 
-static void ms_dos(system__s *sys)
+static int wait_buffered_input(system__s *sys)
 {
-  int            ah;
-  int            dl;
-  int            i;
-  int            c;
-  size_t         idx;
-  size_t         bufidx;
-  unsigned long  pos;
-  unsigned char *buf;
-  fcb__s        *fcb;
-  char           filename[FILENAME_MAX];
+  int c = read_buffered_input(sys);
   
-  assert(sys != NULL); 
+  if (c >= 0)
+    return c;
   
-  ah = (sys->vm.regs.eax >> 8) & 255;
-  switch(ah)
+  out_flush(sys);
+  sys->waited = true;
+  
+  while(true)
   {
-    case 0:	/* exit */
-         exit(100);
+    struct pollfd   pfd = { .fd = 0, .events = POLLIN };
+    struct timespec start;
+    struct timespec end;
+    uint64_t        waited;
+    int             rc;
     
-    case 0x01: /* Read character with echo */
-         {
-           int c = read_buffered_input(sys);
-           if (c >= 0)
-           {
-             sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00) | (c & 0xFF);
-             if (c != '\n')
-               putchar(c);
-             fflush(stdout);
-           }
-           else
-           {
-             /* No input available, try to wait a bit for piped input */
-             usleep(1000); /* 1ms */
-             c = read_buffered_input(sys);
-             if (c >= 0)
-             {
-               sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00) | (c & 0xFF);
-               if (c != '\n')
-                 putchar(c);
-               fflush(stdout);
-             }
-             else
-             {
-               /* Still no input, return without blocking */
-               sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00);
-             }
-           }
-         }
-         break;
+    if (sys->metrics != NULL)
+    {
+      clock_gettime(CLOCK_REALTIME,&start);
+      metrics_set(&sys->metrics->waiting,start.tv_sec * 1000000000uLL + start.tv_nsec);
+    }
     
-    case 0x06: /* direct console I/O */
-         dl = sys->vm.regs.edx & 255;
-         if (dl == 0xFF) /* Input */
-         {
-           int c = read_buffered_input(sys);
-           if (c >= 0)
-           {
-             sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00) | (c & 0xFF);
-             sys->vm.regs.eflags &= ~0x40; /* Clear ZF */
-           }
-           else
-           {
-             sys->vm.regs.eflags |= 0x40; /* Set ZF */
-           }
-         }
-         else /* Output */
-         {
-           putchar(dl);
-           handle_prompt_detection(sys, dl);
-         }
-         break;
+    waited = (sys->latency != NULL) ? latency_now() : 0;
+    sys->polls++;
+    rc = poll(&pfd, 1, -1);
     
-    case 0x0F: /* Open file (1.0 version) */
-         sys->vm.regs.eax &= ~255;
-         idx   = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
-         assert(idx < 1024*1024uL);
-         fcb   = (fcb__s *)&sys->mem[idx];
-         if (fcb->drive > 0)
-           sys->vm.regs.eax |= 255;
-         else
-         {
-           if (open_file(sys,fcb,false) != 0)
-             sys->vm.regs.eax |= 255;
-         }
-         break;
-         
-    case 0x10: /* close file */
-         sys->vm.regs.eax &= ~255;
-         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
-         fcb = (fcb__s *)&sys->mem[idx];
-         i   = find_fcb(sys,fcb);
-         assert(i > -1);
-         fclose(sys->fp[i]);
-         sys->fcbs[i] = NULL;
-         sys->fp[i]   = NULL;
-         break;
-         
-    case 0x13: /* delete file */
-         sys->vm.regs.eax &= ~255;
-         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
-         fcb = (fcb__s *)&sys->mem[idx];
-         mkfilename(filename,fcb);
-         if (remove(filename) == -1)
-           sys->vm.regs.eax |= 255;
-         break;
-         
-    case 0x16: /* create file */
-         sys->vm.regs.eax &= ~255;
-         idx   = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
-         assert(idx < 1024*1024uL);
-         fcb   = (fcb__s *)&sys->mem[idx];
-         if (fcb->drive > 1)
-           sys->vm.regs.eax |= 255;
-         else
-         {
-           if (open_file(sys,fcb,true) != 0)
-             sys->vm.regs.eax |= 255;
-         }
-         break;
-         
-    case 0x19: /* return drive --- it's always A */
-         sys->vm.regs.eax &= ~255;
-         break;
-         
-    case 0x1A: /* set DTA address (sigh) */
-         sys->dtaseg = sys->vm.regs.ds;
-         sys->dtaoff = sys->vm.regs.edx & 0xFFFF;
-         break;
+    if (sys->metrics != NULL)
+    {
+      clock_gettime(CLOCK_REALTIME,&end);
+      metrics_set(&sys->metrics->waiting,0);
+      metrics_add(
+        &sys->metrics->blocked_ns,
+        (end.tv_sec - start.tv_sec) * 1000000000uLL + end.tv_nsec - start.tv_nsec
+      );
+    }
+    if (sys->latency != NULL)
+      latency_blocked(sys->latency,latency_now() - waited);
     
-    case 0x21: /* read record from FCB file */
-         sys->vm.regs.eax &= ~255;
-         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
-         fcb = (fcb__s *)&sys->mem[idx];
-         i   = find_fcb(sys,fcb);
-         assert(i > -1);
-         
-         pos = fcb->relrec * fcb->recsize;
-         if (pos > fcb->size)
-         {
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        latency_report(sys);
+        continue;
+      }
+      return -1;
+    }
+    
+    /* readable with nothing to read is EOF */
+    return read_buffered_input(sys);
+  }
+}
+
+/*---------------------------------------------------------------------
+; Whole strings and lines for AH=09h, 0Ah and handles 3Fh/40h.  They go
+; through the same buffers as the single character calls, so a string is
+; one memcpy() into the output buffer, and a line that shows up in one
+; piece costs one read().
+;---------------------------------------------------------------------*/
+
+static void console_write(system__s *sys,const char *data,size_t size)
+{
+  out_write(sys,data,size);
+  for (size_t i = 0 ; i < size ; i++)
+    handle_prompt_detection(sys,data[i]);
+}
+
+static size_t console_read(system__s *sys,char *data,size_t size)
+{
+  size_t n;
+  
+  if ((size == 0) || (wait_buffered_input(sys) < 0))
+    return 0;
+  
+  sys->input_pos--;	/* we only wanted to know there's something */
+  n = (size_t)(sys->input_len - sys->input_pos);
+  if (n > size)
+    n = size;
+  memcpy(data,&sys->input_buffer[sys->input_pos],n);
+  sys->input_pos += n;
+  return n;
+}
+
+static size_t console_read_line(system__s *sys,char *line,size_t max)
+{
+  size_t len = 0;
+  
+  /* max counts the CR that ends the line; anything past it is dropped */
+  if (max == 0)
+    return 0;
+  
+  while (wait_buffered_input(sys) >= 0)
+  {
+    char   *p     = &sys->input_buffer[--sys->input_pos];
+    size_t  avail = (size_t)(sys->input_len - sys->input_pos);
+    size_t  n     = 0;
+    
+    while ((n < avail) && (p[n] != '\r') && (p[n] != '\n'))
+      n++;
+    
+    memcpy(&line[len],p,(n < max - 1 - len) ? n : max - 1 - len);
+    len            += (n < max - 1 - len) ? n : max - 1 - len;
+    sys->input_pos += n;
+    
+    if (n < avail)
+    {
+      /* CR, LF or CR LF all end it */
+      sys->input_pos++;
+      if ((p[n] == '\r') && (n + 1 < avail) && (p[n + 1] == '\n'))
+        sys->input_pos++;
+      break;
+    }
+  }
+  
+  line[len] = '\r';
+  out_write(sys,line,len);
+  return len;
+}
+
+/********************************************************************/
+
+static void stub_drain(system__s *sys)
+{
+  size_t len = get_word(sys->mem,MEM_STUB + STUB_LEN);
+  
+  if (len > 0)
+  {
+    set_word(sys->mem,MEM_STUB + STUB_LEN,0);
+    console_write(sys,(char *)&sys->mem[MEM_STUB + STUB_BUF],len);
+  }
+}
+
+static size_t stub_dta(system__s *sys)
+{
+  return (size_t)get_word(sys->mem,MEM_STUB + STUB_DTA + 2) * 16
+       + get_word(sys->mem,MEM_STUB + STUB_DTA);
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Snapshots.  Racter spends a while loading and reading its vocabulary
+; before it says anything worth answering, so with --snapshot we run up
+; to the first time the guest asks for console input, save everything
+; there and exit; --restore picks up from that file.  Guest memory goes
+; at the end, page aligned, so it can be mapped MAP_PRIVATE and shared
+; between every session started from the same snapshot.  Output written
+; up to that point is kept too, and replayed on restore.
+;
+; The guest's IP is backed up over the INT 21h, so a restored session
+; makes the input call again.
+;---------------------------------------------------------------------*/
+
+#define SNAP_MAGIC	"MSDOSV86"
+#define SNAP_VERSION	1
+#define SNAP_ALIGN	4096
+
+typedef struct snapshot
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t memsize;
+  uint64_t memoff;
+  uint32_t outlen;
+  struct vm86_regs regs;
+  bool     input;
+  char     prompt[4];
+  struct
+  {
+    int32_t  fcb;	/* offset in guest memory, -1 if unused */
+    char     name[13];
+    int64_t  pos;
+  } files[16];
+} snapshot__s;
+
+static void out_record(system__s *sys,const char *data,size_t size)
+{
+  if (sys->transcript_len + size > sys->transcript_max)
+  {
+    sys->transcript_max = (sys->transcript_len + size) * 2;
+    sys->transcript     = realloc(sys->transcript,sys->transcript_max);
+    if (sys->transcript == NULL)
+    {
+      perror("realloc()");
+      exit(3);
+    }
+  }
+  
+  memcpy(&sys->transcript[sys->transcript_len],data,size);
+  sys->transcript_len += size;
+}
+
+static void snapshot_save(system__s *sys)
+{
+  static const char zero[SNAP_ALIGN];
+  
+  snapshot__s  snap;
+  FILE        *fp;
+  size_t       pad;
+  
+  stub_drain(sys);
+  out_flush(sys);
+  sys->vm.regs.eip = (sys->vm.regs.eip - 2) & 0xFFFF;
+  
+  /* a snapshot only has the names of files; it can't bring the copies */
+  if (sys->overlay != NULL)
+  {
+    fprintf(stderr,"%s: the guest changed files while starting up\n",sys->snapshot);
+    exit(4);
+  }
+  
+  memset(&snap,0,sizeof(snap));
+  memcpy(snap.magic,SNAP_MAGIC,sizeof(snap.magic));
+  snap.version = SNAP_VERSION;
+  snap.memsize = 1024*1024uL;
+  snap.outlen  = sys->transcript_len;
+  snap.regs    = sys->vm.regs;
+  snap.input   = sys->input;
+  memcpy(snap.prompt,sys->prompt,sizeof(snap.prompt));
+  
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    snap.files[i].fcb = -1;
+    if ((sys->fcbs[i] != NULL) && (sys->fp[i] != NULL))
+    {
+      snap.files[i].fcb = (unsigned char *)sys->fcbs[i] - sys->mem;
+      snap.files[i].pos = ftell(sys->fp[i]);
+      mkfilename(snap.files[i].name,sys->fcbs[i]);
+    }
+  }
+  
+  snap.memoff = (sizeof(snap) + snap.outlen + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+  pad         = snap.memoff - sizeof(snap) - snap.outlen;
+  
+  fp = fopen(sys->snapshot,"wb");
+  if (fp == NULL)
+  {
+    perror(sys->snapshot);
+    exit(4);
+  }
+  
+  fwrite(&snap,sizeof(snap),1,fp);
+  fwrite(sys->transcript,1,snap.outlen,fp);
+  fwrite(zero,1,pad,fp);
+  fwrite(sys->mem,1,1024*1024uL,fp);
+  
+  if (fclose(fp) == EOF)
+  {
+    perror(sys->snapshot);
+    exit(4);
+  }
+  
+  exit(EXIT_SUCCESS);
+}
+
+static int snapshot_restore(system__s *sys,const char *fname)
+{
+  snapshot__s  snap;
+  char        *out;
+  void        *mem;
+  int          fd;
+  
+  fd = open(fname,O_RDONLY);
+  if (fd == -1)
+  {
+    perror(fname);
+    return EXIT_FAILURE;
+  }
+  
+  if (
+          (pread(fd,&snap,sizeof(snap),0) != sizeof(snap))
+       || (memcmp(snap.magic,SNAP_MAGIC,sizeof(snap.magic)) != 0)
+       || (snap.version != SNAP_VERSION)
+       || (snap.memsize != 1024*1024uL)
+     )
+  {
+    fprintf(stderr,"%s: not a snapshot from this version\n",fname);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  
+  /* right on top of the anonymous mapping---vm86 wants it at 0 */
+  mem = mmap(sys->mem,1024*1024,PROT_EXEC | PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,fd,snap.memoff);
+  out = malloc(snap.outlen + 1);
+  if (
+          (mem == MAP_FAILED)
+       || (out == NULL)
+       || (pread(fd,out,snap.outlen,sizeof(snap)) != (ssize_t)snap.outlen)
+     )
+  {
+    perror(fname);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  
+  close(fd);
+  sys->vm.regs = snap.regs;
+  sys->input   = snap.input;
+  memcpy(sys->prompt,snap.prompt,sizeof(sys->prompt));
+  
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    if (snap.files[i].fcb < 0)
+      continue;
+    
+    snap.files[i].name[sizeof(snap.files[i].name) - 1] = '\0';
+    sys->fp[i] = file_open(sys,snap.files[i].name);
+    if (sys->fp[i] == NULL)
+    {
+      perror(snap.files[i].name);
+      return EXIT_FAILURE;
+    }
+    
+    fseek(sys->fp[i],snap.files[i].pos,SEEK_SET);
+    sys->fcbs[i] = (fcb__s *)&sys->mem[snap.files[i].fcb];
+    filemap_open(&sys->maps[i],fileno(sys->fp[i]),snap.files[i].name);
+  }
+  
+  out_write(sys,out,snap.outlen);
+  free(out);
+  return EXIT_SUCCESS;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; --metrics (see metrics.h).  The file goes when we exit; a zygote child
+; gets one of its own, starting from what the zygote had counted.
+;---------------------------------------------------------------------*/
+
+static char g_metrics_file[FILENAME_MAX];
+
+static void metrics_close(void)
+{
+  if (g_metrics_file[0] != '\0')
+    unlink(g_metrics_file);
+}
+
+static metrics__s *metrics_open(metrics__s *from)
+{
+  metrics__s      *m;
+  struct timespec  now;
+  int              fd;
+  
+  snprintf(g_metrics_file,sizeof(g_metrics_file),"%s/%s%ld",METRICS_DIR,METRICS_PREFIX,(long)getpid());
+  fd = open(g_metrics_file,O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+  if ((fd == -1) || (ftruncate(fd,sizeof(metrics__s)) == -1))
+  {
+    perror(g_metrics_file);
+    exit(4);
+  }
+  m = mmap(NULL,sizeof(metrics__s),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (m == MAP_FAILED)
+  {
+    perror("mmap()");
+    exit(4);
+  }
+  
+  if (from != NULL)
+  {
+    *m = *from;
+    munmap(from,sizeof(metrics__s));
+  }
+  else
+  {
+    clock_gettime(CLOCK_REALTIME,&now);
+    m->version = METRICS_VERSION;
+    m->backend = METRICS_VM86;
+    m->started = now.tv_sec * 1000000000uLL + now.tv_nsec;
+    memcpy(m->magic,METRICS_MAGIC,sizeof(m->magic));
+  }
+  
+  m->pid = getpid();
+  return m;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Zygote mode.  Like --snapshot, we run up to the first time the guest
+; asks for input, but then sit on a Unix socket instead.  Each connection
+; sends us its stdin and stdout (and optionally stderr) with SCM_RIGHTS;
+; we fork a child onto them, which shares the guest image copy-on-write,
+; replays what the guest has written so far and carries on from there.
+; The caller gets the child's pid back.
+;---------------------------------------------------------------------*/
+
+static int zygote_recv(int conn,int *fds)
+{
+  char            byte;
+  char            cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec    iov = { .iov_base = &byte , .iov_len = 1 };
+  struct msghdr   msg;
+  struct cmsghdr *cmsg;
+  int             n = 0;
+  
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  
+  if (recvmsg(conn,&msg,MSG_CMSG_CLOEXEC) < 1)
+    return 0;
+  
+  for (cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR(&msg,cmsg))
+  {
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+    {
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds,CMSG_DATA(cmsg),n * sizeof(int));
+      break;
+    }
+  }
+  
+  /* we need at least stdin and stdout */
+  if (n < 2)
+  {
+    while (n > 0)
+      close(fds[--n]);
+  }
+  
+  return n;
+}
+
+/*---------------------------------------------------------------------
+; A child shares its parent's open files, file offsets included, so each
+; one reopens the files the guest has open to get its own.  Copies from
+; --base are in memory, and the fork() already gave it its own of those.
+;---------------------------------------------------------------------*/
+
+static void files_reopen(system__s *sys)
+{
+  char fname[FILENAME_MAX];
+  long pos;
+  
+  for (int i = 0 ; i < 16 ; i++)
+  {
+    if ((sys->fcbs[i] == NULL) || (sys->fp[i] == NULL))
+      continue;
+    
+    pos = ftell(sys->fp[i]);
+    mkfilename(fname,sys->fcbs[i]);
+    fclose(sys->fp[i]);
+    sys->fp[i] = file_open(sys,fname);
+    if (sys->fp[i] == NULL)
+    {
+      perror(fname);
+      exit(4);
+    }
+    fseek(sys->fp[i],pos,SEEK_SET);
+    sys->maps[i].fd = fileno(sys->fp[i]);	/* the map itself still holds */
+  }
+}
+
+static void profile_start(void);
+static void trace_forked(void);
+
+static void zygote_serve(system__s *sys)
+{
+  struct sockaddr_un addr;
+  struct sigaction   sa;
+  int                sock;
+  
+  stub_drain(sys);
+  out_flush(sys);
+  fflush(NULL);	/* or every child writes out what's still buffered */
+  
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sys->zygote) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr,"%s: socket name too long\n",sys->zygote);
+    exit(4);
+  }
+  strcpy(addr.sun_path,sys->zygote);
+  unlink(sys->zygote);
+  
+  sock = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+  if (
+          (sock == -1)
+       || (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) == -1)
+       || (listen(sock,SOMAXCONN) == -1)
+     )
+  {
+    perror(sys->zygote);
+    exit(4);
+  }
+  
+  /* nobody waits for the children */
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sa.sa_flags   = SA_NOCLDWAIT;
+  sigaction(SIGCHLD,&sa,NULL);
+  
+  while(true)
+  {
+    int   fds[3];
+    int   conn;
+    int   n;
+    pid_t pid;
+    
+    conn = accept4(sock,NULL,NULL,SOCK_CLOEXEC);
+    if (conn == -1)
+    {
+      if ((errno == EINTR) || (errno == ECONNABORTED))
+        continue;
+      perror("accept()");
+      exit(4);
+    }
+    
+    n = zygote_recv(conn,fds);
+    if (n < 2)
+    {
+      close(conn);
+      continue;
+    }
+    
+    pid = fork();
+    if (pid == 0)
+    {
+      g_metrics_file[0] = '\0';	/* the zygote's, not ours to unlink */
+      close(sock);
+      close(conn);
+      for (int i = 0 ; i < n ; i++)
+      {
+        dup2(fds[i],i);
+        close(fds[i]);
+      }
+      
+      fcntl(STDIN_FILENO,F_SETFL,fcntl(STDIN_FILENO,F_GETFL,0) | O_NONBLOCK);
+      files_reopen(sys);
+      
+      if (sys->profile != NULL)
+      {
+        sys->prof_forked = true;
+        profile_start();
+      }
+      if (sys->metrics != NULL)
+        sys->metrics = metrics_open(sys->metrics);
+      trace_forked();
+      
+      sys->startup = false;
+      out_write(sys,sys->transcript,sys->transcript_len);
+      free(sys->transcript);
+      sys->transcript = NULL;
+      return;
+    }
+    
+    for (int i = 0 ; i < n ; i++)
+      close(fds[i]);
+    if (pid > 0)
+      write(conn,&pid,sizeof(pid));
+    else
+      perror("fork()");
+    close(conn);
+  }
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; The first time the guest asks for input, it's done starting up.
+;---------------------------------------------------------------------*/
+
+static void startup_done(system__s *sys)
+{
+  if (sys->snapshot != NULL)
+    snapshot_save(sys);
+  zygote_serve(sys);
+}
+
+/********************************************************************/
+
+static void ms_dos(system__s *sys)
+{
+  int            ah;
+  int            dl;
+  int            i;
+  int            c;
+  size_t         idx;
+  size_t         bufidx;
+  unsigned long  pos;
+  unsigned char *buf;
+  fcb__s        *fcb;
+  char           filename[FILENAME_MAX];
+  
+  assert(sys != NULL); 
+  
+  ah = (sys->vm.regs.eax >> 8) & 255;
+  if (sys->metrics != NULL)
+    metrics_add(&sys->metrics->int21[ah],1);
+  
+  switch(ah)
+  {
+    case 0:	/* exit */
+         exit(100);
+    
+    case 0x01: /* Read character with echo */
+         {
+           if (sys->startup)
+             startup_done(sys);
+           
+           /* this one waits, so we can block until the input shows up */
+           int c = wait_buffered_input(sys);
+           if (c >= 0)
+           {
+             sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00) | (c & 0xFF);
+             sys->moved       = 1;
+             if (c != '\n')
+               out_putc(sys, c);
+           }
+           else
+           {
+             /* EOF, return without blocking */
+             sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00);
+           }
+         }
+         break;
+    
+    case 0x02: /* write character */
+         out_putc(sys,sys->vm.regs.edx & 255);
+         sys->moved = 1;
+         handle_prompt_detection(sys,sys->vm.regs.edx & 255);
+         break;
+    
+    case 0x06: /* direct console I/O */
+         dl = sys->vm.regs.edx & 255;
+         if (dl == 0xFF) /* Input */
+         {
+           if (sys->startup)
+             startup_done(sys);
+           
+           int c = read_buffered_input(sys);
+           
+           /*------------------------------------------------------------
+           ; This one doesn't wait, so a guest waiting for input polls in
+           ; a loop (each time costing us a trip out of vm86 mode).  Once
+           ; it has come up empty enough times without doing anything
+           ; else, block until there's input instead of letting it spin.
+           ;-------------------------------------------------------------*/
+           
+           if ((c < 0) && (++sys->idle_polls >= IDLE_POLLS))
+             c = wait_buffered_input(sys);
+           
+           if (c >= 0)
+           {
+             sys->idle_polls = 0;
+             sys->moved      = 1;
+             sys->vm.regs.eax = (sys->vm.regs.eax & 0xFF00) | (c & 0xFF);
+             sys->vm.regs.eflags &= ~0x40; /* Clear ZF */
+           }
+           else
+           {
+             sys->vm.regs.eflags |= 0x40; /* Set ZF */
+           }
+         }
+         else /* Output */
+         {
+           out_putc(sys, dl);
+           sys->moved = 1;
+           handle_prompt_detection(sys, dl);
+         }
+         break;
+    
+    case 0x09: /* write '$' terminated string */
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         assert(idx < 1024*1024uL);
+         buf = memchr(&sys->mem[idx],'$',1024*1024uL - idx);
+         if (buf != NULL)
+         {
+           console_write(sys,(char *)&sys->mem[idx],buf - &sys->mem[idx]);
+           sys->moved = buf - &sys->mem[idx];
+         }
+         break;
+    
+    case 0x0A: /* buffered line input */
+         if (sys->startup)
+           startup_done(sys);
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         assert(idx + 2 + sys->mem[idx] <= 1024*1024uL);
+         sys->mem[idx + 1] = console_read_line(sys,(char *)&sys->mem[idx + 2],sys->mem[idx]);
+         sys->moved        = sys->mem[idx + 1];
+         break;
+    
+    case 0x0F: /* Open file (1.0 version) */
+         sys->vm.regs.eax &= ~255;
+         idx   = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         assert(idx < 1024*1024uL);
+         fcb   = (fcb__s *)&sys->mem[idx];
+         if (fcb->drive > 0)
+           sys->vm.regs.eax |= 255;
+         else
+         {
+           if (open_file(sys,fcb,false) != 0)
+             sys->vm.regs.eax |= 255;
+         }
+         break;
+         
+    case 0x10: /* close file */
+         sys->vm.regs.eax &= ~255;
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         fcb = (fcb__s *)&sys->mem[idx];
+         i   = find_fcb(sys,fcb);
+         assert(i > -1);
+         if (sys->fp[i] != NULL)
+         {
+           fclose(sys->fp[i]);
+           file_unmap(sys,i);
+         }
+         sys->fcbs[i] = NULL;
+         sys->fp[i]   = NULL;
+         sys->vf[i]   = NULL;
+         break;
+         
+    case 0x13: /* delete file */
+         sys->vm.regs.eax &= ~255;
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         fcb = (fcb__s *)&sys->mem[idx];
+         mkfilename(filename,fcb);
+         if (sys->base != -1)
+         {
+           vfile__s *vf = vfile_find(sys->overlay,filename);
+           
+           if ((vf == NULL) && (faccessat(sys->base,filename,F_OK,0) == -1))
+             sys->vm.regs.eax |= 255;
+           else if ((vf != NULL) && vf->deleted)
+             sys->vm.regs.eax |= 255;
+           else
+             vfile_create(sys,filename)->deleted = true;
+         }
+         else if (remove(filename) == -1)
+           sys->vm.regs.eax |= 255;
+         break;
+         
+    case 0x16: /* create file */
+         sys->vm.regs.eax &= ~255;
+         idx   = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         assert(idx < 1024*1024uL);
+         fcb   = (fcb__s *)&sys->mem[idx];
+         if (fcb->drive > 1)
+           sys->vm.regs.eax |= 255;
+         else
+         {
+           if (open_file(sys,fcb,true) != 0)
+             sys->vm.regs.eax |= 255;
+         }
+         break;
+         
+    case 0x19: /* return drive --- it's always A */
+         sys->vm.regs.eax &= ~255;
+         break;
+         
+    case 0x1A: /* set DTA address (sigh)---normally the stub does this */
+         set_word(sys->mem,MEM_STUB + STUB_DTA,sys->vm.regs.edx & 0xFFFF);
+         set_word(sys->mem,MEM_STUB + STUB_DTA + 2,sys->vm.regs.ds);
+         break;
+    
+    case 0x21: /* read record from FCB file */
+         sys->vm.regs.eax &= ~255;
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         fcb = (fcb__s *)&sys->mem[idx];
+         i   = find_fcb(sys,fcb);
+         assert(i > -1);
+         
+         pos = fcb->relrec * fcb->recsize;
+         if (pos > fcb->size)
+         {
            sys->vm.regs.eax |= 1;
            break;
          }
          
          fcb->cblock  = (pos / 512) & 0xFFFF;       /* I guess? */
          fcb->crecnum = (pos % 512) / fcb->recsize; /* I guess? */
-         fseek(sys->fp[i],pos,SEEK_SET);
-         bufidx = (size_t)sys->dtaseg * 16 + (size_t)sys->dtaoff;
+         bufidx = stub_dta(sys);
          buf    = &sys->mem[bufidx];
          if (fcb->size - pos < fcb->recsize)
          {
@@ -634,7 +1732,14 @@ static void ms_dos(system__s *sys)
            memset(buf,0,fcb->recsize);
          }
          
-         fread(buf,1,fcb->recsize,sys->fp[i]);
+         if (sys->vf[i] != NULL)
+           vfile_read(sys->vf[i],buf,pos,fcb->recsize);
+         else if (!filemap_read(&sys->maps[i],buf,pos,fcb->recsize))
+         {
+           fseek(sys->fp[i],pos,SEEK_SET);
+           fread(buf,1,fcb->recsize,sys->fp[i]);
+         }
+         sys->moved = fcb->recsize;
          
          /*-----------------------------------------------------------
          ; all the documentation I've read says this function DOES NOT
@@ -657,10 +1762,24 @@ static void ms_dos(system__s *sys)
          
          fcb->cblock  = (pos / 512) & 0xFFFF;       /* I guess? */
          fcb->crecnum = (pos % 512) / fcb->recsize; /* I guess? */
-         fseek(sys->fp[i],pos,SEEK_SET);
-         bufidx = (size_t)sys->dtaseg * 16 + (size_t)sys->dtaoff;
+         bufidx = stub_dta(sys);
          buf    = &sys->mem[bufidx];
-         fwrite(buf,1,fcb->recsize,sys->fp[i]);
+         
+         if ((sys->base != -1) && (sys->vf[i] == NULL))
+           vfile_copyup(sys,i);
+         
+         if (sys->vf[i] != NULL)
+         {
+           if (!vfile_write(sys->vf[i],buf,pos,fcb->recsize))
+             exit(3);
+         }
+         else
+         {
+           fseek(sys->fp[i],pos,SEEK_SET);
+           fwrite(buf,1,fcb->recsize,sys->fp[i]);
+           fflush(sys->fp[i]);	/* so the map sees it */
+         }
+         sys->moved = fcb->recsize;
          
          /*-----------------------------------------------------------
          ; all the documentation I've read says this function DOES NOT
@@ -672,6 +1791,54 @@ static void ms_dos(system__s *sys)
          fcb->relrec++;
          break;
     
+    case 0x3F: /* read from handle---only stdin for now */
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         pos = sys->vm.regs.ecx & 0xFFFF;
+         assert(idx + pos <= 1024*1024uL);
+         if ((sys->vm.regs.ebx & 0xFFFF) != 0)
+         {
+           sys->vm.regs.eax     = 6; /* invalid handle */
+           sys->vm.regs.eflags |= 1; /* Set CF */
+           break;
+         }
+         
+         if (sys->startup)
+           startup_done(sys);
+         
+         sys->vm.regs.eax     = console_read(sys,(char *)&sys->mem[idx],pos);
+         sys->vm.regs.eflags &= ~1;
+         sys->moved           = sys->vm.regs.eax & 0xFFFF;
+         break;
+    
+    case 0x40: /* write to handle---only stdout and stderr for now */
+         idx = sys->vm.regs.ds * 16 + (sys->vm.regs.edx & 0xFFFF);
+         pos = sys->vm.regs.ecx & 0xFFFF;
+         assert(idx + pos <= 1024*1024uL);
+         i   = sys->vm.regs.ebx & 0xFFFF;
+         if (i == 1)
+           console_write(sys,(char *)&sys->mem[idx],pos);
+         else if (i == 2)
+         {
+           out_flush(sys);
+           sys->writes++;
+           if (write(STDERR_FILENO,&sys->mem[idx],pos) < 0)
+             pos = 0;
+         }
+         else
+         {
+           sys->vm.regs.eax     = 6; /* invalid handle */
+           sys->vm.regs.eflags |= 1; /* Set CF */
+           break;
+         }
+         
+         sys->vm.regs.eax     = pos;
+         sys->vm.regs.eflags &= ~1;
+         sys->moved           = pos;
+         break;
+    
+    case 0x4C: /* exit with return code */
+         exit(sys->vm.regs.eax & 255);
+    
     default:
          fprintf(stderr,"\n\nUnimplented function %02X\n",ah);
          dump_regs(&sys->vm.regs);
@@ -681,12 +1848,329 @@ static void ms_dos(system__s *sys)
 
 /********************************************************************/
 
-static system__s g_sys = { .mem = MAP_FAILED };
+/*---------------------------------------------------------------------
+; ms_dos() with a record of it in the trace ring, as libmsdos keeps.  The
+; stub's own 02h/06h/09h output never comes out here, so it isn't in
+; it, and exit doesn't come back, so that one is counted on the way in.
+;---------------------------------------------------------------------*/
+
+static void dos_traced(system__s *sys)
+{
+  int                 ah = (sys->vm.regs.eax >> 8) & 255;
+  unsigned long long  start;
+  vm_trace__s        *t  = trace_begin(&sys->trace,&start);
+  
+  t->icount = 0;
+  t->ax     = sys->vm.regs.eax;
+  t->bx     = sys->vm.regs.ebx;
+  t->cx     = sys->vm.regs.ecx;
+  t->dx     = sys->vm.regs.edx;
+  t->ds     = sys->vm.regs.ds;
+  
+  if ((ah == 0x4C) || (ah == 0))
+  {
+    t->bytes = 0;
+    t->ret   = sys->vm.regs.eax;
+    t->flags = 0;
+    trace_end(&sys->trace,t,start);
+    ms_dos(sys);
+    return;
+  }
+  
+  sys->moved  = 0;
+  sys->waited = false;
+  ms_dos(sys);
+  
+  t->bytes = sys->moved;
+  t->ret   = sys->vm.regs.eax;
+  t->flags = sys->vm.regs.eflags & 0x01 ? TRACE_CF : 0;
+  if (sys->waited)
+    t->flags |= TRACE_WAIT;
+  
+  trace_end(&sys->trace,t,start);
+}
+
+static void dos_call(system__s *sys)
+{
+  if (sys->trace.rec != NULL)
+    dos_traced(sys);
+  else
+    ms_dos(sys);
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; A call passed on by the stub.  It IRETs back to the guest, so whatever
+; flags we set have to go into the ones the guest's INT 21h pushed.
+;---------------------------------------------------------------------*/
+
+static void stub_call(system__s *sys)
+{
+  size_t   frame = sys->vm.regs.ss * 16 + (sys->vm.regs.esp & 0xFFFF);
+  uint16_t flags = get_word(sys->mem,frame + 4);
+  
+  dos_call(sys);
+  flags = (flags & ~0x08D5) | (sys->vm.regs.eflags & 0x08D5);
+  set_word(sys->mem,frame + 4,flags);
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Guest memory is sixteen MAP_PRIVATE views of one 64K segment of 0xCC
+; in a memfd, so a page costs nothing until the guest writes to it, and
+; the zygote's children share all the ones it never did.  -s asks the
+; kernel how many that is.
+;---------------------------------------------------------------------*/
+
+#define BLANK_SIZE	0x10000
+
+static void *mem_map(void)
+{
+  void *blank;
+  int   fd;
+  
+  fd = memfd_create("msdos-blank",MFD_CLOEXEC);
+  if ((fd == -1) || (ftruncate(fd,BLANK_SIZE) == -1))
+    return MAP_FAILED;
+  
+  blank = mmap(NULL,BLANK_SIZE,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  if (blank == MAP_FAILED)
+    return MAP_FAILED;
+  memset(blank,0xCC,BLANK_SIZE);
+  munmap(blank,BLANK_SIZE);
+  
+  for (size_t off = 0 ; off < 1024*1024 ; off += BLANK_SIZE)
+    if (mmap((void *)off,BLANK_SIZE,PROT_EXEC | PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_FIXED,fd,0) == MAP_FAILED)
+      return MAP_FAILED;
+  
+  close(fd);
+  return 0;
+}
+
+static long mem_resident(void)
+{
+  uint64_t entry[1024*1024 / 4096];
+  long     pages = 0;
+  int      fd;
+  
+  fd = open("/proc/self/pagemap",O_RDONLY);
+  if (fd == -1)
+    return -1;
+  if (pread(fd,entry,sizeof(entry),0) != sizeof(entry))
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  
+  /* present, and not the page cache of the memfd */
+  for (size_t i = 0 ; i < sizeof(entry) / sizeof(entry[0]) ; i++)
+    if ((entry[i] & (1uLL << 63)) && !(entry[i] & (1uLL << 61)))
+      pages++;
+  
+  return pages * 4;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; --profile.  ITIMER_PROF goes off every ms of CPU time we use, ours or
+; the guest's; the signal knocks us out of vm86() if that's where we are
+; and the next time round the loop takes the guest's CS:IP, and whatever
+; looks like a return address on its stack, as a sample (see profile.h).
+;---------------------------------------------------------------------*/
+
+#define PROF_USEC	1000	/* CPU time between samples */
+
+static volatile sig_atomic_t g_prof_due;
+
+static void prof_alarm(int sig)
+{
+  (void)sig;
+  g_prof_due = 1;
+}
+
+/* timers aren't inherited, so a zygote child calls this again */
+static void profile_start(void)
+{
+  struct itimerval it = { { 0 , PROF_USEC } , { 0 , PROF_USEC } };
+  struct sigaction sa;
+  
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = prof_alarm;
+  sa.sa_flags   = SA_RESTART;
+  sigaction(SIGPROF,&sa,NULL);
+  setitimer(ITIMER_PROF,&it,NULL);
+}
+
+static uint8_t prof_rb(void *mem,uint16_t seg,uint16_t off)
+{
+  return ((uint8_t *)mem)[((seg << 4) + off) & 0xFFFFF];
+}
+
+static void profile_sample(system__s *sys)
+{
+  struct vm86_regs *regs = &sys->vm.regs;
+  
+  g_prof_due = 0;
+  prof_sample(&sys->prof,prof_rb,sys->mem,regs->cs,regs->eip,regs->ss,regs->esp);
+}
+
+/* --profile file gets the folded stacks, file.flat the flat profile */
+static void profile_write(system__s *sys)
+{
+  char  folded[FILENAME_MAX];
+  char  flat[FILENAME_MAX + 8];
+  char  every[64];
+  FILE *fp;
+  FILE *ff;
+  
+  if (sys->prof_forked)
+    snprintf(folded,sizeof(folded),"%s.%ld",sys->profile,(long)getpid());
+  else
+    snprintf(folded,sizeof(folded),"%s",sys->profile);
+  snprintf(flat,sizeof(flat),"%s.flat",folded);
+  snprintf(every,sizeof(every),"%d us of CPU time",PROF_USEC);
+  
+  fp = fopen(folded,"w");
+  ff = fopen(flat,"w");
+  if ((fp == NULL) || (ff == NULL))
+    perror((fp == NULL) ? folded : flat);
+  else
+    prof_write(&sys->prof,fp,ff,every);
+  
+  if (fp != NULL)
+    fclose(fp);
+  if (ff != NULL)
+    fclose(ff);
+}
+
+/********************************************************************/
+
+static system__s g_sys = { .mem = MAP_FAILED , .base = -1 , .behind = -1 };
+
+/*---------------------------------------------------------------------
+; --trace, as in msdos_fixes.  The last INT 21h calls are kept in memory
+; and written out (for msdos_trace to make sense of) when the program
+; ends, on SIGUSR2, or on the way down from a crash or SIGINT/SIGTERM.
+; Each zygote child writes file.pid.
+;---------------------------------------------------------------------*/
+
+static const char *g_trace_name;
+static char        g_trace_file[FILENAME_MAX];
+
+static void trace_dump(void)
+{
+  int fd;
+  
+  if (g_sys.trace.rec == NULL)
+    return;
+  
+  fd = open(g_trace_file,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0666);
+  if (fd != -1)
+  {
+    trace_write(&g_sys.trace,fd);
+    close(fd);
+  }
+}
+
+static void trace_signal(int sig)
+{
+  int saved = errno;
+  
+  trace_dump();
+  errno = saved;
+  
+  /* SA_RESETHAND has put the default action back */
+  if (sig != SIGUSR2)
+    raise(sig);
+}
+
+static void trace_start(const char *file,long records)
+{
+  static const int  fatal[] = { SIGSEGV , SIGBUS , SIGILL , SIGFPE , SIGABRT , SIGINT , SIGTERM };
+  struct sigaction  sa;
+  
+  if (trace_init(&g_sys.trace,(records < 1) ? 1 : records) != 0)
+    exit(4);
+  
+  g_trace_name = file;
+  snprintf(g_trace_file,sizeof(g_trace_file),"%s",file);
+  
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags   = SA_RESTART;
+  sigaction(SIGUSR2,&sa,NULL);
+  
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+  for (size_t i = 0 ; i < sizeof(fatal) / sizeof(fatal[0]) ; i++)
+    sigaction(fatal[i],&sa,NULL);
+}
+
+static void trace_forked(void)
+{
+  if (g_sys.trace.rec != NULL)
+    snprintf(g_trace_file,sizeof(g_trace_file),"%s.%ld",g_trace_name,(long)getpid());
+}
+
+/********************************************************************/
 
 static void cleanup(void)
 {
+  if (g_sys.mem != MAP_FAILED)
+    stub_drain(&g_sys);
+  out_flush(&g_sys);
+  
+  if (g_sys.stats)
+    fprintf(
+      stderr,
+      "console:       %llu writes, %llu reads, %llu polls\n"
+      "vm86 exits:    %llu\n"
+      "memory:        %ld of 1024 KiB written\n",
+      g_sys.writes,
+      g_sys.reads,
+      g_sys.polls,
+      g_sys.exits,
+      (g_sys.mem != MAP_FAILED) ? mem_resident() : -1
+    );
+  
+  for (int i = 0 ; i < 16 ; i++)
+    if (g_sys.fp[i] != NULL)
+      file_unmap(&g_sys,i);
+  
+  if (g_sys.stats && (g_sys.base != -1))
+  {
+    size_t files = 0;
+    size_t bytes = 0;
+    
+    for (vfile__s *vf = g_sys.overlay ; vf != NULL ; vf = vf->next)
+    {
+      files++;
+      bytes += vf->size;
+    }
+    fprintf(stderr,"overlay:       %zu files, %zu bytes\n",files,bytes);
+  }
+  
+  if (g_sys.behind != -1)
+    vfile_flush(g_sys.overlay,g_sys.behind);
+  
+  if (g_sys.latency != NULL)
+    latency_write(g_sys.latency,stderr);
+  
+  if (g_sys.profile != NULL)
+    profile_write(&g_sys);
+  prof_init(&g_sys.prof,0,false);
+  
+  trace_dump();
+  trace_init(&g_sys.trace,0);
+  
   if (g_sys.mem != MAP_FAILED)
     munmap(g_sys.mem,1024*1024);
+  
+  free(g_sys.transcript);
+  free(g_sys.latency);
 }
 
 int main(int argc,char *argv[])
@@ -702,41 +2186,219 @@ int main(int argc,char *argv[])
     "TRAP"
   };
   
-  if (argc < 2)
+  struct sigaction  sa;
+  const char       *program = NULL;
+  const char       *restore = NULL;
+  const char       *trace   = NULL;
+  long              records = TRACE_RECORDS;
+  bool              metered = false;
+  bool              timed   = false;
+  
+  g_sys.out_max = OUT_SIZE;
+  
+  for (int i = 1 ; i < argc ; i++)
+  {
+    if ((strcmp(argv[i],"--snapshot") == 0) && (i + 1 < argc))
+      g_sys.snapshot = argv[++i];
+    else if ((strcmp(argv[i],"--zygote") == 0) && (i + 1 < argc))
+      g_sys.zygote = argv[++i];
+    else if ((strcmp(argv[i],"--restore") == 0) && (i + 1 < argc))
+      restore = argv[++i];
+    else if ((strcmp(argv[i],"--base") == 0) && (i + 1 < argc))
+    {
+      g_sys.base = open(argv[++i],O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (g_sys.base == -1)
+      {
+        perror(argv[i]);
+        exit(2);
+      }
+    }
+    else if ((strcmp(argv[i],"--write-behind") == 0) && (i + 1 < argc))
+    {
+      g_sys.behind = open(argv[++i],O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (g_sys.behind == -1)
+      {
+        perror(argv[i]);
+        exit(2);
+      }
+    }
+    else if ((strcmp(argv[i],"--trace") == 0) && (i + 1 < argc))
+      trace = argv[++i];
+    else if ((strcmp(argv[i],"--trace-size") == 0) && (i + 1 < argc))
+      records = strtol(argv[++i],NULL,10);
+    else if ((strcmp(argv[i],"--profile") == 0) && (i + 1 < argc))
+      g_sys.profile = argv[++i];
+    else if (strcmp(argv[i],"--metrics") == 0)
+      metered = true;
+    else if (strcmp(argv[i],"--latency") == 0)
+      timed = true;
+    else if (strcmp(argv[i],"-s") == 0)
+      g_sys.stats = true;
+    else if ((strcmp(argv[i],"-o") == 0) && (i + 1 < argc))
+    {
+      long max = strtol(argv[++i],NULL,10);
+      g_sys.out_max = (max < 0) ? 0 : (max > OUT_SIZE) ? OUT_SIZE : (size_t)max;
+    }
+    else if (program == NULL)
+      program = argv[i];
+  }
+  
+  if ((program == NULL) == (restore == NULL))
+  {
+    fprintf(stderr,"usage: %s file [--snapshot file | --zygote socket] [--base dir [--write-behind dir]] [--trace file [--trace-size n]] [--profile file] [--metrics] [--latency] [-s] [-o bytes]\n",argv[0]);
+    fprintf(stderr,"       %s --restore file [--zygote socket] [--base dir [--write-behind dir]] [--trace file [--trace-size n]] [--profile file] [--metrics] [--latency] [-s] [-o bytes]\n",argv[0]);
+    exit(2);
+  }
+  
+  if ((g_sys.behind != -1) && (g_sys.base == -1))
   {
-    fprintf(stderr,"usage: %s file\n",argv[0]);
+    fprintf(stderr,"%s: --write-behind needs --base\n",argv[0]);
     exit(2);
   }
+  
+  g_sys.startup = (g_sys.snapshot != NULL) || (g_sys.zygote != NULL);
 
   setvbuf(stdin,NULL,_IONBF,0);  
   setvbuf(stdout,NULL,_IONBF,0);
   atexit(cleanup);
   
-  g_sys.mem = mmap(0,1024*1024,PROT_EXEC | PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,-1,0);
+  if (metered)
+  {
+    g_sys.metrics = metrics_open(NULL);
+    atexit(metrics_close);
+  }
+  
+  if (timed)
+  {
+    g_sys.latency = calloc(1,sizeof(latency__s));
+    if (g_sys.latency == NULL)
+    {
+      perror("calloc()");
+      exit(4);
+    }
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = latency_signal;
+    sigaction(SIGUSR1,&sa,NULL);
+  }
+  
+  /*---------------------------------------------------------------------
+  ; The output timer.  The signal also knocks us out of vm86(), which
+  ; comes back as VM86_SIGNAL, and that's when the flush happens.
+  ;---------------------------------------------------------------------*/
+  
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = out_alarm;
+  sa.sa_flags   = SA_RESTART;
+  sigaction(SIGALRM,&sa,NULL);
+  
+  if (trace != NULL)
+    trace_start(trace,records);
+  
+  if (g_sys.profile != NULL)
+  {
+    if (prof_init(&g_sys.prof,SEG_LOAD,true) != 0)
+      exit(4);
+    profile_start();
+  }
+  
+  g_sys.mem = mem_map();
   if (g_sys.mem == MAP_FAILED)
   {
     perror("mmap()");
     exit(3);
   }
   
-  memset(g_sys.mem,0xCC,1024*1024);  
   memset(&g_sys.vm,0,sizeof(g_sys.vm));
   memset(&g_sys.vm.int_revectored,  255,sizeof(g_sys.vm.int_revectored));
   memset(&g_sys.vm.int21_revectored,255,sizeof(g_sys.vm.int21_revectored));
+  
+  /*---------------------------------------------------------------------
+  ; INT 21h goes through the vector table to the stub, but only for what
+  ; it handles; the rest still comes straight to us.  With -o 0 output
+  ; has to go out as it happens, so that comes straight to us too.
+  ;---------------------------------------------------------------------*/
+  
+  revector(&g_sys.vm.int_revectored,0x21,false);
+  revector(&g_sys.vm.int21_revectored,0x19,false);
+  revector(&g_sys.vm.int21_revectored,0x1A,false);
+  if (g_sys.out_max > 0)
+  {
+    revector(&g_sys.vm.int21_revectored,0x02,false);
+    revector(&g_sys.vm.int21_revectored,0x06,false);
+    revector(&g_sys.vm.int21_revectored,0x09,false);
+  }
   g_sys.vm.cpu_type = CPU_086;
   
-  load_exe(argv[1],g_sys.mem,&g_sys.vm.regs);
+  if (restore != NULL)
+  {
+    if (snapshot_restore(&g_sys,restore) != EXIT_SUCCESS)
+      exit(4);
+  }
+  else
+    load_exe(program,g_sys.mem,&g_sys.vm.regs);
   
   while(true)
   {
-    int rc   = vm86(VM86_ENTER,&g_sys.vm);
-    int type = VM86_TYPE(rc);
-    int arg  = VM86_ARG(rc);
+    int  rc   = vm86(VM86_ENTER,&g_sys.vm);
+    int  type = VM86_TYPE(rc);
+    int  arg  = VM86_ARG(rc);
+    bool held;
+    
+    g_sys.exits++;
+    if (g_sys.metrics != NULL)
+      metrics_set(&g_sys.metrics->entries,g_sys.exits);
     
     if (rc < 0)
     {
-      perror("vm86()");
-      exit(4);
+      if (errno == EINTR)
+        type = VM86_SIGNAL;
+      else
+      {
+        perror("vm86()");
+        exit(4);
+      }
+    }
+    
+    if (g_prof_due)
+      profile_sample(&g_sys);
+    latency_report(&g_sys);
+    
+    /* the stub's first byte stays put, or every byte would be a first */
+    if ((type == VM86_INTx) && (arg == STUB_PENDING))
+    {
+      out_clock(&g_sys);
+      continue;
+    }
+    
+    /*---------------------------------------------------------------------
+    ; A signal can come in the middle of the stub's putc, after it loads
+    ; STUB_LEN and before it stores it back one more, and if we emptied the
+    ; buffer then those bytes would go out again.  So while it's in the
+    ; stub the buffer waits for the next trip out that isn't a signal, and
+    ; the clock starts over so that won't be long.
+    ;---------------------------------------------------------------------*/
+    
+    held = (type == VM86_SIGNAL) && (g_sys.vm.regs.cs == SEG_STUB);
+    if (!held)
+      stub_drain(&g_sys);
+    
+    if (g_flush_due)
+    {
+      out_flush(&g_sys);
+      if (held)
+        out_clock(&g_sys);
+    }
+    
+    if (type == VM86_SIGNAL)
+      continue;
+    
+    if ((type == VM86_INTx) && (arg == STUB_FLUSH))
+      continue;
+    
+    if ((type == VM86_INTx) && (arg == STUB_CALL))
+    {
+      stub_call(&g_sys);
+      continue;
     }
     
     if (type != VM86_INTx)
@@ -761,7 +2423,7 @@ int main(int argc,char *argv[])
       exit(6);
     }
     
-    ms_dos(&g_sys);
+    dos_call(&g_sys);
   }
   
   return 0;
@@ -23,6 +23,13 @@
 
 /* Improved portable version with better I/O handling for pipes */
 
+/*---------------------------------------------------------------------
+; The emulator itself is in libmsdos.c; this hooks one VM up to stdin and
+; stdout.  Output from the guest is passed on when the Racter prompt shows
+; up, when the guest waits for input, OUT_DELAY ms after it was last
+; passed on, or once -o bytes have piled up.
+;---------------------------------------------------------------------*/
+
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,995 +37,1080 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <errno.h>
-#include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <poll.h>
+#include <pthread.h>
 
-#define SEG_ENV		0x1000
-#define SEG_PSP		0x2000
-#define SEG_LOAD	0x2010
+#include "libmsdos.h"
 
-#define MEM_ENV		(SEG_ENV  * 16)
-#define MEM_PSP		(SEG_PSP  * 16)
-#define MEM_LOAD	(SEG_LOAD * 16)
+#define SLICE		65536	/* instructions between looks at the clock */
+#define OUT_DELAY	20	/* ms before buffered output goes out anyway */
+#define TRACE_RECORDS	4096	/* INT 21h calls --trace keeps by default */
+#define PROF_PERIOD	10000	/* instructions between --profile samples */
 
 /********************************************************************/
 
-typedef struct fcbs	/* short FCB block */
-{
-  char     drive;
-  char     name[8];
-  char     ext[3];
-  uint16_t cblock;
-  uint16_t recsize;
-} __attribute__((packed)) fcbs__s;
+/*---------------------------------------------------------------------
+; --latency.  SIGUSR1 asks for the histograms so far, which go out next
+; time we come up for air (even from waiting on input).
+;---------------------------------------------------------------------*/
 
-typedef struct fcb
-{
-  char     drive;
-  char     name[8];
-  char     ext[3];
-  uint16_t cblock;
-  uint16_t recsize;
-  uint32_t size;
-  uint16_t date;
-  uint16_t time;
-  uint16_t rsvp0;
-  uint8_t  crecnum;
-  uint32_t relrec;
-} fcb__s;
+static latency__s            *g_latency;
+static volatile sig_atomic_t  g_latency_due;
 
-typedef struct psp
+static void latency_signal(int sig)
 {
-  uint8_t  warmboot[2];		/* 0xCD, 0x20 */
-  uint16_t last_seg;
-  uint8_t  rsvp0;
-  uint8_t  oldmscall_jmp;	/* 0x9A, offlo, offhi, seglo, seghi */
-  uint16_t oldmscall_off;
-  uint16_t oldmscall_seg;
-  uint16_t termaddr[2];
-  uint16_t ctrlcaddr[2];
-  uint16_t erroraddr[2];
-  uint8_t  rsvp1[22];
-  uint16_t envp;
-  uint8_t  rsvp2[34];
-  uint8_t  mscall[3];		/* 0xCD , 0x21 , 0xCB */
-  uint8_t  rsvp3[9];
-  fcbs__s  primary;
-  fcbs__s  secondary;
-  uint8_t  rsvp[4];
-  uint8_t  cmdlen;
-  uint8_t  cmd[127];
-} __attribute__((packed)) psp__s;
+  (void)sig;
+  g_latency_due = 1;
+}
 
-typedef struct exehdr
+static void latency_report(void)
 {
-  uint8_t  magic[2];	/* 0x4D, 0x5A */
-  uint16_t lastpagesize;
-  uint16_t filepages;
-  uint16_t numreloc;
-  uint16_t hdrpara;
-  uint16_t minalloc;
-  uint16_t maxalloc;
-  uint16_t init_ss;
-  uint16_t init_sp;
-  uint16_t chksum;
-  uint16_t init_ip;
-  uint16_t init_cs;
-  uint16_t reltable;
-  uint16_t overlay;
-} __attribute__((packed)) exehdr__s;
+  if (g_latency_due && (g_latency != NULL))
+  {
+    g_latency_due = 0;
+    latency_write(g_latency,stderr);
+  }
+}
 
-/* Enhanced x86 registers structure */
-typedef struct x86_regs {
-  uint32_t eax, ebx, ecx, edx;
-  uint32_t esi, edi, ebp, esp;
-  uint32_t eip;
-  uint32_t eflags;
-  uint16_t cs, ds, es, ss, fs, gs;
-} x86_regs;
+/********************************************************************/
 
-typedef struct system
+typedef struct console
 {
-  x86_regs                regs;
-  unsigned char          *mem;
-  fcb__s                 *fcbs[16];
-  FILE                   *fp[16];
-  uint16_t                dtaseg;
-  uint16_t                dtaoff;
-  
-  /* Racter prompt detection */
-  bool input;
-  char prompt[4];
-  bool running;
-  
-  /* Input buffer for better pipe handling */
-  char input_buffer[256];
-  int input_len;
-  int input_pos;
-  
-  /* Debug mode */
-  bool debug;
-} system__s;
-
-static system__s g_sys;
+  vm__s           *vm;
+  struct timespec  last;	/* output last went out */
+  
+  /* Host console I/O calls, reported by -s */
+  unsigned long long writes;
+  unsigned long long reads;
+  unsigned long long polls;
+  
+  /* --replay: inputs fed, and the prompts and words in the output */
+  bool               replay;
+  unsigned long long inputs;
+  char               prompt[3];
+  bool               word;
+  unsigned long long turns;
+  unsigned long long words;
+} console__s;
 
 /********************************************************************/
 
-static void cleanup(void)
+static void console_count(console__s *con,const char *data,size_t size)
 {
-  if (g_sys.mem != NULL)
+  for (size_t i = 0 ; i < size ; i++)
   {
-    free(g_sys.mem);
-    g_sys.mem = NULL;
+    bool space = isspace((unsigned char)data[i]) || (data[i] == '>');
+  
+    if (!space && !con->word)
+      con->words++;
+    con->word = !space;
+  
+    con->prompt[0] = con->prompt[1];
+    con->prompt[1] = con->prompt[2];
+    con->prompt[2] = data[i];
+    if (memcmp(con->prompt,"\r\n>",3) == 0)
+      con->turns++;
   }
+}
+
+static void console_write(console__s *con)
+{
+  const char *data;
+  size_t      size;
+  
+  clock_gettime(CLOCK_MONOTONIC,&con->last);
+  vm_drain(con->vm,&data,&size);
+  if (con->replay)
+    console_count(con,data,size);
   
-  for (int i = 0; i < 16; i++)
+  while (size > 0)
   {
-    if (g_sys.fp[i] != NULL)
+    ssize_t bytes = write(STDOUT_FILENO,data,size);
+  
+    con->writes++;
+    if (bytes < 0)
     {
-      fclose(g_sys.fp[i]);
-      g_sys.fp[i] = NULL;
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+      {
+        struct pollfd pfd = { .fd = STDOUT_FILENO , .events = POLLOUT };
+        poll(&pfd,1,-1);
+        continue;
+      }
+      return;	/* nobody is listening any more */
     }
+  
+    data += bytes;
+    size -= bytes;
   }
 }
 
 /********************************************************************/
 
-static inline uint16_t get_word(unsigned char *mem, size_t offset)
+static bool console_due(console__s *con)
 {
-  return mem[offset] | (mem[offset + 1] << 8);
+  struct timespec now;
+  long            ms;
+  
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  ms = (now.tv_sec - con->last.tv_sec) * 1000
+     + (now.tv_nsec - con->last.tv_nsec) / 1000000;
+  return ms >= OUT_DELAY;
 }
 
-static inline void set_word(unsigned char *mem, size_t offset, uint16_t value)
+/*---------------------------------------------------------------------
+; Park on poll() until stdin has something for the guest.  Readable with
+; nothing to read is EOF, which the guest gets told about too.
+;---------------------------------------------------------------------*/
+
+static void console_read(console__s *con)
 {
-  mem[offset] = value & 0xFF;
-  mem[offset + 1] = (value >> 8) & 0xFF;
+  char buffer[4096];
+  
+  while(true)
+  {
+    struct pollfd pfd = { .fd = STDIN_FILENO , .events = POLLIN };
+    ssize_t       bytes;
+  
+    con->polls++;
+    if (poll(&pfd,1,-1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        latency_report();
+        continue;
+      }
+      vm_feed(con->vm,NULL,0);
+      return;
+    }
+  
+    con->reads++;
+    bytes = read(STDIN_FILENO,buffer,sizeof(buffer));
+    if (bytes < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN))
+        continue;
+      bytes = 0;
+    }
+  
+    vm_feed(con->vm,buffer,bytes);
+    return;
+  }
 }
 
-static inline uint32_t get_dword(unsigned char *mem, size_t offset)
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; --trace.  The VM keeps its last INT 21h calls in memory, and they're
+; written out (for msdos_trace to make sense of) when the program ends,
+; on SIGUSR2, or on the way down from a crash or SIGINT/SIGTERM.  Each
+; zygote child writes file.pid.
+;---------------------------------------------------------------------*/
+
+static vm__s      *g_trace_vm;
+static const char *g_trace_name;
+static char        g_trace_file[FILENAME_MAX];
+
+static void trace_dump(void)
 {
-  return get_word(mem, offset) | ((uint32_t)get_word(mem, offset + 2) << 16);
+  int fd;
+  
+  if (g_trace_vm == NULL)
+    return;
+  
+  fd = open(g_trace_file,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0666);
+  if (fd != -1)
+  {
+    vm_trace_dump(g_trace_vm,fd);
+    close(fd);
+  }
 }
 
-static inline void set_dword(unsigned char *mem, size_t offset, uint32_t value)
+static void trace_signal(int sig)
 {
-  set_word(mem, offset, value & 0xFFFF);
-  set_word(mem, offset + 2, (value >> 16) & 0xFFFF);
+  int saved = errno;
+  
+  trace_dump();
+  errno = saved;
+  
+  /* SA_RESETHAND has put the default action back */
+  if (sig != SIGUSR2)
+    raise(sig);
 }
 
-static inline size_t seg_off_to_linear(uint16_t seg, uint16_t off)
+static void trace_start(vm__s *vm,const char *file,long records)
 {
-  return ((size_t)seg * 16) + off;
+  static const int  fatal[] = { SIGSEGV , SIGBUS , SIGILL , SIGFPE , SIGABRT , SIGINT , SIGTERM };
+  struct sigaction  sa;
+  
+  if (vm_trace(vm,(records < 1) ? 1 : records) != 0)
+    exit(4);
+  
+  g_trace_vm   = vm;
+  g_trace_name = file;
+  snprintf(g_trace_file,sizeof(g_trace_file),"%s",file);
+  
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags   = SA_RESTART;
+  sigaction(SIGUSR2,&sa,NULL);
+  
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+  for (size_t i = 0 ; i < sizeof(fatal) / sizeof(fatal[0]) ; i++)
+    sigaction(fatal[i],&sa,NULL);
 }
 
-/********************************************************************/
+static void trace_forked(void)
+{
+  if (g_trace_vm != NULL)
+    snprintf(g_trace_file,sizeof(g_trace_file),"%s.%ld",g_trace_name,(long)getpid());
+}
+
+/*---------------------------------------------------------------------
+; --profile file writes the folded stacks to file and the flat profile to
+; file.flat (file.pid and file.pid.flat in a zygote child).
+;---------------------------------------------------------------------*/
 
-static void mkfilename(char *fname, fcb__s *fcb)
+static void profile_write(vm__s *vm,const char *name,bool forked)
 {
-  int i;
-  int c;
+  char  folded[FILENAME_MAX];
+  char  flat[FILENAME_MAX + 8];
+  FILE *fp;
+  FILE *ff;
   
-  for(i = 0 , c = 0 ; (i < 8) && (fcb->name[i] != ' ') ; i++ , c++)
-    fname[c] = fcb->name[i];
-    
-  if (fcb->ext[0] != ' ')
-  {
-    fname[c++] = '.';
-    for(i = 0 ; (i < 3) && (fcb->ext[i] != ' ') ; i++ , c++)
-      fname[c] = fcb->ext[i];
-  }
+  if (forked)
+    snprintf(folded,sizeof(folded),"%s.%ld",name,(long)getpid());
+  else
+    snprintf(folded,sizeof(folded),"%s",name);
+  snprintf(flat,sizeof(flat),"%s.flat",folded);
+  
+  fp = fopen(folded,"w");
+  ff = fopen(flat,"w");
+  if ((fp == NULL) || (ff == NULL))
+    perror((fp == NULL) ? folded : flat);
+  else
+    vm_profile_write(vm,fp,ff);
   
-  fname[c] = '\0';
+  if (fp != NULL)
+    fclose(fp);
+  if (ff != NULL)
+    fclose(ff);
 }
 
 /********************************************************************/
 
-static int find_fcb(system__s *sys, fcb__s *fcb)
+/*---------------------------------------------------------------------
+; --metrics (see metrics.h).  The file goes when we exit; a zygote child
+; gets one of its own, starting from what the zygote had counted.
+;---------------------------------------------------------------------*/
+
+static char g_metrics_file[FILENAME_MAX];
+
+static void metrics_close(void)
 {
-  for (size_t i = 0 ; i < 16 ; i++)
-    if (sys->fcbs[i] == fcb)
-      return i;
-  return -1;
+  if (g_metrics_file[0] != '\0')
+    unlink(g_metrics_file);
 }
 
-/********************************************************************/
-
-static int open_file(system__s *sys, fcb__s *fcb, bool create)
+static metrics__s *metrics_open(metrics__s *from)
 {
-  char fname[13];
-  int  idx;
-  int  i;
+  metrics__s      *m;
+  struct timespec  now;
+  int              fd;
   
-  mkfilename(fname, fcb);
+  snprintf(g_metrics_file,sizeof(g_metrics_file),"%s/%s%ld",METRICS_DIR,METRICS_PREFIX,(long)getpid());
+  fd = open(g_metrics_file,O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+  if ((fd == -1) || (ftruncate(fd,sizeof(metrics__s)) == -1))
+  {
+    perror(g_metrics_file);
+    exit(4);
+  }
+  m = mmap(NULL,sizeof(metrics__s),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (m == MAP_FAILED)
+  {
+    perror("mmap()");
+    exit(4);
+  }
   
-  if (create)
+  if (from != NULL)
   {
-    idx = find_fcb(sys, fcb);
-    if (idx == -1)
-    {
-      for (i = 0 ; i < 16 ; i++)
-        if (sys->fcbs[i] == NULL)
-          break;
-      idx = i;
-    }
-    
-    sys->fp[idx] = fopen(fname, "w+b");
+    *m = *from;
+    munmap(from,sizeof(metrics__s));
   }
   else
   {
-    for (i = 0 ; i < 16 ; i++)
-      if (sys->fcbs[i] == NULL)
-        break;
-    idx = i;
-    sys->fp[idx] = fopen(fname, "r+b");
-    if (sys->fp[idx] == NULL)
-      sys->fp[idx] = fopen(fname, "rb");
+    clock_gettime(CLOCK_REALTIME,&now);
+    m->version = METRICS_VERSION;
+    m->backend = METRICS_SOFT;
+    m->started = now.tv_sec * 1000000000uLL + now.tv_nsec;
+    memcpy(m->magic,METRICS_MAGIC,sizeof(m->magic));
   }
   
-  if (sys->fp[idx] == NULL)
+  m->pid = getpid();
+  return m;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Zygote mode.  Like --snapshot, we run up to the first time the guest
+; asks for input, but then sit on a Unix socket instead.  Each connection
+; sends us its stdin and stdout (and optionally stderr) with SCM_RIGHTS;
+; we fork a child onto them, which shares the guest image copy-on-write,
+; replays what the guest has written so far and carries on from there.
+; The caller gets the child's pid back.
+;---------------------------------------------------------------------*/
+
+static int zygote_recv(int conn,int *fds)
+{
+  char            byte;
+  char            cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec    iov = { .iov_base = &byte , .iov_len = 1 };
+  struct msghdr   msg;
+  struct cmsghdr *cmsg;
+  int             n = 0;
+  
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  
+  if (recvmsg(conn,&msg,MSG_CMSG_CLOEXEC) < 1)
+    return 0;
+  
+  for (cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR(&msg,cmsg))
   {
-    return 255;
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+    {
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds,CMSG_DATA(cmsg),n * sizeof(int));
+      break;
+    }
   }
   
-  sys->fcbs[idx] = fcb;
-  fcb->cblock    = 0;
-  fcb->crecnum   = 0;
-  fcb->recsize   = 128;
-  
-  if (!create)
+  /* we need at least stdin and stdout */
+  if (n < 2)
   {
-    struct stat buf;
-    fstat(fileno(sys->fp[idx]), &buf);
-    fcb->size = buf.st_size;
+    while (n > 0)
+      close(fds[--n]);
   }
-  else
-    fcb->size = 0;
-    
-  fcb->drive = 3;  /* C: drive */
-  return 0;
+  
+  return n;
 }
 
-/********************************************************************/
-
-static int load_program(
-        const char       *fname,
-        unsigned char    *mem,
-        x86_regs         *regs
-)
+static void zygote_serve(console__s *con,const char *path)
 {
-  exehdr__s  hdr;
-  size_t     binsize;
-  size_t     i;
-  uint16_t   off[2];
-  FILE      *fp;
-  psp__s    *psp;
-  uint16_t  *patch;
-  size_t     offset;
-  struct stat st;
-  
-  assert(fname != NULL);
-  assert(regs  != NULL);
-  
-  memset(&mem[MEM_ENV],0,256);
-  psp = (psp__s *)&mem[MEM_PSP];
-  
-  memset(psp,0,256);
-  psp->warmboot[0]   = 0xCD;
-  psp->warmboot[1]   = 0x20;
-  psp->oldmscall_jmp = 0x9A;
-  psp->oldmscall_off = offsetof(psp__s,mscall);
-  psp->oldmscall_seg = SEG_PSP;
-  psp->termaddr[0]   = 129;
-  psp->termaddr[1]   = SEG_PSP;
-  psp->ctrlcaddr[0]  = 130;
-  psp->ctrlcaddr[1]  = SEG_PSP;
-  psp->erroraddr[0]  = 131;
-  psp->erroraddr[1]  = SEG_PSP;
-  psp->envp          = SEG_ENV;
-  psp->mscall[0]     = 0xCD;
-  psp->mscall[1]     = 0x21;
-  psp->mscall[2]     = 0xCB;
-  
-  /* Dummy interrupt handlers */
-  mem[MEM_PSP + 129] = 0xCF; /* IRET */
-  mem[MEM_PSP + 130] = 0xCF; /* IRET */
-  mem[MEM_PSP + 131] = 0xCF; /* IRET */
-  
-  fp = fopen(fname,"rb");
-  if (fp == NULL)
+  struct sockaddr_un addr;
+  struct sigaction   sa;
+  int                sock;
+  
+  fflush(NULL);	/* or every child writes out what's still buffered */
+  
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
   {
-    fprintf(stderr,"fopen(\"%s\") = %s\n",fname,strerror(errno));
-    return EXIT_FAILURE;
+    fprintf(stderr,"%s: socket name too long\n",path);
+    exit(4);
   }
+  strcpy(addr.sun_path,path);
+  unlink(path);
   
-  /* Get file size */
-  fstat(fileno(fp), &st);
+  sock = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+  if (
+          (sock == -1)
+       || (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) == -1)
+       || (listen(sock,SOMAXCONN) == -1)
+     )
+  {
+    perror(path);
+    exit(4);
+  }
   
-  /* Check if it's an EXE file */
-  fread(&hdr,sizeof(hdr),1,fp);
-  rewind(fp);
+  /* nobody waits for the children */
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sa.sa_flags   = SA_NOCLDWAIT;
+  sigaction(SIGCHLD,&sa,NULL);
   
-  if ((hdr.magic[0] == 0x4D) && (hdr.magic[1] == 0x5A))
+  while(true)
   {
-    /* EXE file */
-    fread(&hdr,sizeof(hdr),1,fp);
-    
-    offset = hdr.hdrpara * 16;
-    
-    if (hdr.lastpagesize == 0)
-      binsize = hdr.filepages * 512;
-    else
-      binsize = (hdr.filepages - 1) * 512 + hdr.lastpagesize;
-    
-    binsize -= offset;
-    
-    fseek(fp,offset,SEEK_SET);
-    fread(&mem[MEM_LOAD],1,binsize,fp);
-    
-    /* Process relocations */
-    for (i = 0 ; i < hdr.numreloc ; i++)
+    int   fds[3];
+    int   conn;
+    int   n;
+    pid_t pid;
+  
+    conn = accept4(sock,NULL,NULL,SOCK_CLOEXEC);
+    if (conn == -1)
     {
-      fseek(fp,hdr.reltable + i * 4,SEEK_SET);
-      fread(off,sizeof(uint16_t),2,fp);
-      patch = (uint16_t *)&mem[MEM_LOAD + off[0] + off[1] * 16];
-      *patch += SEG_LOAD;
+      if ((errno == EINTR) || (errno == ECONNABORTED))
+        continue;
+      perror("accept()");
+      exit(4);
     }
-    
-    /* Initialize registers for EXE */
-    memset(regs, 0, sizeof(x86_regs));
-    regs->cs = SEG_LOAD + hdr.init_cs;
-    regs->eip = hdr.init_ip;
-    regs->ss = SEG_LOAD + hdr.init_ss;
-    regs->esp = hdr.init_sp;
-    regs->ds = SEG_PSP;
-    regs->es = SEG_PSP;
-    regs->eax = 0;
-    regs->eflags = 0x0200; /* Interrupts enabled */
-  }
-  else
-  {
-    /* COM file - load at offset 0x100 in PSP segment */
-    binsize = st.st_size;
-    if (binsize > 65536 - 256)
+  
+    n = zygote_recv(conn,fds);
+    if (n < 2)
     {
-      fprintf(stderr,"%s: COM file too large\n",fname);
-      fclose(fp);
-      return EXIT_FAILURE;
+      close(conn);
+      continue;
     }
-    
-    /* Load COM file at PSP:0100h */
-    fread(&mem[MEM_PSP + 0x100], 1, binsize, fp);
-    
-    /* Initialize registers for COM */
-    memset(regs, 0, sizeof(x86_regs));
-    regs->cs = SEG_PSP;
-    regs->ds = SEG_PSP;
-    regs->es = SEG_PSP;
-    regs->ss = SEG_PSP;
-    regs->eip = 0x100;  /* COM files start at offset 0x100 */
-    regs->esp = 0xFFFE; /* Stack at top of segment */
-    regs->eax = 0;
-    regs->eflags = 0x0200; /* Interrupts enabled */
-  }
   
-  fclose(fp);
+    pid = fork();
+    if (pid == 0)
+    {
+      g_metrics_file[0] = '\0';	/* the zygote's, not ours to unlink */
+      close(sock);
+      close(conn);
+      for (int i = 0 ; i < n ; i++)
+      {
+        dup2(fds[i],i);
+        close(fds[i]);
+      }
   
-  /* Set up DTA (Disk Transfer Area) */
-  g_sys.dtaseg = SEG_PSP;
-  g_sys.dtaoff = 0x80;
+      fcntl(STDIN_FILENO,F_SETFL,fcntl(STDIN_FILENO,F_GETFL,0) | O_NONBLOCK);
+      if (vm_forked(con->vm) < 0)
+        exit(4);
+      return;
+    }
   
-  return EXIT_SUCCESS;
+    for (int i = 0 ; i < n ; i++)
+      close(fds[i]);
+    if (pid > 0)
+      write(conn,&pid,sizeof(pid));
+    else
+      perror("fork()");
+    close(conn);
+  }
 }
 
 /********************************************************************/
 
-static void handle_prompt_detection(system__s *sys, char c)
+/*---------------------------------------------------------------------
+; Server mode.  Like --zygote, we run up to the first time the guest asks
+; for input, but then save it to a memfd and host every connection to the
+; socket in this process, as a VM of its own restored from there---so the
+; guest pages nobody has written to are shared between all of them.
+;
+; Every socket sits in one epoll set.  A session whose guest is waiting
+; on input is parked there and costs nothing; once the socket has
+; something for it, it goes on the run queue for the worker threads, who
+; run it until it wants more input (or has had SLICES slices, when it
+; goes to the back of the queue).  EPOLLONESHOT makes sure a session is
+; only ever in one place at a time, so it needs no lock of its own.
+;---------------------------------------------------------------------*/
+
+#define SLICES		16		/* a session's turn on a worker */
+#define PEND_MAX	(1024 * 1024)	/* unsent output before we stop running it */
+
+typedef struct session
+{
+  struct session *next;
+  vm__s          *vm;
+  int             fd;
+  bool            added;	/* in the epoll set yet */
+  char           *pend;		/* output the socket wouldn't take */
+  size_t          pend_len;
+  size_t          pend_max;
+} session__s;
+
+typedef struct server
+{
+  const char      *snapshot;
+  unsigned         flags;
+  long             max;
+  int              epoll;
+  pthread_mutex_t  lock;
+  pthread_cond_t   ready;
+  session__s      *head;
+  session__s      *tail;
+} server__s;
+
+/********************************************************************/
+
+static void server_queue(server__s *srv,session__s *s)
+{
+  s->next = NULL;
+  pthread_mutex_lock(&srv->lock);
+  if (srv->tail != NULL)
+    srv->tail->next = s;
+  else
+    srv->head = s;
+  srv->tail = s;
+  pthread_cond_signal(&srv->ready);
+  pthread_mutex_unlock(&srv->lock);
+}
+
+static void server_park(server__s *srv,session__s *s,uint32_t events)
 {
-  /* Handle Racter prompt detection */
-  memmove(&sys->prompt[0], &sys->prompt[1], 3);
-  sys->prompt[3] = c;
+  struct epoll_event ev = { .events = events | EPOLLONESHOT , .data.ptr = s };
   
-  if (sys->prompt[1] == '\r' && sys->prompt[2] == '\n' && sys->prompt[3] == '>')
-  {
-    sys->input = true;
-    fflush(stdout);
-  }
-  else if (c == '\r')
-  {
-    sys->input = false;
-  }
+  if (s->pend_len > 0)
+    ev.events |= EPOLLOUT;
+  
+  epoll_ctl(srv->epoll,s->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,s->fd,&ev);
+  s->added = true;
 }
 
 /********************************************************************/
 
-static int read_buffered_input(system__s *sys)
+static void session_close(session__s *s)
 {
-  if (sys->input_pos < sys->input_len)
+  close(s->fd);	/* which takes it out of the epoll set too */
+  vm_destroy(s->vm);
+  free(s->pend);
+  free(s);
+}
+
+/*---------------------------------------------------------------------
+; Send what's pending and whatever the guest has written since.  What the
+; socket won't take now is kept for when it will.  Returns false once the
+; other end has gone away.
+;---------------------------------------------------------------------*/
+
+static bool session_send(session__s *s)
+{
+  const char *data;
+  size_t      size;
+  ssize_t     bytes;
+  
+  if (s->pend_len > 0)
+  {
+    bytes = send(s->fd,s->pend,s->pend_len,MSG_NOSIGNAL);
+    if (bytes < 0)
+    {
+      if (errno != EAGAIN)
+        return false;
+      bytes = 0;
+    }
+    memmove(s->pend,&s->pend[bytes],s->pend_len - bytes);
+    s->pend_len -= bytes;
+  }
+  
+  vm_drain(s->vm,&data,&size);
+  if (size == 0)
+    return true;
+  
+  bytes = 0;
+  if (s->pend_len == 0)
   {
-    return sys->input_buffer[sys->input_pos++];
+    bytes = send(s->fd,data,size,MSG_NOSIGNAL);
+    if (bytes < 0)
+    {
+      if (errno != EAGAIN)
+        return false;
+      bytes = 0;
+    }
   }
   
-  /* Check if input is available without blocking */
-  struct pollfd pfd = { .fd = 0, .events = POLLIN };
-  if (poll(&pfd, 1, 0) > 0)
+  if ((size_t)bytes < size)
   {
-    sys->input_len = read(0, sys->input_buffer, sizeof(sys->input_buffer) - 1);
-    if (sys->input_len > 0)
+    size -= bytes;
+    if (s->pend_len + size > s->pend_max)
     {
-      sys->input_pos = 0;
-      return sys->input_buffer[sys->input_pos++];
+      s->pend_max = (s->pend_len + size) * 2;
+      s->pend     = realloc(s->pend,s->pend_max);
+      if (s->pend == NULL)
+      {
+        perror("realloc()");
+        exit(3);
+      }
     }
+    memcpy(&s->pend[s->pend_len],&data[bytes],size);
+    s->pend_len += size;
   }
   
-  return -1;
+  return true;
 }
 
 /********************************************************************/
 
-static void dos_int21(system__s *sys)
+static void session_run(server__s *srv,session__s *s)
 {
-  unsigned char *mem = sys->mem;
-  uint8_t func = (sys->regs.eax >> 8) & 0xFF;
-  fcb__s *fcb;
-  size_t idx;
-  int handle;
+  char buffer[4096];
   
-  if (sys->debug)
-    fprintf(stderr, "DOS INT 21h AH=%02X\n", func);
+  /* don't let a guest bury a client that isn't reading */
+  if (s->pend_len > PEND_MAX)
+  {
+    if (!session_send(s))
+    {
+      session_close(s);
+      return;
+    }
+    if (s->pend_len > PEND_MAX)
+    {
+      server_park(srv,s,0);
+      return;
+    }
+  }
   
-  switch(func)
+  for (int slice = 0 ; slice < SLICES ; slice++)
   {
-    case 0x01: /* Read character with echo */
-      {
-        int c = read_buffered_input(sys);
-        if (c >= 0)
-        {
-          sys->regs.eax = (sys->regs.eax & 0xFF00) | (c & 0xFF);
-          if (c != '\n')
-            putchar(c);
-          fflush(stdout);
-        }
-        else
-        {
-          /* No input available, try to wait a bit for piped input */
-          usleep(1000); /* 1ms */
-          c = read_buffered_input(sys);
-          if (c >= 0)
-          {
-            sys->regs.eax = (sys->regs.eax & 0xFF00) | (c & 0xFF);
-            if (c != '\n')
-              putchar(c);
-            fflush(stdout);
-          }
-          else
-          {
-            /* Still no input, return without blocking */
-            sys->regs.eax = (sys->regs.eax & 0xFF00);
-          }
-        }
-      }
-      break;
-      
-    case 0x02: /* Write character */
-      {
-        char c = sys->regs.edx & 0xFF;
-        putchar(c);
-        handle_prompt_detection(sys, c);
-      }
-      break;
-      
-    case 0x06: /* Direct console I/O */
-      {
-        uint8_t dl = sys->regs.edx & 0xFF;
-        if (dl == 0xFF) /* Input */
-        {
-          int c = read_buffered_input(sys);
-          if (c >= 0)
-          {
-            sys->regs.eax = (sys->regs.eax & 0xFF00) | (c & 0xFF);
-            sys->regs.eflags &= ~0x40; /* Clear ZF */
-          }
-          else
-          {
-            sys->regs.eflags |= 0x40; /* Set ZF */
-          }
-        }
-        else /* Output */
-        {
-          putchar(dl);
-          handle_prompt_detection(sys, dl);
-        }
-      }
-      break;
-      
-    case 0x09: /* Write string */
-      {
-        size_t addr = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
-        while (mem[addr] != '$')
-        {
-          putchar(mem[addr]);
-          handle_prompt_detection(sys, mem[addr]);
-          addr++;
-        }
-      }
-      break;
-      
-    case 0x0C: /* Clear keyboard buffer and read */
-      {
-        uint8_t subfunc = sys->regs.eax & 0xFF;
-        
-        /* Clear input buffer */
-        sys->input_pos = 0;
-        sys->input_len = 0;
-        
-        /* Drain any pending input */
-        struct pollfd pfd = { .fd = 0, .events = POLLIN };
-        while (poll(&pfd, 1, 0) > 0)
-        {
-          char dummy[256];
-          if (read(0, dummy, sizeof(dummy)) <= 0)
-            break;
-        }
-        
-        /* Now handle the subfunction */
-        if (subfunc == 0x01 || subfunc == 0x06 || subfunc == 0x07 || 
-            subfunc == 0x08 || subfunc == 0x0A)
-        {
-          sys->regs.eax = (subfunc << 8) | subfunc;
-          dos_int21(sys);
-        }
-      }
-      break;
-      
-    /* FCB File operations */
-    case 0x0F: /* Open file using FCB */
-      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
-      fcb = (fcb__s *)&sys->mem[idx];
-      sys->regs.eax = (sys->regs.eax & 0xFF00) | open_file(sys, fcb, false);
-      break;
-      
-    case 0x10: /* Close file using FCB */
-      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
-      fcb = (fcb__s *)&sys->mem[idx];
-      handle = find_fcb(sys, fcb);
-      if (handle >= 0)
+    vm_reason__e why = vm_run(s->vm,SLICE);
+    ssize_t      bytes;
+  
+    if (why == VM_BUDGET)
+      continue;
+  
+    if (!session_send(s) || (why == VM_EXITED))
+    {
+      session_close(s);
+      return;
+    }
+  
+    if (why == VM_NEED_INPUT)
+    {
+      bytes = read(s->fd,buffer,sizeof(buffer));
+      if (bytes >= 0)
+        vm_feed(s->vm,buffer,bytes);
+      else if ((errno == EAGAIN) || (errno == EINTR))
       {
-        fclose(sys->fp[handle]);
-        sys->fp[handle] = NULL;
-        sys->fcbs[handle] = NULL;
-        sys->regs.eax = (sys->regs.eax & 0xFF00);
+        server_park(srv,s,EPOLLIN);
+        return;
       }
       else
-        sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
-      break;
-      
-    case 0x14: /* Sequential read using FCB */
-      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
-      fcb = (fcb__s *)&sys->mem[idx];
-      handle = find_fcb(sys, fcb);
-      if (handle >= 0)
       {
-        size_t dta = seg_off_to_linear(sys->dtaseg, sys->dtaoff);
-        size_t nread = fread(&sys->mem[dta], 1, fcb->recsize, sys->fp[handle]);
-        if (nread == fcb->recsize)
-        {
-          fcb->crecnum++;
-          sys->regs.eax = (sys->regs.eax & 0xFF00);
-        }
-        else
-          sys->regs.eax = (sys->regs.eax & 0xFF00) | 0x01;
+        session_close(s);
+        return;
       }
-      else
-        sys->regs.eax = (sys->regs.eax & 0xFF00) | 0xFF;
-      break;
-      
-    case 0x16: /* Create file using FCB */
-      idx = seg_off_to_linear(sys->regs.ds, sys->regs.edx & 0xFFFF);
-      fcb = (fcb__s *)&sys->mem[idx];
-      sys->regs.eax = (sys->regs.eax & 0xFF00) | open_file(sys, fcb, true);
-      break;
-      
-    case 0x19: /* Get current drive */
-      sys->regs.eax = (sys->regs.eax & 0xFF00) | 0x02; /* C: drive */
-      break;
-      
-    case 0x1A: /* Set DTA */
-      sys->dtaseg = sys->regs.ds;
-      sys->dtaoff = sys->regs.edx & 0xFFFF;
-      break;
-      
-    case 0x25: /* Set interrupt vector - ignored */
-      break;
-      
-    case 0x30: /* Get DOS version */
-      sys->regs.eax = 0x0005; /* DOS 5.0 */
-      sys->regs.ebx = 0x0000;
-      sys->regs.ecx = 0x0000;
-      break;
-      
-    case 0x35: /* Get interrupt vector */
-      /* Return dummy values */
-      sys->regs.es = 0x0000;
-      sys->regs.ebx = 0x0000;
-      break;
-      
-    case 0x4C: /* Exit program */
-      sys->running = false;
-      break;
-      
-    default:
-      if (sys->debug)
-        fprintf(stderr, "Unhandled DOS INT 21h function: %02X\n", func);
-      break;
+    }
+  }
+  
+  /* it's had its turn */
+  if (!session_send(s))
+  {
+    session_close(s);
+    return;
   }
+  server_queue(srv,s);
+}
+
+static void *server_worker(void *arg)
+{
+  server__s  *srv = arg;
+  session__s *s;
+  
+  while(true)
+  {
+    pthread_mutex_lock(&srv->lock);
+    while (srv->head == NULL)
+      pthread_cond_wait(&srv->ready,&srv->lock);
+    s         = srv->head;
+    srv->head = s->next;
+    if (srv->head == NULL)
+      srv->tail = NULL;
+    pthread_mutex_unlock(&srv->lock);
+  
+    session_run(srv,s);
+  }
+  
+  return NULL;
 }
 
 /********************************************************************/
 
-/* Enhanced x86 instruction decoder and executor */
-static bool execute_instruction(system__s *sys)
+static void server_accept(server__s *srv,int sock)
 {
-  unsigned char *mem = sys->mem;
-  size_t ip_addr = seg_off_to_linear(sys->regs.cs, sys->regs.eip & 0xFFFF);
-  uint8_t opcode = mem[ip_addr];
-  bool executed = true;
+  while(true)
+  {
+    session__s *s;
+    int         conn;
   
-  if (sys->debug)
-    fprintf(stderr, "Execute: %04X:%04X: %02X\n", sys->regs.cs, (uint16_t)sys->regs.eip, opcode);
+    conn = accept4(sock,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn == -1)
+    {
+      if ((errno == EAGAIN) || (errno == ECONNABORTED) || (errno == EINTR))
+        return;
+      perror("accept()");
+      return;	/* EMFILE and friends; try again on the next connection */
+    }
   
-  /* Enhanced instruction handling */
-  switch(opcode)
+    s = calloc(1,sizeof(session__s));
+    if (s == NULL)
+    {
+      perror("calloc()");
+      close(conn);
+      continue;
+    }
+  
+    s->fd = conn;
+    s->vm = vm_restore(srv->snapshot,srv->flags);
+    if (s->vm == NULL)
+    {
+      close(conn);
+      free(s);
+      continue;
+    }
+    if (srv->max >= 0)
+      vm_output_max(s->vm,srv->max);
+  
+    /* it has the startup output to send, if nothing else */
+    server_queue(srv,s);
+  }
+}
+
+static void server_run(console__s *con,const char *path,long threads,unsigned flags,long max)
+{
+  static server__s   srv;
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  char               snapshot[64];
+  pthread_t          tid;
+  int                sock;
+  int                mfd;
+  
+  /* the guest as it is now is what every session starts from */
+  mfd = memfd_create("msdos-snapshot",MFD_CLOEXEC);
+  if (mfd == -1)
   {
-    case 0x90: /* NOP */
-      sys->regs.eip++;
-      break;
-      
-    /* MOV immediate to register instructions */
-    case 0xB0: /* MOV AL, imm8 */
-      sys->regs.eax = (sys->regs.eax & 0xFFFFFF00) | mem[ip_addr + 1];
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB1: /* MOV CL, imm8 */
-      sys->regs.ecx = (sys->regs.ecx & 0xFFFFFF00) | mem[ip_addr + 1];
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB2: /* MOV DL, imm8 */
-      sys->regs.edx = (sys->regs.edx & 0xFFFFFF00) | mem[ip_addr + 1];
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB3: /* MOV BL, imm8 */
-      sys->regs.ebx = (sys->regs.ebx & 0xFFFFFF00) | mem[ip_addr + 1];
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB4: /* MOV AH, imm8 */
-      sys->regs.eax = (sys->regs.eax & 0xFFFF00FF) | ((uint32_t)mem[ip_addr + 1] << 8);
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB5: /* MOV CH, imm8 */
-      sys->regs.ecx = (sys->regs.ecx & 0xFFFF00FF) | ((uint32_t)mem[ip_addr + 1] << 8);
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB6: /* MOV DH, imm8 */
-      sys->regs.edx = (sys->regs.edx & 0xFFFF00FF) | ((uint32_t)mem[ip_addr + 1] << 8);
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB7: /* MOV BH, imm8 */
-      sys->regs.ebx = (sys->regs.ebx & 0xFFFF00FF) | ((uint32_t)mem[ip_addr + 1] << 8);
-      sys->regs.eip += 2;
-      break;
-      
-    case 0xB8: /* MOV EAX/AX, imm16/32 */
-      sys->regs.eax = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xB9: /* MOV ECX/CX, imm16/32 */
-      sys->regs.ecx = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xBA: /* MOV EDX/DX, imm16/32 */
-      sys->regs.edx = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xBB: /* MOV EBX/BX, imm16/32 */
-      sys->regs.ebx = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xBC: /* MOV ESP/SP, imm16/32 */
-      sys->regs.esp = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xBD: /* MOV EBP/BP, imm16/32 */
-      sys->regs.ebp = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xBE: /* MOV ESI/SI, imm16/32 */
-      sys->regs.esi = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    case 0xBF: /* MOV EDI/DI, imm16/32 */
-      sys->regs.edi = get_word(mem, ip_addr + 1);
-      sys->regs.eip += 3;
-      break;
-      
-    /* MOV register to register */
-    case 0x88: /* MOV r/m8, r8 */
-      {
-        uint8_t modrm = mem[ip_addr + 1];
-        uint8_t mod = (modrm >> 6) & 3;
-        uint8_t reg = (modrm >> 3) & 7;
-        uint8_t rm = modrm & 7;
-        
-        if (mod == 3) /* Register to register */
-        {
-          uint8_t src_val = 0;
-          switch(reg)
-          {
-            case 0: src_val = sys->regs.eax & 0xFF; break; /* AL */
-            case 1: src_val = sys->regs.ecx & 0xFF; break; /* CL */
-            case 2: src_val = sys->regs.edx & 0xFF; break; /* DL */
-            case 3: src_val = sys->regs.ebx & 0xFF; break; /* BL */
-            case 4: src_val = (sys->regs.eax >> 8) & 0xFF; break; /* AH */
-            case 5: src_val = (sys->regs.ecx >> 8) & 0xFF; break; /* CH */
-            case 6: src_val = (sys->regs.edx >> 8) & 0xFF; break; /* DH */
-            case 7: src_val = (sys->regs.ebx >> 8) & 0xFF; break; /* BH */
-          }
-          
-          switch(rm)
-          {
-            case 0: sys->regs.eax = (sys->regs.eax & 0xFFFFFF00) | src_val; break; /* AL */
-            case 1: sys->regs.ecx = (sys->regs.ecx & 0xFFFFFF00) | src_val; break; /* CL */
-            case 2: sys->regs.edx = (sys->regs.edx & 0xFFFFFF00) | src_val; break; /* DL */
-            case 3: sys->regs.ebx = (sys->regs.ebx & 0xFFFFFF00) | src_val; break; /* BL */
-            case 4: sys->regs.eax = (sys->regs.eax & 0xFFFF00FF) | ((uint32_t)src_val << 8); break; /* AH */
-            case 5: sys->regs.ecx = (sys->regs.ecx & 0xFFFF00FF) | ((uint32_t)src_val << 8); break; /* CH */
-            case 6: sys->regs.edx = (sys->regs.edx & 0xFFFF00FF) | ((uint32_t)src_val << 8); break; /* DH */
-            case 7: sys->regs.ebx = (sys->regs.ebx & 0xFFFF00FF) | ((uint32_t)src_val << 8); break; /* BH */
-          }
-        }
-        sys->regs.eip += 2;
-      }
-      break;
-      
-    /* Compare instructions */
-    case 0x3C: /* CMP AL, imm8 */
-      {
-        uint8_t al = sys->regs.eax & 0xFF;
-        uint8_t imm = mem[ip_addr + 1];
-        uint16_t result = al - imm;
-        
-        /* Set flags */
-        sys->regs.eflags &= ~(0x0001 | 0x0040 | 0x0080); /* Clear CF, ZF, SF */
-        if (result == 0) sys->regs.eflags |= 0x0040; /* ZF */
-        if (result & 0x8000) sys->regs.eflags |= 0x0080; /* SF */
-        if (al < imm) sys->regs.eflags |= 0x0001; /* CF */
-        
-        sys->regs.eip += 2;
-      }
-      break;
-      
-    /* Jump instructions */
-    case 0x75: /* JNZ/JNE rel8 */
-      {
-        int8_t rel = (int8_t)mem[ip_addr + 1];
-        sys->regs.eip += 2;
-        if (!(sys->regs.eflags & 0x0040)) /* ZF clear */
-        {
-          sys->regs.eip = (sys->regs.eip + rel) & 0xFFFF;
-        }
-      }
-      break;
-      
-    case 0x74: /* JZ/JE rel8 */
-      {
-        int8_t rel = (int8_t)mem[ip_addr + 1];
-        sys->regs.eip += 2;
-        if (sys->regs.eflags & 0x0040) /* ZF set */
-        {
-          sys->regs.eip = (sys->regs.eip + rel) & 0xFFFF;
-        }
-      }
-      break;
-      
-    case 0xEB: /* JMP rel8 */
-      {
-        int8_t rel = (int8_t)mem[ip_addr + 1];
-        sys->regs.eip = (sys->regs.eip + 2 + rel) & 0xFFFF;
-      }
-      break;
-      
-    /* Push/Pop instructions */
-    case 0x50: /* PUSH EAX/AX */
-      {
-        size_t sp_addr = seg_off_to_linear(sys->regs.ss, (sys->regs.esp - 2) & 0xFFFF);
-        set_word(mem, sp_addr, sys->regs.eax & 0xFFFF);
-        sys->regs.esp = (sys->regs.esp - 2) & 0xFFFF;
-        sys->regs.eip++;
-      }
-      break;
-      
-    case 0x58: /* POP EAX/AX */
-      {
-        size_t sp_addr = seg_off_to_linear(sys->regs.ss, sys->regs.esp & 0xFFFF);
-        sys->regs.eax = (sys->regs.eax & 0xFFFF0000) | get_word(mem, sp_addr);
-        sys->regs.esp = (sys->regs.esp + 2) & 0xFFFF;
-        sys->regs.eip++;
-      }
-      break;
-      
-    case 0xCD: /* INT instruction */
-      {
-        uint8_t int_num = mem[ip_addr + 1];
-        sys->regs.eip += 2;
-        
-        if (int_num == 0x21)
-        {
-          dos_int21(sys);
-        }
-        else if (int_num == 0x20)
-        {
-          /* Program termination */
-          sys->running = false;
-        }
-        else
-        {
-          if (sys->debug)
-            fprintf(stderr, "Unhandled interrupt: %02X\n", int_num);
-        }
-      }
-      break;
-      
-    case 0xCF: /* IRET */
-      {
-        size_t sp_addr = seg_off_to_linear(sys->regs.ss, sys->regs.esp & 0xFFFF);
-        sys->regs.eip = get_word(mem, sp_addr);
-        sys->regs.cs = get_word(mem, sp_addr + 2);
-        sys->regs.eflags = get_word(mem, sp_addr + 4);
-        sys->regs.esp += 6;
-      }
-      break;
-      
-    case 0xCB: /* RETF */
-      {
-        size_t sp_addr = seg_off_to_linear(sys->regs.ss, sys->regs.esp & 0xFFFF);
-        sys->regs.eip = get_word(mem, sp_addr);
-        sys->regs.cs = get_word(mem, sp_addr + 2);
-        sys->regs.esp += 4;
-      }
-      break;
-      
-    case 0xC3: /* RET */
-      {
-        size_t sp_addr = seg_off_to_linear(sys->regs.ss, sys->regs.esp & 0xFFFF);
-        sys->regs.eip = get_word(mem, sp_addr);
-        sys->regs.esp += 2;
-      }
-      break;
-      
-    default:
-      /* For unhandled opcodes, skip the instruction and hope for the best */
-      if (sys->debug)
-      {
-        fprintf(stderr, "Unhandled opcode at %04X:%04X: %02X\n", 
-                sys->regs.cs, (uint16_t)sys->regs.eip, opcode);
-      }
-      sys->regs.eip++;
-      executed = false;
-      break;
+    perror("memfd_create()");
+    exit(4);
   }
+  snprintf(snapshot,sizeof(snapshot),"/proc/self/fd/%d",mfd);
+  if (vm_save(con->vm,snapshot) != 0)
+    exit(4);
+  vm_destroy(con->vm);
+  con->vm = NULL;
+  
+  srv.snapshot = snapshot;
+  srv.flags    = flags;
+  srv.max      = max;
+  pthread_mutex_init(&srv.lock,NULL);
+  pthread_cond_init(&srv.ready,NULL);
   
-  return executed;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr,"%s: socket name too long\n",path);
+    exit(4);
+  }
+  strcpy(addr.sun_path,path);
+  unlink(path);
+  
+  sock      = socket(AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+  srv.epoll = epoll_create1(EPOLL_CLOEXEC);
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (
+          (sock == -1)
+       || (srv.epoll == -1)
+       || (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) == -1)
+       || (listen(sock,SOMAXCONN) == -1)
+       || (epoll_ctl(srv.epoll,EPOLL_CTL_ADD,sock,&ev) == -1)
+     )
+  {
+    perror(path);
+    exit(4);
+  }
+  
+  for (long i = 0 ; i < threads ; i++)
+  {
+    if (pthread_create(&tid,NULL,server_worker,&srv) != 0)
+    {
+      perror("pthread_create()");
+      exit(4);
+    }
+    pthread_detach(tid);
+  }
+  
+  while(true)
+  {
+    struct epoll_event events[64];
+    int                n;
+  
+    n = epoll_wait(srv.epoll,events,64,-1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait()");
+      exit(4);
+    }
+  
+    for (int i = 0 ; i < n ; i++)
+    {
+      if (events[i].data.ptr == NULL)
+        server_accept(&srv,sock);
+      else
+        server_queue(&srv,events[i].data.ptr);
+    }
+  }
 }
 
 /********************************************************************/
 
 int main(int argc, char *argv[])
 {
-  int cycles_without_io = 0;
+  const char *program  = NULL;
+  const char *restore  = NULL;
+  const char *snapshot = NULL;
+  const char *zygote   = NULL;
+  const char *serve    = NULL;
+  const char *trace    = NULL;
+  const char *profile  = NULL;
+  const char *record   = NULL;
+  const char *replay   = NULL;
+  FILE       *session  = NULL;
+  bool        diverged = false;
+  metrics__s *metrics  = NULL;
+  bool        metered  = false;
+  bool        timed    = false;
+  long        records  = TRACE_RECORDS;
+  long        threads  = sysconf(_SC_NPROCESSORS_ONLN);
+  bool        stats    = false;
+  bool        startup  = true;
+  bool        forked   = false;
+  unsigned    flags    = 0;
+  long        max      = -1;
+  console__s  con;
+  struct timespec began;
   
-  if (argc < 2)
+  for (int i = 1 ; i < argc ; i++)
   {
-    fprintf(stderr, "usage: %s file [-d]\n", argv[0]);
-    exit(2);
+    if ((strcmp(argv[i], "--snapshot") == 0) && (i + 1 < argc))
+      snapshot = argv[++i];
+    else if ((strcmp(argv[i], "--zygote") == 0) && (i + 1 < argc))
+      zygote = argv[++i];
+    else if ((strcmp(argv[i], "--serve") == 0) && (i + 1 < argc))
+      serve = argv[++i];
+    else if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+      threads = strtol(argv[++i], NULL, 10);
+    else if ((strcmp(argv[i], "--restore") == 0) && (i + 1 < argc))
+      restore = argv[++i];
+    else if ((strcmp(argv[i], "--cache") == 0) && (i + 1 < argc))
+      vm_image_cache(argv[++i]);
+    else if ((strcmp(argv[i], "--base") == 0) && (i + 1 < argc))
+    {
+      if (vm_base(argv[++i]) != 0)
+        exit(2);
+    }
+    else if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc))
+      trace = argv[++i];
+    else if ((strcmp(argv[i], "--trace-size") == 0) && (i + 1 < argc))
+      records = strtol(argv[++i], NULL, 10);
+    else if ((strcmp(argv[i], "--profile") == 0) && (i + 1 < argc))
+      profile = argv[++i];
+    else if (strcmp(argv[i], "--metrics") == 0)
+      metered = true;
+    else if (strcmp(argv[i], "--latency") == 0)
+      timed = true;
+    else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc))
+      record = argv[++i];
+    else if ((strcmp(argv[i], "--replay") == 0) && (i + 1 < argc))
+      replay = argv[++i];
+    else if (strcmp(argv[i], "-d") == 0)
+      flags |= VM_DEBUG;
+    else if (strcmp(argv[i], "-s") == 0)
+      stats = true;
+    else if (strcmp(argv[i], "-j") == 0)
+      flags |= VM_JIT;
+    else if (strcmp(argv[i], "-J") == 0)
+      flags |= VM_JIT | VM_LOCKSTEP;
+    else if (strcmp(argv[i], "--realtime") == 0)
+      flags |= VM_REALTIME;
+    else if (strcmp(argv[i], "-A") == 0)
+      flags |= VM_A20;
+    else if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc))
+    {
+      max = strtol(argv[++i], NULL, 10);
+      if (max < 0)
+        max = 0;
+    }
+    else if (program == NULL)
+      program = argv[i];
   }
   
-  if (argc > 2 && strcmp(argv[2], "-d") == 0)
-    g_sys.debug = true;
+  /*---------------------------------------------------------------------
+  ; The sessions --serve runs aren't traced, only the one it starts from.
+  ; A recording is one session from the start, so it's not for any of
+  ; the ways of starting more than one.
+  ;---------------------------------------------------------------------*/
   
-  /* Set up non-blocking I/O */
-  int flags = fcntl(0, F_GETFL, 0);
-  fcntl(0, F_SETFL, flags | O_NONBLOCK);
+  if (
+          ((program == NULL) == (restore == NULL))
+       || (((trace != NULL) || (profile != NULL) || metered || timed) && (serve != NULL))
+       || (((record != NULL) || (replay != NULL)) && ((snapshot != NULL) || (zygote != NULL) || (serve != NULL)))
+       || ((record != NULL) && (replay != NULL))
+     )
+  {
+    fprintf(stderr, "usage: %s file [--cache dir] [--base dir] [--snapshot file | --zygote socket | --serve socket [--threads n]] [-d] [-s] [-j|-J] [-A] [--realtime] [-o bytes] [--trace file [--trace-size n]] [--profile file] [--metrics] [--latency] [--record file | --replay file]\n", argv[0]);
+    fprintf(stderr, "       %s --restore file [--base dir] [--zygote socket | --serve socket [--threads n]] [-d] [-s] [-j|-J] [-A] [--realtime] [-o bytes] [--trace file [--trace-size n]] [--profile file] [--metrics] [--latency] [--record file | --replay file]\n", argv[0]);
+    fprintf(stderr, "       (--trace, --profile, --metrics and --latency don't go with --serve,\n");
+    fprintf(stderr, "       nor --record and --replay with --snapshot, --zygote or --serve)\n");
+    exit(2);
+  }
   
-  setvbuf(stdin, NULL, _IONBF, 0);  
-  setvbuf(stdout, NULL, _IONBF, 0);
-  atexit(cleanup);
+  /* Set up non-blocking I/O */
+  int fl = fcntl(0, F_GETFL, 0);
+  fcntl(0, F_SETFL, fl | O_NONBLOCK);
   
-  g_sys.mem = malloc(1024 * 1024);
-  if (g_sys.mem == NULL)
+  memset(&con, 0, sizeof(con));
+  con.vm = (restore != NULL) ? vm_restore(restore, flags) : vm_create(program, flags);
+  if (con.vm == NULL)
+    exit(4);
+  if (max >= 0)
+    vm_output_max(con.vm, max);
+  if (trace != NULL)
+    trace_start(con.vm, trace, records);
+  if ((profile != NULL) && (vm_profile(con.vm, PROF_PERIOD) != 0))
+    exit(4);
+  if (metered)
   {
-    perror("malloc()");
-    exit(3);
+    metrics = metrics_open(NULL);
+    atexit(metrics_close);
+    vm_metrics(con.vm, metrics);
+  }
+  if (timed)
+  {
+    struct sigaction sa;
+    
+    g_latency = calloc(1, sizeof(latency__s));
+    if (g_latency == NULL)
+    {
+      perror("calloc()");
+      exit(4);
+    }
+    vm_latency(con.vm, g_latency);
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = latency_signal;
+    sigaction(SIGUSR1, &sa, NULL);
   }
   
-  memset(g_sys.mem, 0xCC, 1024 * 1024);
-  g_sys.running = true;
-  g_sys.input = false;
-  g_sys.input_len = 0;
-  g_sys.input_pos = 0;
-  
-  if (load_program(argv[1], g_sys.mem, &g_sys.regs) != EXIT_SUCCESS)
+  if ((record != NULL) || (replay != NULL))
   {
-    exit(4);
+    session = fopen((record != NULL) ? record : replay, (record != NULL) ? "wb" : "rb");
+    if (session == NULL)
+    {
+      perror((record != NULL) ? record : replay);
+      exit(4);
+    }
+    if (((record != NULL) ? vm_record(con.vm, session) : vm_replay(con.vm, session)) != 0)
+      exit(4);
+    con.replay = (replay != NULL);
   }
   
-  if (!g_sys.debug)
+  if ((flags & VM_DEBUG) == 0)
   {
     fprintf(stderr, "Note: This is a minimal DOS emulator for Racter.\n");
     fprintf(stderr, "It implements just enough to handle basic I/O.\n\n");
   }
   
   /* Main execution loop */
-  while (g_sys.running)
+  clock_gettime(CLOCK_MONOTONIC, &con.last);
+  began = con.last;
+  
+  while(true)
   {
-    bool executed = execute_instruction(&g_sys);
-    
-    /* If we didn't execute a real instruction, we might be stuck */
-    if (!executed)
+    vm_reason__e why = vm_run(con.vm, SLICE);
+  
+    latency_report();
+    if (why == VM_BUDGET)
     {
-      cycles_without_io++;
-      if (cycles_without_io > 10000)
+      if (console_due(&con))
+        console_write(&con);
+      continue;
+    }
+  
+    console_write(&con);
+  
+    if (why == VM_EXITED)
+      break;
+  
+    if (why == VM_NEED_INPUT)
+    {
+      /* the first time the guest asks for input, it's done starting up */
+      if (startup && (snapshot != NULL))
+        exit(vm_save(con.vm, snapshot) == 0 ? EXIT_SUCCESS : 4);
+      else if (startup && (zygote != NULL))
       {
-        /* We're probably stuck in a loop, try to find the next INT 21h */
-        size_t addr = seg_off_to_linear(g_sys.regs.cs, g_sys.regs.eip & 0xFFFF);
-        bool found = false;
-        
-        for (int i = 0; i < 100 && !found; i++)
+        zygote_serve(&con, zygote);
+        trace_forked();
+        forked = true;
+        if (metrics != NULL)
         {
-          if (g_sys.mem[addr + i] == 0xCD && g_sys.mem[addr + i + 1] == 0x21)
-          {
-            g_sys.regs.eip += i;
-            found = true;
-            cycles_without_io = 0;
-          }
+          metrics = metrics_open(metrics);
+          vm_metrics(con.vm, metrics);
         }
+      }
+      else if (startup && (serve != NULL))
+        server_run(&con, serve, (threads < 1) ? 1 : threads, flags, max);
+      else if (con.replay)
+      {
+        int rc = vm_replay_feed(con.vm);
         
-        if (!found)
+        if (rc < 0)
+          vm_feed(con.vm, NULL, 0);
+        else if ((rc > 0) && !diverged)
         {
-          fprintf(stderr, "Program appears stuck, terminating\n");
-          break;
+          fprintf(stderr, "replay: the guest went its own way before input %llu\n", con.inputs + 1);
+          diverged = true;
         }
+        con.inputs++;
       }
+      else
+        console_read(&con);
+      startup = false;
     }
-    else
-    {
-      cycles_without_io = 0;
-    }
+  }
+  
+  if (stats)
+  {
+    vm_stats(con.vm, stderr);
+    fprintf(
+      stderr,
+      "console:       %llu writes, %llu reads, %llu polls\n",
+      con.writes,
+      con.reads,
+      con.polls
+    );
+  }
+  
+  if (g_latency != NULL)
+    latency_write(g_latency, stderr);
+  
+  if (con.replay)
+  {
+    struct timespec now;
+    double          secs;
     
-    /* Give other processes a chance to run */
-    if (cycles_without_io > 100)
-    {
-      usleep(1000); /* 1ms sleep */
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - began.tv_sec) + (now.tv_nsec - began.tv_nsec) / 1e9;
+    fprintf(
+      stderr,
+      "replay:        %llu inputs, %llu turns, %llu words in %.3f s; %.1f turns/s, %.0f words/s%s\n",
+      con.inputs,
+      con.turns,
+      con.words,
+      secs,
+      (secs > 0) ? con.turns / secs : 0.0,
+      (secs > 0) ? con.words / secs : 0.0,
+      diverged ? " (diverged)" : ""
+    );
   }
+  if (session != NULL)
+    fclose(session);
+  
+  if (profile != NULL)
+    profile_write(con.vm, profile, forked);
   
+  trace_dump();
+  g_trace_vm = NULL;
+  vm_destroy(con.vm);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,229 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; Show every msdos and msdos_fixes running with --metrics on this host
+; (see metrics.h): a line for each, the totals, and the INT 21h calls
+; they've made between them, busiest first.
+;
+;	msdos-top [-d seconds]
+;
+; Once, or every so many seconds with -d.  A file left behind by a
+; process that's gone (one that was killed, say) is skipped.
+;---------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define TOP_CALLS	10	/* INT 21h functions listed */
+
+/********************************************************************/
+
+/* a counter at a time, so none of them is torn */
+static bool metrics_read(const char *name,metrics__s *m)
+{
+  const uint64_t *src;
+  uint64_t       *dst = (uint64_t *)m;
+  struct stat     st;
+  void           *map;
+  int             fd;
+  
+  memset(m,0,sizeof(*m));
+  fd = open(name,O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  if ((fstat(fd,&st) == -1) || ((size_t)st.st_size < sizeof(metrics__s)))
+  {
+    close(fd);
+    return false;
+  }
+  map = mmap(NULL,sizeof(metrics__s),PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  
+  src = map;
+  for (size_t i = 0 ; i < sizeof(metrics__s) / sizeof(uint64_t) ; i++)
+    dst[i] = __atomic_load_n(&src[i],__ATOMIC_RELAXED);
+  munmap(map,sizeof(metrics__s));
+  
+  return (memcmp(m->magic,METRICS_MAGIC,sizeof(m->magic)) == 0)
+      && (m->version == METRICS_VERSION)
+      && ((kill(m->pid,0) == 0) || (errno == EPERM));
+}
+
+/********************************************************************/
+
+static void show(const metrics__s *m,uint64_t now,const char *who)
+{
+  double   up      = (now > m->started) ? (now - m->started) / 1e9 : 0.0;
+  uint64_t blocked = m->blocked_ns;
+  uint64_t calls   = 0;
+  
+  if ((m->waiting != 0) && (now > m->waiting))
+    blocked += now - m->waiting;
+  
+  for (int i = 0 ; i < 256 ; i++)
+    calls += m->int21[i];
+  
+  printf(
+    "%8s %-5s %9.1f %12llu %9llu %9llu %9llu %9llu %7llu %7.1f%% %s\n",
+    who,
+    (m->backend == METRICS_VM86) ? "vm86" : (m->backend == METRICS_SOFT) ? "soft" : "-",
+    up,
+    (unsigned long long)m->insns,
+    (unsigned long long)m->entries,
+    (unsigned long long)calls,
+    (unsigned long long)m->bytes_in,
+    (unsigned long long)m->bytes_out,
+    (unsigned long long)m->turns,
+    (up > 0) ? 100.0 * blocked / 1e9 / up : 0.0,
+    (m->backend == 0) ? "" : m->prompt ? "prompt" : (m->waiting != 0) ? "waiting" : "running"
+  );
+}
+
+static void top(void)
+{
+  metrics__s      total;
+  struct timespec ts;
+  struct dirent  *de;
+  DIR            *dir;
+  uint64_t        now;
+  uint64_t        up       = 0;
+  unsigned        sessions = 0;
+  int             order[256];
+  
+  clock_gettime(CLOCK_REALTIME,&ts);
+  now = ts.tv_sec * 1000000000uLL + ts.tv_nsec;
+  memset(&total,0,sizeof(total));
+  
+  printf(
+    "%8s %-5s %9s %12s %9s %9s %9s %9s %7s %8s %s\n",
+    "PID","CPU","UP s","INSNS","VM86","INT 21h","IN","OUT","TURNS","BLOCKED","STATE"
+  );
+  
+  dir = opendir(METRICS_DIR);
+  while ((dir != NULL) && ((de = readdir(dir)) != NULL))
+  {
+    char       name[FILENAME_MAX];
+    char       pid[16];
+    metrics__s m;
+  
+    if (strncmp(de->d_name,METRICS_PREFIX,strlen(METRICS_PREFIX)) != 0)
+      continue;
+    snprintf(name,sizeof(name),"%s/%s",METRICS_DIR,de->d_name);
+    if (!metrics_read(name,&m))
+      continue;
+  
+    snprintf(pid,sizeof(pid),"%lld",(long long)m.pid);
+    show(&m,now,pid);
+    sessions++;
+  
+    up               += (now > m.started) ? now - m.started : 0;
+    total.blocked_ns += m.blocked_ns;
+    if ((m.waiting != 0) && (now > m.waiting))
+      total.blocked_ns += now - m.waiting;
+    total.insns      += m.insns;
+    total.entries    += m.entries;
+    total.bytes_in   += m.bytes_in;
+    total.bytes_out  += m.bytes_out;
+    total.turns      += m.turns;
+    total.prompt     += m.prompt;
+    for (int i = 0 ; i < 256 ; i++)
+      total.int21[i] += m.int21[i];
+  }
+  if (dir != NULL)
+    closedir(dir);
+  
+  printf("%u running, %llu at the prompt\n",sessions,(unsigned long long)total.prompt);
+  if (sessions == 0)
+    return;
+  
+  /* all their time put together, so BLOCKED is a share of that */
+  total.started = now - up;
+  show(&total,now,"total");
+  
+  /* the busiest INT 21h functions */
+  for (int i = 0 ; i < 256 ; i++)
+    order[i] = i;
+  for (int i = 0 ; (i < TOP_CALLS) && (i < 256) ; i++)
+  {
+    for (int j = i + 1 ; j < 256 ; j++)
+    {
+      if (total.int21[order[j]] > total.int21[order[i]])
+      {
+        int t    = order[i];
+        order[i] = order[j];
+        order[j] = t;
+      }
+    }
+    if (total.int21[order[i]] == 0)
+      break;
+    printf("%sAH=%02Xh %llu",(i == 0) ? "\nINT 21h: " : "  ",order[i],(unsigned long long)total.int21[order[i]]);
+  }
+  putchar('\n');
+}
+
+/********************************************************************/
+
+int main(int argc,char *argv[])
+{
+  long delay = 0;
+  
+  for (int i = 1 ; i < argc ; i++)
+  {
+    if ((strcmp(argv[i],"-d") == 0) && (i + 1 < argc))
+      delay = strtol(argv[++i],NULL,10);
+    else
+    {
+      fprintf(stderr,"usage: %s [-d seconds]\n",argv[0]);
+      return 2;
+    }
+  }
+  
+  while(true)
+  {
+    if (delay > 0)
+      printf("\033[H\033[J");
+    top();
+    fflush(stdout);
+    if (delay <= 0)
+      return 0;
+    sleep(delay);
+  }
+}
@@ -0,0 +1,318 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; Decode a file written by msdos or msdos_fixes --trace.  Prints the
+; calls in order, and then for each function a histogram of how long the
+; host took over it, in powers of two microseconds.
+;
+;	msdos_trace [-t | -h] file
+;
+; -t is the timeline only, -h the histograms only.  In the timeline, gap
+; is the time since the call before it returned---the guest running, or
+; (after a call marked "wait") us waiting for input.  msdos waits inside
+; the call, so there the wait is in the call's own time.
+;---------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+#define BUCKETS		24	/* 1us ... 8s and up */
+#define BAR		40	/* width of the longest bar */
+
+typedef struct func
+{
+  unsigned long long calls;
+  unsigned long long waits;
+  unsigned long long bytes;
+  unsigned long long total;
+  uint32_t           max;
+  unsigned long long bucket[BUCKETS];
+} func__s;
+
+/********************************************************************/
+
+static const char *func_name(uint8_t ah)
+{
+  switch(ah)
+  {
+    case 0x01: return "read char";
+    case 0x02: return "write char";
+    case 0x06: return "console I/O";
+    case 0x07: return "raw input";
+    case 0x08: return "input";
+    case 0x09: return "write string";
+    case 0x0A: return "buffered input";
+    case 0x0B: return "input status";
+    case 0x0C: return "flush and read";
+    case 0x0F: return "FCB open";
+    case 0x10: return "FCB close";
+    case 0x14: return "FCB read";
+    case 0x15: return "FCB write";
+    case 0x16: return "FCB create";
+    case 0x19: return "get drive";
+    case 0x1A: return "set DTA";
+    case 0x21: return "FCB random read";
+    case 0x22: return "FCB random write";
+    case 0x25: return "set vector";
+    case 0x2A: return "get date";
+    case 0x2C: return "get time";
+    case 0x30: return "DOS version";
+    case 0x35: return "get vector";
+    case 0x3C: return "create";
+    case 0x3D: return "open";
+    case 0x3E: return "close";
+    case 0x3F: return "read";
+    case 0x40: return "write";
+    case 0x41: return "delete";
+    case 0x42: return "seek";
+    case 0x44: return "IOCTL";
+    case 0x45: return "dup";
+    case 0x46: return "dup2";
+    case 0x48: return "allocate";
+    case 0x49: return "free";
+    case 0x4A: return "resize";
+    case 0x4C: return "exit";
+    default:   return "?";
+  }
+}
+
+/********************************************************************/
+
+static int bucket(uint32_t ns)
+{
+  int b = 0;
+  
+  for (uint32_t us = ns / 1000 ; (us > 0) && (b < BUCKETS - 1) ; us /= 2)
+    b++;
+  return b;
+}
+
+static void bucket_label(char *buf,size_t size,int b)
+{
+  static const char *unit[] = { "us" , "ms" , "s" };
+  unsigned long      lo     = (b == 0) ? 0 : 1uL << (b - 1);
+  int                u      = 0;
+  
+  while ((lo >= 1000) && (u < 2))
+  {
+    lo /= 1000;
+    u++;
+  }
+  
+  if (b == 0)
+    snprintf(buf,size,"<1us");
+  else
+    snprintf(buf,size,"%lu%s",lo,unit[u]);
+}
+
+/********************************************************************/
+
+static void timeline(const vm_trace__s *rec,uint64_t count)
+{
+  uint64_t prev = 0;
+  
+  printf("%12s %12s %10s  AH %-16s %4s %4s %4s %4s %4s  %4s %6s %10s\n",
+         "ms","gap us","insns","function","AX","BX","CX","DX","DS","->AX","bytes","us");
+  
+  for (uint64_t i = 0 ; i < count ; i++)
+  {
+    const vm_trace__s *t = &rec[i];
+  
+    printf(
+      "%12.3f %12.1f %10llu  %02X %-16s %04X %04X %04X %04X %04X  %04X %6u %10.1f%s%s\n",
+      t->when / 1e6,
+      (i == 0) ? 0.0 : (t->when > prev ? t->when - prev : 0) / 1e3,
+      (unsigned long long)t->icount,
+      t->ax >> 8,
+      func_name(t->ax >> 8),
+      t->ax,
+      t->bx,
+      t->cx,
+      t->dx,
+      t->ds,
+      t->ret,
+      t->bytes,
+      t->latency / 1e3,
+      (t->flags & TRACE_CF)   ? " CF"   : "",
+      (t->flags & TRACE_WAIT) ? " wait" : ""
+    );
+    prev = t->when + t->latency;
+  }
+}
+
+/********************************************************************/
+
+static void histograms(const vm_trace__s *rec,uint64_t count)
+{
+  static func__s func[256];
+  
+  for (uint64_t i = 0 ; i < count ; i++)
+  {
+    func__s *f = &func[rec[i].ax >> 8];
+  
+    f->calls++;
+    f->bytes += rec[i].bytes;
+    f->total += rec[i].latency;
+    if (rec[i].latency > f->max)
+      f->max = rec[i].latency;
+    if (rec[i].flags & TRACE_WAIT)
+      f->waits++;
+    f->bucket[bucket(rec[i].latency)]++;
+  }
+  
+  for (int ah = 0 ; ah < 256 ; ah++)
+  {
+    func__s            *f    = &func[ah];
+    unsigned long long  most = 0;
+    int                 lo   = BUCKETS;
+    int                 hi   = 0;
+  
+    if (f->calls == 0)
+      continue;
+  
+    printf(
+      "%02X %s: %llu calls (%llu waited), %llu bytes, mean %.1f us, max %.1f us\n",
+      ah,
+      func_name(ah),
+      f->calls,
+      f->waits,
+      f->bytes,
+      f->total / 1e3 / f->calls,
+      f->max / 1e3
+    );
+  
+    for (int b = 0 ; b < BUCKETS ; b++)
+    {
+      if (f->bucket[b] == 0)
+        continue;
+      if (b < lo)
+        lo = b;
+      hi = b;
+      if (f->bucket[b] > most)
+        most = f->bucket[b];
+    }
+  
+    for (int b = lo ; b <= hi ; b++)
+    {
+      char label[16];
+      int  len = (f->bucket[b] * BAR + most - 1) / most;
+  
+      bucket_label(label,sizeof(label),b);
+      printf("  %6s |%-*.*s %llu\n",label,BAR,len,"########################################",f->bucket[b]);
+    }
+    putchar('\n');
+  }
+}
+
+/********************************************************************/
+
+int main(int argc,char *argv[])
+{
+  vm_trace_hdr__s  hdr;
+  vm_trace__s     *rec;
+  const char      *fname = NULL;
+  bool             lines = true;
+  bool             hists = true;
+  FILE            *fp;
+  
+  for (int i = 1 ; i < argc ; i++)
+  {
+    if (strcmp(argv[i],"-t") == 0)
+      hists = false;
+    else if (strcmp(argv[i],"-h") == 0)
+      lines = false;
+    else if (fname == NULL)
+      fname = argv[i];
+  }
+  
+  if (fname == NULL)
+  {
+    fprintf(stderr,"usage: %s [-t | -h] file\n",argv[0]);
+    return 2;
+  }
+  
+  fp = fopen(fname,"rb");
+  if (fp == NULL)
+  {
+    perror(fname);
+    return 1;
+  }
+  
+  if (
+          (fread(&hdr,sizeof(hdr),1,fp) != 1)
+       || (memcmp(hdr.magic,TRACE_MAGIC,sizeof(hdr.magic)) != 0)
+       || (hdr.version != TRACE_VERSION)
+       || (hdr.size != sizeof(vm_trace__s))
+     )
+  {
+    fprintf(stderr,"%s: not a trace this understands\n",fname);
+    return 1;
+  }
+  
+  rec = calloc(hdr.count ? hdr.count : 1,sizeof(vm_trace__s));
+  if (rec == NULL)
+  {
+    perror("calloc()");
+    return 1;
+  }
+  
+  hdr.count = fread(rec,sizeof(vm_trace__s),hdr.count,fp);
+  fclose(fp);
+  
+  /* from clock ticks to ns */
+  if ((hdr.ticks > 0) && (hdr.ns > 0))
+  {
+    double scale = (double)hdr.ns / hdr.ticks;
+    
+    for (uint64_t i = 0 ; i < hdr.count ; i++)
+    {
+      double latency = rec[i].latency * scale;
+      
+      rec[i].when    = rec[i].when * scale;
+      rec[i].latency = (latency > UINT32_MAX) ? UINT32_MAX : latency;
+    }
+  }
+  
+  printf(
+    "%llu calls, the last %llu of them here\n\n",
+    (unsigned long long)hdr.total,
+    (unsigned long long)hdr.count
+  );
+  
+  if (lines)
+  {
+    timeline(rec,hdr.count);
+    putchar('\n');
+  }
+  if (hists)
+    histograms(rec,hdr.count);
+  
+  free(rec);
+  return 0;
+}
@@ -0,0 +1,194 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; The --base overlay, for msdos and msdos_fixes alike.  The guest's files
+; come from a shared directory that's never written to.  A file the guest
+; creates, writes or deletes gets a copy in memory instead, private to
+; the process (or the VM), and a deleted one is a copy marked deleted;
+; later opens find that first.  vfile_flush() writes them all out to a
+; directory, for --write-behind.
+;---------------------------------------------------------------------*/
+
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct vfile
+{
+  struct vfile  *next;
+  char           name[FILENAME_MAX];
+  unsigned char *data;
+  size_t         size;
+  size_t         max;
+  bool           deleted;
+} vfile__s;
+
+/********************************************************************/
+
+static inline vfile__s *vfile_find(vfile__s *list,const char *name)
+{
+  for (vfile__s *vf = list ; vf != NULL ; vf = vf->next)
+    if (strcmp(vf->name,name) == 0)
+      return vf;
+  return NULL;
+}
+
+/* the file as an empty copy, whatever it was before; NULL if no memory */
+static inline vfile__s *vfile_new(vfile__s **list,const char *name)
+{
+  vfile__s *vf = vfile_find(*list,name);
+  
+  if (vf == NULL)
+  {
+    vf = calloc(1,sizeof(vfile__s));
+    if (vf == NULL)
+    {
+      perror("calloc()");
+      return NULL;
+    }
+    snprintf(vf->name,sizeof(vf->name),"%s",name);
+    vf->next = *list;
+    *list    = vf;
+  }
+  
+  vf->size    = 0;
+  vf->deleted = false;
+  return vf;
+}
+
+static inline void vfile_free(vfile__s **list)
+{
+  while (*list != NULL)
+  {
+    vfile__s *vf = *list;
+    
+    *list = vf->next;
+    free(vf->data);
+    free(vf);
+  }
+}
+
+/* false if there's no memory for it */
+static inline bool vfile_write(vfile__s *vf,const unsigned char *buf,size_t pos,size_t len)
+{
+  if (pos + len > vf->max)
+  {
+    size_t         max  = (pos + len) * 2;
+    unsigned char *data = realloc(vf->data,max);
+    
+    if (data == NULL)
+    {
+      perror("realloc()");
+      return false;
+    }
+    vf->data = data;
+    vf->max  = max;
+  }
+  
+  /* writing past the end leaves a hole of zeros, as it would on disk */
+  if (pos > vf->size)
+    memset(&vf->data[vf->size],0,pos - vf->size);
+  
+  memcpy(&vf->data[pos],buf,len);
+  if (pos + len > vf->size)
+    vf->size = pos + len;
+  return true;
+}
+
+/* how much of it there was */
+static inline size_t vfile_read(const vfile__s *vf,unsigned char *buf,size_t pos,size_t len)
+{
+  if (pos >= vf->size)
+    return 0;
+  if (len > vf->size - pos)
+    len = vf->size - pos;
+  memcpy(buf,&vf->data[pos],len);
+  return len;
+}
+
+/*---------------------------------------------------------------------
+; The guest is about to write to a file it opened from the base
+; directory, so its copy starts out as what's in there.
+;---------------------------------------------------------------------*/
+
+static inline bool vfile_fill(vfile__s *vf,int fd)
+{
+  unsigned char buf[4096];
+  size_t        pos = 0;
+  ssize_t       bytes;
+  
+  while ((bytes = pread(fd,buf,sizeof(buf),pos)) > 0)
+  {
+    if (!vfile_write(vf,buf,pos,bytes))
+      return false;
+    pos += bytes;
+  }
+  
+  return bytes == 0;
+}
+
+/*---------------------------------------------------------------------
+; Write-behind.  Each file goes to a temporary name and is renamed over
+; the old one, so a reader never sees half a file.
+;---------------------------------------------------------------------*/
+
+static inline void vfile_flush(const vfile__s *list,int dir)
+{
+  char tmp[FILENAME_MAX + 16];
+  
+  for (const vfile__s *vf = list ; vf != NULL ; vf = vf->next)
+  {
+    if (vf->deleted)
+    {
+      if ((unlinkat(dir,vf->name,0) == -1) && (errno != ENOENT))
+        perror(vf->name);
+      continue;
+    }
+    
+    snprintf(tmp,sizeof(tmp),"%s.%ld",vf->name,(long)getpid());
+    
+    int fd = openat(dir,tmp,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0666);
+    if (
+            (fd == -1)
+         || (write(fd,vf->data,vf->size) != (ssize_t)vf->size)
+         || (close(fd) == -1)
+         || (renameat(dir,tmp,dir,vf->name) == -1)
+       )
+    {
+      perror(vf->name);
+      if (fd != -1)
+        unlinkat(dir,tmp,0);
+    }
+  }
+}
+
+#endif
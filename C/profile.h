@@ -0,0 +1,346 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; The --profile table, for msdos and msdos_fixes alike.  Each takes its
+; samples when it likes (msdos on ITIMER_PROF, msdos_fixes every so many
+; instructions) and hands over the guest's CS:IP and SS:SP, along with a
+; way to read its memory.  There are no frame pointers to follow, so a
+; word on the stack is taken for a near return address if the
+; instruction before it is a near CALL, and a pair of words for a far one
+; if it's a far CALL or an INT (which is how the guest gets to msdos's
+; stub, or to a handler of its own).  Data can look like that too, but
+; it's only a sample.  The stacks go into a hash table that's kept no
+; more than half full.
+;---------------------------------------------------------------------*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROF_DEPTH	8	/* frames in a stack, the sampled CS:IP included */
+#define PROF_SCAN	64	/* words of the guest's stack looked at */
+
+typedef uint8_t prof_rb__f(void *,uint16_t,uint16_t);	/* byte at seg:off */
+
+typedef struct prof
+{
+  uint32_t           frame[PROF_DEPTH];	/* CS << 16 | IP, innermost first */
+  unsigned           depth;
+  unsigned long long count;
+} prof__s;
+
+typedef struct prof_table
+{
+  prof__s            *slot;	/* NULL when not profiling */
+  size_t              mask;
+  size_t              used;
+  unsigned long long  samples;
+  uint16_t            load;	/* segment the program was loaded at */
+} prof_table__s;
+
+typedef struct prof_flat
+{
+  uint32_t           addr;
+  unsigned long long self;
+  unsigned long long total;
+} prof_flat__s;
+
+/********************************************************************/
+
+/* load is where far return addresses start; false to stop */
+static inline int prof_init(prof_table__s *table,uint16_t load,bool on)
+{
+  free(table->slot);
+  memset(table,0,sizeof(prof_table__s));
+  if (!on)
+    return 0;
+  
+  table->slot = calloc(1024,sizeof(prof__s));
+  if (table->slot == NULL)
+  {
+    perror("calloc()");
+    return -1;
+  }
+  table->mask = 1023;
+  table->load = load;
+  return 0;
+}
+
+/* the instruction that ends at seg:off is a CALL, direct or FF /reg */
+static inline bool prof_call(prof_rb__f *rb,void *mem,uint16_t seg,uint16_t off,uint8_t direct,uint16_t len,uint8_t reg)
+{
+  for (uint16_t n = 2 ; n <= 4 ; n++)
+  {
+    uint8_t modrm = rb(mem,seg,off - n + 1);
+    uint8_t mod   = modrm >> 6;
+    
+    if ((rb(mem,seg,off - n) != 0xFF) || (((modrm >> 3) & 7) != reg))
+      continue;
+    if ((n == 2) && (((mod == 3) && (reg == 2)) || ((mod == 0) && ((modrm & 7) != 6))))
+      return true;
+    if ((n == 3) && (mod == 1))
+      return true;
+    if ((n == 4) && ((mod == 2) || ((mod == 0) && ((modrm & 7) == 6))))
+      return true;
+  }
+  
+  return rb(mem,seg,off - len) == direct;
+}
+
+static inline uint16_t prof_rw(prof_rb__f *rb,void *mem,uint16_t seg,uint16_t off)
+{
+  return rb(mem,seg,off) | (rb(mem,seg,off + 1) << 8);
+}
+
+static inline unsigned prof_walk(
+        const prof_table__s *table,
+        prof_rb__f          *rb,
+        void                *mem,
+        uint16_t             cs,
+        uint16_t             ip,
+        uint16_t             ss,
+        uint32_t             sp,
+        uint32_t            *frame
+)
+{
+  unsigned depth = 0;
+  
+  frame[depth++] = ((uint32_t)cs << 16) | ip;
+  
+  /* up to the top of the stack segment, and no further */
+  for (unsigned i = 0 ; (i < PROF_SCAN) && (depth < PROF_DEPTH) && (sp < 0xFFFF) ; i++ , sp += 2)
+  {
+    uint16_t off = prof_rw(rb,mem,ss,sp);
+    uint16_t seg = prof_rw(rb,mem,ss,sp + 2);
+    
+    if (
+            (sp < 0xFFFD)
+         && (seg >= table->load)
+         && (prof_call(rb,mem,seg,off,0x9A,5,3) || (rb(mem,seg,off - 2) == 0xCD))
+       )
+    {
+      frame[depth++] = ((uint32_t)seg << 16) | off;
+      cs             = seg;
+      sp            += 2;
+      i++;
+    }
+    else if (prof_call(rb,mem,cs,off,0xE8,3,2))
+      frame[depth++] = ((uint32_t)cs << 16) | off;
+  }
+  
+  return depth;
+}
+
+static inline size_t prof_hash(const uint32_t *frame,unsigned depth)
+{
+  uint64_t h = 0xCBF29CE484222325uLL;
+  
+  for (unsigned i = 0 ; i < depth ; i++)
+    h = (h ^ frame[i]) * 0x100000001B3uLL;
+  return h ^ (h >> 29);
+}
+
+static inline prof__s *prof_slot(prof__s *slots,size_t mask,const uint32_t *frame,unsigned depth)
+{
+  for (size_t i = prof_hash(frame,depth) ; ; i++)
+  {
+    prof__s *p = &slots[i & mask];
+    
+    if (p->count == 0)
+      return p;
+    if ((p->depth == depth) && (memcmp(p->frame,frame,depth * sizeof(uint32_t)) == 0))
+      return p;
+  }
+}
+
+/* one sample of the guest at cs:ip with its stack at ss:sp */
+static inline void prof_sample(
+        prof_table__s *table,
+        prof_rb__f    *rb,
+        void          *mem,
+        uint16_t       cs,
+        uint16_t       ip,
+        uint16_t       ss,
+        uint16_t       sp
+)
+{
+  uint32_t  frame[PROF_DEPTH];
+  unsigned  depth = prof_walk(table,rb,mem,cs,ip,ss,sp,frame);
+  prof__s  *p;
+  
+  table->samples++;
+  
+  if ((table->used + 1) * 2 > table->mask + 1)
+  {
+    size_t   mask  = table->mask * 2 + 1;
+    prof__s *slots = calloc(mask + 1,sizeof(prof__s));
+    
+    if (slots == NULL)
+      return;
+    for (size_t i = 0 ; i <= table->mask ; i++)
+      if (table->slot[i].count > 0)
+        *prof_slot(slots,mask,table->slot[i].frame,table->slot[i].depth) = table->slot[i];
+    free(table->slot);
+    table->slot = slots;
+    table->mask = mask;
+  }
+  
+  p = prof_slot(table->slot,table->mask,frame,depth);
+  if (p->count == 0)
+  {
+    memcpy(p->frame,frame,sizeof(frame));
+    p->depth = depth;
+    table->used++;
+  }
+  p->count++;
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Frames are written as segment:offset with the segment relative to where
+; the program was loaded, like a linker's map file has them.  The folded
+; stacks are outermost first, as flamegraph.pl wants them.  In the flat
+; profile, self is samples taken there and total samples with it anywhere
+; on the stack, and every says how often a sample was taken.
+;---------------------------------------------------------------------*/
+
+static inline int prof_by_addr(const void *a,const void *b)
+{
+  const prof_flat__s *x = a;
+  const prof_flat__s *y = b;
+  
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static inline int prof_by_count(const void *a,const void *b)
+{
+  const prof_flat__s *x = a;
+  const prof_flat__s *y = b;
+  
+  if (x->self != y->self)
+    return (x->self < y->self) - (x->self > y->self);
+  if (x->total != y->total)
+    return (x->total < y->total) - (x->total > y->total);
+  return prof_by_addr(a,b);
+}
+
+static inline void prof_frame(const prof_table__s *table,FILE *fp,uint32_t frame)
+{
+  fprintf(fp,"%04X:%04X",(uint16_t)((frame >> 16) - table->load),frame & 0xFFFF);
+}
+
+/* either FILE can be NULL */
+static inline int prof_write(const prof_table__s *table,FILE *folded,FILE *flat,const char *every)
+{
+  prof_flat__s *f;
+  size_t        n = 0;
+  size_t        m = 0;
+  
+  if (table->slot == NULL)
+    return -1;
+  
+  for (size_t i = 0 ; (folded != NULL) && (i <= table->mask) ; i++)
+  {
+    const prof__s *p = &table->slot[i];
+    
+    if (p->count == 0)
+      continue;
+    for (unsigned d = p->depth ; d-- > 0 ; )
+    {
+      prof_frame(table,folded,p->frame[d]);
+      fputc(d > 0 ? ';' : ' ',folded);
+    }
+    fprintf(folded,"%llu\n",p->count);
+  }
+  
+  if (flat == NULL)
+    return 0;
+  
+  f = calloc(table->used * PROF_DEPTH + 1,sizeof(prof_flat__s));
+  if (f == NULL)
+  {
+    perror("calloc()");
+    return -1;
+  }
+  
+  /* a frame for every address on every stack, counted once a stack */
+  for (size_t i = 0 ; i <= table->mask ; i++)
+  {
+    const prof__s *p = &table->slot[i];
+    
+    for (unsigned d = 0 ; (p->count > 0) && (d < p->depth) ; d++)
+    {
+      bool seen = false;
+      
+      for (unsigned e = 0 ; e < d ; e++)
+        seen |= p->frame[e] == p->frame[d];
+      if (seen)
+        continue;
+      f[n].addr  = p->frame[d];
+      f[n].self  = (d == 0) ? p->count : 0;
+      f[n].total = p->count;
+      n++;
+    }
+  }
+  
+  qsort(f,n,sizeof(prof_flat__s),prof_by_addr);
+  for (size_t i = 0 ; i < n ; i++)
+  {
+    if ((m > 0) && (f[m - 1].addr == f[i].addr))
+    {
+      f[m - 1].self  += f[i].self;
+      f[m - 1].total += f[i].total;
+    }
+    else
+      f[m++] = f[i];
+  }
+  qsort(f,m,sizeof(prof_flat__s),prof_by_count);
+  
+  fprintf(flat,"%llu samples, one every %s\n\n",table->samples,every);
+  fprintf(flat,"%10s %7s %10s %7s  %s\n","self","%","total","%","CS:IP");
+  for (size_t i = 0 ; i < m ; i++)
+  {
+    fprintf(
+      flat,
+      "%10llu %6.2f%% %10llu %6.2f%%  ",
+      f[i].self,
+      100.0 * f[i].self / table->samples,
+      f[i].total,
+      100.0 * f[i].total / table->samples
+    );
+    prof_frame(table,flat,f[i].addr);
+    fputc('\n',flat);
+  }
+  
+  free(f);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,347 @@
+#!/usr/bin/env python3
+"""
+Microbenchmarks for the DOS emulator
+
+Builds synthetic COM programs (hand-assembled, like the ones in
+test_runner.py), runs each on every backend there is, and prints the
+results as JSON on stdout, for keeping alongside the commit they're from:
+
+    make bench > bench-$(git rev-parse --short HEAD).json
+
+Backends are the interpreter (msdos_fixes), its JIT (msdos_fixes -j) and
+vm86 (msdos), each if it's there and works on this host.  A program a
+backend can't run (msdos has no AH=14h for the FCB one) goes under
+"skipped" with the reason, and the rest still run.  For every program
+and backend:
+
+    seconds          best of RUNS, less what the empty program takes
+    ns_per_op        per operation (an iteration, element, call or record)
+    mips             guest instructions a second (REP MOVSW is one)
+    ns_per_int21     for the programs that are mostly DOS calls
+    syscalls_per_op  read and write system calls, from /proc/self/io
+
+Instruction and INT 21h counts come from the interpreter (-s and
+--trace); the guest is the same on every backend.  SCALE multiplies the
+work, RUNS is how many times each is timed.
+"""
+
+import json
+import os
+import platform
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+RUNS = int(os.environ.get("RUNS", "3"))
+SCALE = float(os.environ.get("SCALE", "1"))
+MSDOS = os.path.abspath(os.environ.get("MSDOS", "../msdos_fixes"))
+VM86 = os.path.abspath(os.environ.get("VM86", "../msdos"))
+
+FCB_RECORDS = 4000      # records the FCB program reads each time round
+FCB_FILE = "BENCH.DAT"
+
+
+def le16(n):
+    return list(struct.pack("<H", n))
+
+
+def outer(n):
+    return max(1, min(65535, int(n * SCALE)))
+
+
+def empty():
+    return bytes([
+        0xB8, 0x00, 0x4C,  # MOV AX, 4C00h
+        0xCD, 0x21,        # INT 21h
+    ])
+
+
+def alu(n):
+    return bytes([
+        0xBA, *le16(n),    # MOV DX, n
+        0xB9, 0xFF, 0xFF,  # MOV CX, FFFFh
+        0x01, 0xD8,        # ADD AX, BX
+        0x31, 0xC3,        # XOR BX, AX
+        0x11, 0xC6,        # ADC SI, AX
+        0xD1, 0xE7,        # SHL DI, 1
+        0x45,              # INC BP
+        0xE2, 0xF5,        # LOOP -11
+        0x4A,              # DEC DX
+        0x75, 0xEF,        # JNZ -17
+        0xB8, 0x00, 0x4C,  # MOV AX, 4C00h
+        0xCD, 0x21,        # INT 21h
+    ])
+
+
+def string(n):
+    return bytes([
+        0x1E,              # PUSH DS
+        0x07,              # POP ES
+        0xFC,              # CLD
+        0xBA, *le16(n),    # MOV DX, n
+        0xBE, 0x00, 0x10,  # MOV SI, 1000h
+        0xBF, 0x00, 0x50,  # MOV DI, 5000h
+        0xB9, 0x00, 0x20,  # MOV CX, 2000h
+        0xF3, 0xA5,        # REP MOVSW
+        0xBF, 0x00, 0x90,  # MOV DI, 9000h
+        0xB9, 0x00, 0x20,  # MOV CX, 2000h
+        0xB8, 0x34, 0x12,  # MOV AX, 1234h
+        0xF3, 0xAB,        # REP STOSW
+        0xBE, 0x00, 0x10,  # MOV SI, 1000h
+        0xBF, 0x00, 0x50,  # MOV DI, 5000h
+        0xB9, 0x00, 0x40,  # MOV CX, 4000h
+        0xF3, 0xA6,        # REPE CMPSB
+        0x4A,              # DEC DX
+        0x75, 0xDC,        # JNZ -36
+        0xB8, 0x00, 0x4C,  # MOV AX, 4C00h
+        0xCD, 0x21,        # INT 21h
+    ])
+
+
+def memory(n):
+    # every word of 3000:0000 to 9000:FFFF, clear of the program at 2000h
+    return bytes([
+        0xBA, *le16(n),          # MOV DX, n
+        0xBB, 0x00, 0x30,        # MOV BX, 3000h
+        0x8E, 0xC3,              # MOV ES, BX
+        0x31, 0xFF,              # XOR DI, DI
+        0xB9, 0xFF, 0x7F,        # MOV CX, 7FFFh
+        0x26, 0x01, 0x05,        # ADD ES:[DI], AX
+        0x26, 0x8B, 0x45, 0x02,  # MOV AX, ES:[DI+2]
+        0x47,                    # INC DI
+        0x47,                    # INC DI
+        0xE2, 0xF5,              # LOOP -11
+        0x81, 0xC3, 0x00, 0x10,  # ADD BX, 1000h
+        0x81, 0xFB, 0x00, 0xA0,  # CMP BX, A000h
+        0x72, 0xE4,              # JB -28
+        0x4A,                    # DEC DX
+        0x75, 0xDE,              # JNZ -34
+        0xB8, 0x00, 0x4C,        # MOV AX, 4C00h
+        0xCD, 0x21,              # INT 21h
+    ])
+
+
+def farcall(n):
+    return bytes([
+        0x8C, 0x0E, 0x21, 0x01,              # MOV [0121h], CS
+        0xC7, 0x06, 0x1F, 0x01, 0x1E, 0x01,  # MOV WORD [011Fh], 011Eh
+        0xBA, *le16(n),                      # MOV DX, n
+        0xB9, 0xFF, 0xFF,                    # MOV CX, FFFFh
+        0xFF, 0x1E, 0x1F, 0x01,              # CALL FAR [011Fh]
+        0xE2, 0xFA,                          # LOOP -6
+        0x4A,                                # DEC DX
+        0x75, 0xF4,                          # JNZ -12
+        0xB8, 0x00, 0x4C,                    # MOV AX, 4C00h
+        0xCD, 0x21,                          # INT 21h
+        0xCB,                                # 011Eh: RETF
+        0x00, 0x00, 0x00, 0x00,              # 011Fh: the far pointer
+    ])
+
+
+def console(n):
+    return bytes([
+        0xBE, *le16(n),    # MOV SI, n
+        0xB9, 0xFF, 0xFF,  # MOV CX, FFFFh
+        0xB4, 0x02,        # MOV AH, 02h
+        0xB2, 0x2E,        # MOV DL, '.'
+        0xCD, 0x21,        # INT 21h
+        0xB4, 0x09,        # MOV AH, 09h
+        0xBA, 0x1D, 0x01,  # MOV DX, 011Dh
+        0xCD, 0x21,        # INT 21h
+        0xE2, 0xF1,        # LOOP -15
+        0x4E,              # DEC SI
+        0x75, 0xEB,        # JNZ -21
+        0xB8, 0x00, 0x4C,  # MOV AX, 4C00h
+        0xCD, 0x21,        # INT 21h
+        *b'the quick brown fox\r\n$',
+    ])
+
+
+def fcb(n):
+    return bytes([
+        0xB4, 0x1A,                    # MOV AH, 1Ah
+        0xBA, 0x50, 0x01,              # MOV DX, 0150h (DTA)
+        0xCD, 0x21,                    # INT 21h
+        0xBE, *le16(n),                # MOV SI, n
+        0xB4, 0x0F,                    # MOV AH, 0Fh
+        0xBA, 0x2B, 0x01,              # MOV DX, 012Bh (FCB)
+        0xCD, 0x21,                    # INT 21h
+        0xC6, 0x06, 0x4B, 0x01, 0x00,  # MOV BYTE [014Bh], 0 (current record)
+        0xB9, *le16(FCB_RECORDS),      # MOV CX, FCB_RECORDS
+        0xB4, 0x14,                    # MOV AH, 14h
+        0xCD, 0x21,                    # INT 21h
+        0xE2, 0xFA,                    # LOOP -6
+        0xB4, 0x10,                    # MOV AH, 10h
+        0xCD, 0x21,                    # INT 21h
+        0x4E,                          # DEC SI
+        0x75, 0xE4,                    # JNZ -28
+        0xB8, 0x00, 0x4C,              # MOV AX, 4C00h
+        0xCD, 0x21,                    # INT 21h
+        0x00, *b'BENCH   DAT',         # 012Bh: the FCB
+        *([0] * 25),
+    ])
+
+
+# name, program, operations, whether it's mostly INT 21h
+def workloads():
+    n = [outer(250), outer(200), outer(40), outer(80), outer(30), outer(100)]
+    return [
+        ("alu", alu(n[0]), n[0] * 65535, False),
+        ("string", string(n[1]), n[1] * (0x2000 + 0x2000 + 0x4000), False),
+        ("memory", memory(n[2]), n[2] * 7 * 0x7FFF, False),
+        ("farcall", farcall(n[3]), n[3] * 65535, False),
+        ("console", console(n[4]), n[4] * 65535, True),
+        ("fcb", fcb(n[5]), n[5] * FCB_RECORDS, True),
+    ]
+
+
+def io_calls():
+    calls = 0
+    with open("/proc/self/io") as f:
+        for line in f:
+            key, value = line.split(":")
+            if key in ("syscr", "syscw"):
+                calls += int(value)
+    return calls
+
+
+def run(cmd, program):
+    """Wall time and read/write system calls of one run"""
+    before = io_calls()
+    start = time.perf_counter()
+    result = subprocess.run(
+        cmd + [program],
+        stdin=subprocess.DEVNULL,
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+        timeout=300,
+    )
+    elapsed = time.perf_counter() - start
+    if result.returncode != 0:
+        raise RuntimeError(f"{' '.join(cmd)} {program} exited {result.returncode}")
+    return elapsed, io_calls() - before
+
+
+def best(cmd, program):
+    times = []
+    calls = None
+    for _ in range(RUNS):
+        elapsed, calls = run(cmd, program)
+        times.append(elapsed)
+    return min(times), calls
+
+
+def counts(program):
+    """Guest instructions and INT 21h calls, from the interpreter"""
+    result = subprocess.run(
+        [MSDOS, program, "-s", "--trace", "counts.trc"],
+        stdin=subprocess.DEVNULL,
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.PIPE,
+        text=True,
+        timeout=300,
+    )
+    insns = 0
+    for line in result.stderr.splitlines():
+        if line.startswith("instructions:"):
+            insns = int(line.split()[1])
+    with open("counts.trc", "rb") as f:
+        calls = struct.unpack("<Q", f.read(32)[24:32])[0]
+    os.remove("counts.trc")
+    return insns, calls
+
+
+def backends():
+    found = []
+    skipped = []
+    if os.access(MSDOS, os.X_OK):
+        found.append(("interpreter", [MSDOS]))
+        if platform.machine() == "x86_64":
+            found.append(("jit", [MSDOS, "-j"]))
+        else:
+            skipped.append({"backend": "jit", "reason": "not x86_64"})
+    else:
+        skipped.append({"backend": "interpreter", "reason": f"no {MSDOS}"})
+
+    # vm86 only works on a 32-bit x86 kernel that allows it
+    if not os.access(VM86, os.X_OK):
+        skipped.append({"backend": "vm86", "reason": f"no {VM86}"})
+    elif os.path.realpath(VM86) == os.path.realpath(MSDOS):
+        skipped.append({"backend": "vm86", "reason": f"{VM86} is the interpreter"})
+    else:
+        try:
+            run([VM86], "empty.com")
+            found.append(("vm86", [VM86]))
+        except (RuntimeError, OSError, subprocess.TimeoutExpired) as e:
+            skipped.append({"backend": "vm86", "reason": str(e)})
+    return found, skipped
+
+
+def main():
+    work = tempfile.mkdtemp(prefix="msdos-bench-")
+    os.chdir(work)
+    try:
+        with open("empty.com", "wb") as f:
+            f.write(empty())
+        with open(FCB_FILE, "wb") as f:
+            f.write(os.urandom(FCB_RECORDS * 128))
+
+        found, skipped = backends()
+        if not found:
+            print("Error: no backend to run (make msdos_fixes first)", file=sys.stderr)
+            return 1
+
+        # less starting up and exiting, as with the times
+        base_insns, base_calls = counts("empty.com")
+        programs = []
+        for name, code, ops, dos in workloads():
+            with open(name + ".com", "wb") as f:
+                f.write(code)
+            insns, calls = counts(name + ".com")
+            programs.append((name, ops, dos, insns - base_insns, calls - base_calls))
+
+        results = []
+        for backend, cmd in found:
+            base_time, base_io = best(cmd, "empty.com")
+            for name, ops, dos, insns, calls in programs:
+                print(f"{backend} {name}...", file=sys.stderr)
+                try:
+                    elapsed, io = best(cmd, name + ".com")
+                except (RuntimeError, OSError, subprocess.TimeoutExpired) as e:
+                    skipped.append({"backend": backend, "workload": name, "reason": str(e)})
+                    continue
+                secs = max(elapsed - base_time, 1e-9)
+                results.append({
+                    "backend": backend,
+                    "workload": name,
+                    "ops": ops,
+                    "instructions": insns,
+                    "int21": calls,
+                    "seconds": round(secs, 6),
+                    "ns_per_op": round(secs * 1e9 / ops, 3),
+                    "mips": round(insns / secs / 1e6, 3),
+                    "ns_per_int21": round(secs * 1e9 / calls, 3) if dos else None,
+                    "syscalls_per_op": round(max(io - base_io, 0) / ops, 6),
+                })
+
+        report = {
+            "date": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+            "host": platform.node(),
+            "machine": platform.machine(),
+            "runs": RUNS,
+            "scale": SCALE,
+            "results": results,
+            "skipped": skipped,
+        }
+        print(json.dumps(report, indent=2))
+        return 0
+    finally:
+        os.chdir("/")
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
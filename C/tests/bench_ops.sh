@@ -0,0 +1,76 @@
+#!/bin/bash
+# Per-opcode microbenchmark for the portable emulator
+#
+# Each case runs 16 copies of one instruction inside a LOOP, OUTER times
+# around 65535 iterations, and reports nanoseconds per guest instruction
+# (the LOOP/DEC/JNZ overhead is counted as instructions too), best of RUNS.
+# Run it against two builds to compare them:
+#
+#	MSDOS=/tmp/old/msdos_fixes ./bench_ops.sh
+#	MSDOS=../msdos_fixes ./bench_ops.sh -j
+
+set -e
+
+MSDOS=${MSDOS:-../msdos_fixes}
+OUTER=${OUTER:-20}
+RUNS=${RUNS:-3}
+
+if [ ! -x "$MSDOS" ]; then
+    echo "Error: $MSDOS not found (make msdos_fixes first)"
+    exit 1
+fi
+
+# name and the bytes of one copy of the instruction
+cases=(
+    "mov_r16_r16:\x89\xD8"
+    "mov_r8_r8:\x88\xE3"
+    "mov_r16_m16:\x8B\x1E\x00\x80"
+    "mov_m16_r16:\x89\x1E\x00\x80"
+    "push_pop:\x53\x5B"
+    "add_r16_r16:\x01\xD8"
+    "add_r8_imm:\x80\xC3\x05"
+    "sub_r16_imm:\x83\xEE\x03"
+    "xor_r16_r16:\x31\xD8"
+    "adc_r16_r16:\x11\xD8"
+    "inc_r16:\x40"
+    "shl_r16_1:\xD1\xE0"
+    "cmp_jz:\x39\xD8\x74\x00"
+    "cmp_jb:\x3C\x20\x72\x00"
+    "add_m16_r16:\x01\x1E\x00\x80"
+)
+
+hex()
+{
+    printf '\\x%02X' "$1"
+}
+
+printf "%-14s %10s %8s\n" "case" "insns" "ns/insn"
+
+for c in "${cases[@]}"; do
+    name=${c%%:*}
+    op=${c#*:}
+    body=""
+    for i in $(seq 16); do
+        body="$body$op"
+    done
+    len=$(printf "$body" | wc -c)
+
+    # MOV DX,OUTER / MOV CX,FFFF / body / LOOP / DEC DX / JNZ / MOV AH,4C / INT 21
+    loop=$(hex $(( (256 - len - 2) & 0xFF )))
+    jnz=$(hex $(( (256 - len - 2 - 3 - 3) & 0xFF )))
+    printf "\xBA$(hex $((OUTER & 0xFF)))$(hex $((OUTER >> 8)))\xB9\xFF\xFF$body\xE2$loop\x4A\x75$jnz\xB4\x4C\xCD\x21" > bench_$name.com
+
+    best=0
+    for r in $(seq $RUNS); do
+        start=$(date +%s%N)
+        insns=$($MSDOS bench_$name.com -s "$@" 2>&1 >/dev/null | sed -n 's/^instructions: *//p')
+        end=$(date +%s%N)
+        if [ $best -eq 0 ] || [ $((end - start)) -lt $best ]; then
+            best=$((end - start))
+        fi
+    done
+    rm -f bench_$name.com
+
+    awk -v n="$name" -v i="$insns" -v t=$best \
+        'BEGIN { printf "%-14s %10d %8.2f\n", n, i, t / i }'
+done
@@ -0,0 +1,94 @@
+#!/bin/bash
+# Startup-time benchmark for the portable emulator's loader
+#
+# Builds an EXE about the size of RACTER.EXE (SIZE bytes of image, RELOCS
+# relocations) that exits as soon as it starts, and reports the mean wall
+# time of RUNS starts, in microseconds, for
+#
+#	plain	no --cache
+#	cold	--cache into an empty directory (relocate and save)
+#	cached	--cache with the image already there (map it)
+#
+#	MSDOS=../msdos_fixes ./bench_startup.sh
+
+set -e
+
+MSDOS=${MSDOS:-../msdos_fixes}
+RUNS=${RUNS:-200}
+SIZE=${SIZE:-131072}
+RELOCS=${RELOCS:-4096}
+
+if [ ! -x "$MSDOS" ]; then
+    echo "Error: $MSDOS not found (make msdos_fixes first)"
+    exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+le16()
+{
+    printf "\\x$(printf %02X $(($1 & 255)))\\x$(printf %02X $((($1 >> 8) & 255)))"
+}
+
+# header and relocation table, padded to a paragraph
+hdrpara=$(( (28 + RELOCS * 4 + 15) / 16 ))
+total=$(( hdrpara * 16 + SIZE ))
+{
+    printf 'MZ'
+    le16 $((total % 512))
+    le16 $(( (total + 511) / 512 ))
+    le16 $RELOCS
+    le16 $hdrpara
+    le16 0
+    le16 65535
+    le16 $((SIZE / 16))
+    le16 256
+    le16 0
+    le16 0
+    le16 0
+    le16 28
+    le16 0
+
+    # each one patches a word of its own after the code
+    for ((i = 0 ; i < RELOCS ; i++)); do
+        addr=$((16 + i * 2))
+        le16 $((addr & 15))
+        le16 $((addr >> 4))
+    done
+    head -c $((hdrpara * 16 - 28 - RELOCS * 4)) /dev/zero
+
+    # mov ax,4C00h; int 21h
+    printf '\xB8\x00\x4C\xCD\x21'
+    head -c $((SIZE - 5)) /dev/zero
+} > "$work/bench.exe"
+
+run()
+{
+    local start end
+
+    start=$(date +%s%N)
+    for ((i = 0 ; i < RUNS ; i++)); do
+        if [ "$2" = "cold" ]; then
+            "$MSDOS" "$work/bench.exe" --cache "$1/$i" </dev/null >/dev/null 2>&1
+        elif [ -n "$1" ]; then
+            "$MSDOS" "$work/bench.exe" --cache "$1" </dev/null >/dev/null 2>&1
+        else
+            "$MSDOS" "$work/bench.exe" </dev/null >/dev/null 2>&1
+        fi
+    done
+    end=$(date +%s%N)
+    echo $(( (end - start) / RUNS / 1000 ))
+}
+
+# a directory of its own for every cold start
+mkdir "$work/cache" "$work/cold"
+for ((i = 0 ; i < RUNS ; i++)); do
+    echo "$work/cold/$i"
+done | xargs mkdir
+
+printf "%-8s %10s\n" "load" "us/start"
+printf "%-8s %10s\n" "plain"  "$(run "" "")"
+printf "%-8s %10s\n" "cold"   "$(run "$work/cold" cold)"
+"$MSDOS" "$work/bench.exe" --cache "$work/cache" </dev/null >/dev/null 2>&1
+printf "%-8s %10s\n" "cached" "$(run "$work/cache" "")"
@@ -0,0 +1,233 @@
+/************************************************************************
+*
+* Copyright 2015 by Sean Conner.  All Rights Reserved.
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+* Comments, questions and criticisms can be sent to: sean@conman.org
+*
+*************************************************************************/
+
+/*---------------------------------------------------------------------
+; The INT 21h trace, for --trace in msdos and msdos_fixes, and the file
+; it's written to (see msdos_trace.c).  Times are in ticks of the host's
+; cheapest clock from when tracing started, and ticks of them went by in
+; ns nanoseconds up to the dump.  latency is how long the host took over
+; the call, and bytes how much it moved to or from the guest.  A call
+; that found no input sets TRACE_WAIT; msdos_fixes has the guest make it
+; again once there is some, and msdos waits inside the call.  icount is
+; the guest instructions run before it, which msdos can't count (0).
+;---------------------------------------------------------------------*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#define TRACE_MAGIC	"MSDOSTRC"
+#define TRACE_VERSION	1
+
+#define TRACE_CF	0x01	/* the call failed */
+#define TRACE_WAIT	0x02	/* ... or had to wait for input */
+
+typedef struct vm_trace_hdr
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t size;	/* sizeof(vm_trace__s) */
+  uint64_t count;	/* records that follow */
+  uint64_t total;	/* calls made, including ones overwritten */
+  uint64_t ticks;	/* clock ticks from vm_trace() to the dump */
+  uint64_t ns;		/* ... and how many ns that was */
+} vm_trace_hdr__s;
+
+typedef struct vm_trace
+{
+  uint64_t when;
+  uint64_t icount;
+  uint32_t latency;
+  uint32_t bytes;
+  uint16_t ax;
+  uint16_t bx;
+  uint16_t cx;
+  uint16_t dx;
+  uint16_t ds;
+  uint16_t ret;		/* AX afterwards */
+  uint16_t flags;
+  uint16_t pad;
+} vm_trace__s;
+
+/*---------------------------------------------------------------------
+; The last so many calls, a power of two of them.  Only the thread
+; running the guest writes it.  A record is filled in place between
+; trace_begin() and trace_end(), and total only goes up once it's
+; complete, so a dump from a signal handler never sees half of one.
+;---------------------------------------------------------------------*/
+
+typedef struct trace_ring
+{
+  vm_trace__s        *rec;	/* NULL when not tracing */
+  size_t              mask;
+  uint64_t            total;
+  unsigned long long  base;
+  unsigned long long  base_ns;
+} trace_ring__s;
+
+/********************************************************************/
+
+static inline unsigned long long trace_ns(void)
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1000000000uLL + ts.tv_nsec;
+}
+
+/* the time stamp counter on x86: one instruction against 20-odd ns */
+static inline unsigned long long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return trace_ns();
+#endif
+}
+
+/********************************************************************/
+
+/*---------------------------------------------------------------------
+; Room for at least so many records; 0 to stop.  trace_write() leaves out
+; the slot the next call goes into, so the ring needs one more than that
+; (a ring of one would never write anything).
+;---------------------------------------------------------------------*/
+
+static inline int trace_init(trace_ring__s *ring,size_t records)
+{
+  size_t size = 1;
+  
+  free(ring->rec);
+  memset(ring,0,sizeof(trace_ring__s));
+  if (records == 0)
+    return 0;
+  
+  while (size <= records)
+    size *= 2;
+  
+  ring->rec = calloc(size,sizeof(vm_trace__s));
+  if (ring->rec == NULL)
+  {
+    perror("calloc()");
+    return -1;
+  }
+  ring->mask    = size - 1;
+  ring->base    = trace_clock();
+  ring->base_ns = trace_ns();
+  return 0;
+}
+
+static inline vm_trace__s *trace_begin(trace_ring__s *ring,unsigned long long *start)
+{
+  vm_trace__s *t = &ring->rec[ring->total & ring->mask];
+  
+  *start  = trace_clock();
+  t->when = *start - ring->base;
+  return t;
+}
+
+static inline void trace_end(trace_ring__s *ring,vm_trace__s *t,unsigned long long start)
+{
+  unsigned long long took = trace_clock() - start;
+  
+  t->latency = (took > UINT32_MAX) ? UINT32_MAX : took;
+  t->pad     = 0;
+  __atomic_store_n(&ring->total,ring->total + 1,__ATOMIC_RELEASE);
+}
+
+/********************************************************************/
+
+static inline bool trace_write_all(int fd,const void *data,size_t size)
+{
+  const char *p = data;
+  
+  while (size > 0)
+  {
+    ssize_t bytes = write(fd,p,size);
+    
+    if (bytes < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p    += bytes;
+    size -= bytes;
+  }
+  
+  return true;
+}
+
+/*---------------------------------------------------------------------
+; Write the ring to a file descriptor, oldest first.  Only calls write(),
+; so it can be done from a signal handler.  Once the ring has gone all
+; the way round, the oldest slot is the one the next call goes into, and
+; the signal may have come in the middle of it, so that one is left out.
+;---------------------------------------------------------------------*/
+
+static inline int trace_write(const trace_ring__s *ring,int fd)
+{
+  vm_trace_hdr__s hdr;
+  uint64_t        total;
+  size_t          size;
+  size_t          first;
+  size_t          part;
+  
+  if (ring->rec == NULL)
+    return -1;
+  
+  total = __atomic_load_n(&ring->total,__ATOMIC_ACQUIRE);
+  size  = ring->mask + 1;
+  
+  memset(&hdr,0,sizeof(hdr));
+  memcpy(hdr.magic,TRACE_MAGIC,sizeof(hdr.magic));
+  hdr.version = TRACE_VERSION;
+  hdr.size    = sizeof(vm_trace__s);
+  hdr.count   = (total < size) ? total : size - 1;
+  hdr.total   = total;
+  hdr.ticks   = trace_clock() - ring->base;
+  hdr.ns      = trace_ns() - ring->base_ns;
+  
+  first = (total - hdr.count) & ring->mask;
+  part  = (first + hdr.count > size) ? size - first : hdr.count;
+  
+  if (
+          !trace_write_all(fd,&hdr,sizeof(hdr))
+       || !trace_write_all(fd,&ring->rec[first],part * sizeof(vm_trace__s))
+       || !trace_write_all(fd,ring->rec,(hdr.count - part) * sizeof(vm_trace__s))
+     )
+    return -1;
+  
+  return 0;
+}
+
+#endif
@@ -126,6 +126,10 @@ if racterid == 0 then
   signal.default('int')
   signal.default('child')
   fsys.chdir("/tmp/racter")
+  
+  -- Racter starts from whatever IV.C holds.  With --base its writes go
+  -- to a copy in memory, so emptying this one here is still safe.
+  
   io.open("IV.C","w"):close()
   local stdout = io.open("/tmp/racter.stderr","w")
   
@@ -144,7 +148,7 @@ if racterid == 0 then
   from_eliza.read:close()
   from_eliza.write:close()
   
-  process.exec("./C/msdos",{ "/tmp/racter/RACTER.EXE" })
+  process.exec("./C/msdos",{ "/tmp/racter/RACTER.EXE" , "--base" , "/tmp/racter" })
   process.exit(9)
 else
   print("RACTER",racterid)